@@ -0,0 +1,95 @@
+/*
+carrier-dither.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "macros.h"
+#include "clock-control.h"
+#include "timestamp.h"
+#include "carrier-dither.h"
+
+
+// Real transmitters reduce the carrier during low periods rather than
+// switching it off (DCF77 to ~15%, MSF and WWVB by ~17 dB). We approximate
+// this by keying the pin mux with a first order sigma-delta modulator. The
+// antenna and receiver filters average the resulting on/off pattern, so the
+// carrier amplitude they see is the fraction of time the output is on.
+void dither_carrier_until(CARRIER_DITHER *pDither, const struct timespec *pTarget)
+{
+  int64_t startNs = timestamp_now_ns();
+  int64_t nowNs;
+  int64_t targetNs = TIMESPEC_TO_NS(*pTarget);
+  int64_t stepNs = NSEC_PER_SEC / pDither->rateHz;
+
+  if (targetNs <= startNs)
+    return;
+
+  // Steps are aligned to the target so the last one ends exactly on it.
+  // The partial step at the start is left off, as the caller just keyed off.
+  int64_t firstBoundaryNs = targetNs - ((targetNs - startNs) / stepNs) * stepNs;
+  bool on = false;
+  int64_t onStartNs = 0;
+
+  for (int64_t boundaryNs = firstBoundaryNs; boundaryNs < targetNs; boundaryNs += stepNs)
+  {
+    struct timespec targetWait = NS_TO_TIMESPEC(boundaryNs);
+    clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+
+    pDither->accumulator += pDither->level;
+    bool want = (pDither->accumulator >= 1.0);
+    if (want)
+      pDither->accumulator -= 1.0;
+
+    if (want != on)
+    {
+      enable_clock_output(pDither->output, want);
+      nowNs = timestamp_now_ns();
+
+      if (want)
+        onStartNs = nowNs;
+      else
+        pDither->onTimeNs += nowNs - onStartNs;
+
+      on = want;
+    }
+    else
+    {
+      nowNs = timestamp_now_ns();
+    }
+
+    pDither->steps++;
+    if (nowNs > boundaryNs + stepNs)
+      pDither->lateSteps++;
+  }
+
+  struct timespec targetWait = *pTarget;
+  clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+  nowNs = timestamp_now_ns();
+
+  if (on)
+    pDither->onTimeNs += nowNs - onStartNs;
+
+  pDither->lowTimeNs += nowNs - startNs;
+}
@@ -0,0 +1,44 @@
+/*
+carrier-dither.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __CARRIER_DITHER_H__
+#define __CARRIER_DITHER_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "clock-control.h"
+
+typedef struct
+{
+  enum ClockOutput output;  // Clock output being dithered
+  double level;         // Target carrier level during low periods (0 to 1)
+  uint32_t rateHz;      // Dither step rate
+  double accumulator;   // Sigma-delta state carried between low periods
+  uint64_t steps;       // Dither steps taken
+  uint64_t lateSteps;   // Steps that woke after the following step was due
+  int64_t onTimeNs;     // Measured carrier on time during low periods
+  int64_t lowTimeNs;    // Measured total low period time
+} CARRIER_DITHER;
+
+void dither_carrier_until(CARRIER_DITHER *pDither, const struct timespec *pTarget);
+
+#endif  // __CARRIER_DITHER_H__
@@ -38,6 +38,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <float.h>
 #include <math.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/mman.h>
 #include "macros.h"
 #include "clock-control.h"
@@ -47,16 +48,27 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define BCM2709_PERI_BASE     0x3f000000    // BCM2836 - Model 2
 #define BCM2710_PERI_BASE     0x3f000000    // BCM2837 - Model 3
 #define BCM2711_PERI_BASE     0xfe000000    // Model 4
-#define BCM2712_PERI_BASE     0x1f000d0000  // Model 5
+#define RP1_PERI_BASE         0x1f00000000  // Model 5 (RP1 peripherals through PCIe BAR1)
+
+#define BCM_BUS_PERI_BASE     0x7e000000    // Peripheral base as seen by DMA
 
 #define GPIO_REGISTER_OFFSET  0x00200000
 #define CLOCK_REGISTER_OFFSET 0x00101000
+#define TIMER_REGISTER_OFFSET 0x00003000  // Free-running 1 MHz system timer
+
+#define RP1_CLOCK_REGISTER_OFFSET 0x00018000  // clocks_main
+#define RP1_GPIO_REGISTER_OFFSET  0x000d0000  // io_bank0
+#define RP1_PADS_REGISTER_OFFSET  0x000f0000  // pads_bank0
 
 // GPIO Register Word Offsets
 #define GPIO_GPFSEL_OFFSET 0
 #define GPIO_GPSET_OFFSET  7
 #define GPIO_GPCLR_OFFSET  10
 
+// System Timer Register Offsets (32-bit word offsets)
+#define TIMER_CLO_OFFSET 1
+#define TIMER_CHI_OFFSET 2
+
 // Clock Control Register Word Offsets
 #define CLK_GP0CTL 28
 #define CLK_GP0DIV 29
@@ -67,12 +79,38 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define CLK_GP2CTL 32
 #define CLK_GP2DIV 33
 
-// GPIO Setup Macros
-// Note: Always call GPIO_INPUT() to clear register bits
-//       before calling GPIO_OUTPUT() or GPIO_ALT0().
-#define GPIO_INPUT(x)  *(_pGpioVirtMem + GPIO_GPFSEL_OFFSET + ((x) / 10)) &= ~(7 << (((x) % 10) * 3))
-#define GPIO_OUTPUT(x) *(_pGpioVirtMem + GPIO_GPFSEL_OFFSET + ((x) / 10)) |=  (1 << (((x) % 10) * 3))
-#define GPIO_ALT0(x)   *(_pGpioVirtMem + GPIO_GPFSEL_OFFSET + ((x) / 10)) |=  (4 << (((x) % 10) * 3))
+#define CLK_PWMCTL 40
+#define CLK_PWMDIV 41
+
+// GPIO Function Select Macros
+// These compute a new GPFSEL register value from an existing one.
+#define GPIO_FSEL_REGISTER(x) (GPIO_GPFSEL_OFFSET + ((x) / 10))
+#define GPIO_FSEL_INPUT(v, x)  ((v) & ~(7 << (((x) % 10) * 3)))
+#define GPIO_FSEL_OUTPUT(v, x) (GPIO_FSEL_INPUT(v, x) | (1 << (((x) % 10) * 3)))
+#define GPIO_FSEL_ALT0(v, x)   (GPIO_FSEL_INPUT(v, x) | (4 << (((x) % 10) * 3)))
+
+// RP1 Register Word Offsets
+// Reference: https://datasheets.raspberrypi.com/rp1/rp1-peripherals.pdf
+#define RP1_GPIO_CTRL(x)       ((x) * 2 + 1)
+#define RP1_PADS_GPIO(x)       ((x) + 1)
+#define RP1_CLK_GPCLK_OE_CTRL  0
+#define RP1_CLK_GP_CTRL(x)     (20 + (x) * 4)
+#define RP1_CLK_GP_DIV_INT(x)  (21 + (x) * 4)
+#define RP1_CLK_GP_DIV_FRAC(x) (22 + (x) * 4)
+
+// RP1 Register Macros
+#define RP1_GPIO_FUNCSEL_MASK  0x1f
+#define RP1_GPIO_FUNCSEL_GPCLK 0  // GPCLK0-2 are function a0 of GPIO4-6
+#define RP1_PADS_OD            (1 << 7)
+#define RP1_PADS_IE            (1 << 6)
+#define RP1_CLK_CTRL_ENABLE    (1 << 11)
+#define RP1_CLK_CTRL_AUXSRC(x) ((x) << 5)
+#define RP1_CLK_AUXSRC_XOSC    0
+
+#define RP1_XOSC_FREQUENCY 50e6  // RP1 crystal oscillator
+#define RP1_DIV_FRAC_BITS  16    // RP1 divisors are 16.16 fixed point
+
+#define CLOCK_ADOPT_TOLERANCE 0.001  // Largest relative error of an adopted clock
 
 // GPIO Set/Clear Macros
 #define GPIO_SET(x)   *(_pGpioVirtMem + GPIO_GPSET_OFFSET + ((x) / 32)) = (1 << ((x) % 32))
@@ -94,18 +132,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 static enum RaspberryPiModel get_pi_model();
 static void update_clock_source_frequencies();
-static uint32_t *map_bcm_register(off_t registerOffset);
-
+static void write_register(volatile uint32_t *pRegister, uint32_t value);
+static void trace_register_write(volatile uint32_t *pRegister, uint32_t value);
+static double start_clock_rp1(enum ClockOutput output, uint32_t requestedFrequency);
+static double adopt_clock_rp1(enum ClockOutput output, uint32_t requestedFrequency);
+static void stop_clock_rp1(enum ClockOutput output);
+static void set_clock_outputs_rp1(uint32_t outputMask, uint32_t onMask);
 
-enum RaspberryPiModel
-{
-  PI_MODEL_1 = 1,
-  PI_MODEL_2 = 2,
-  PI_MODEL_3 = 3,
-  PI_MODEL_4 = 4,
-  PI_MODEL_5 = 5,
-  PI_MODEL_UNKNOWN = -1
-};
 
 typedef struct
 {
@@ -116,9 +149,37 @@ typedef struct
 } CLOCK_SOURCE;
 
 
+typedef struct
+{
+  int gpioPin;            // GPIO pin with the clock on ALT0
+  uint32_t ctlWord;       // Clock control register word offset
+  uint32_t divWord;       // Clock divisor register word offset
+} CLOCK_OUTPUT_PIN;
+
+
+// All clock output pins share GPFSEL0, so any combination
+// of them can be switched with a single register write.
+static const CLOCK_OUTPUT_PIN _clockOutputPins[CLOCK_OUTPUT_COUNT] =
+{
+  [CLOCK_OUTPUT_GP0] = { 4, CLK_GP0CTL, CLK_GP0DIV },
+  [CLOCK_OUTPUT_GP1] = { 5, CLK_GP1CTL, CLK_GP1DIV },
+  [CLOCK_OUTPUT_GP2] = { 6, CLK_GP2CTL, CLK_GP2DIV },
+};
+
 static enum RaspberryPiModel _piModel;
 static volatile uint32_t *_pGpioVirtMem;
 static volatile uint32_t *_pClockVirtMem;
+static volatile uint32_t *_pPadsVirtMem;  // RP1 only
+static volatile uint32_t *_pTimerVirtMem; // BCM only
+static bool _mockRegisters = false;
+static enum RaspberryPiModel _mockPiModel = PI_MODEL_3;
+static double _clockSourceFrequency[CLOCK_OUTPUT_COUNT];
+static const char *_clockSourceName[CLOCK_OUTPUT_COUNT];
+
+// Mock register write trace (ring buffer)
+#define REGISTER_TRACE_LENGTH 65536
+static REGISTER_WRITE _registerTrace[REGISTER_TRACE_LENGTH];
+static uint64_t _registerTraceHead = 0;
 
 // Reference: /sys/kernel/debug/clk/clk_summary
 static CLOCK_SOURCE _clockSources[] =
@@ -222,6 +283,22 @@ static void update_clock_source_frequencies()
   size_t len = 0;
   double freqValue = 0;
 
+  // Mock registers use the nominal Pi 3 clock frequencies.
+  if (_mockRegisters)
+  {
+    for (size_t i = 0; i < ARRAY_LENGTH(_clockSources); i++)
+    {
+      switch (_clockSources[i].clockSource)
+      {
+        case 1:  _clockSources[i].clockFrequency = 19.2e6; break;
+        case 6:  _clockSources[i].clockFrequency = 500e6;  break;
+        case 7:  _clockSources[i].clockFrequency = 216e6;  break;
+        default: _clockSources[i].clockFrequency = 0;      break;
+      }
+    }
+    return;
+  }
+
   for (size_t i = 0; i < ARRAY_LENGTH(_clockSources); i++)
   {
     strcpy(buffer, "/sys/kernel/debug/clk/");
@@ -261,9 +338,165 @@ static void update_clock_source_frequencies()
 }
 
 
-static uint32_t *map_bcm_register(off_t registerOffset)
+static void write_register(volatile uint32_t *pRegister, uint32_t value)
+{
+  *pRegister = value;
+
+  if (_mockRegisters)
+  {
+    // Mock BCM clock generators report busy as soon as they are enabled.
+    if (_piModel != PI_MODEL_5 &&
+        (pRegister == _pClockVirtMem + CLK_GP0CTL || pRegister == _pClockVirtMem + CLK_GP1CTL ||
+         pRegister == _pClockVirtMem + CLK_GP2CTL || pRegister == _pClockVirtMem + CLK_PWMCTL))
+    {
+      *pRegister = (value & CLK_CTL_ENAB) ? (value | CLK_CTL_BUSY) : (value & ~CLK_CTL_BUSY);
+    }
+
+    trace_register_write(pRegister, value);
+  }
+}
+
+
+static void trace_register_write(volatile uint32_t *pRegister, uint32_t value)
+{
+  uint64_t idx = __atomic_fetch_add(&_registerTraceHead, 1, __ATOMIC_ACQ_REL);
+  REGISTER_WRITE *pEntry = &_registerTrace[idx % REGISTER_TRACE_LENGTH];
+
+  clock_gettime(CLOCK_REALTIME, &pEntry->time);
+  pEntry->value = value;
+
+  if (pRegister >= _pGpioVirtMem && pRegister < _pGpioVirtMem + getpagesize() / sizeof(uint32_t))
+  {
+    pEntry->block = REGISTER_BLOCK_GPIO;
+    pEntry->word = pRegister - _pGpioVirtMem;
+  }
+  else if (pRegister >= _pPadsVirtMem && pRegister < _pPadsVirtMem + getpagesize() / sizeof(uint32_t))
+  {
+    pEntry->block = REGISTER_BLOCK_PADS;
+    pEntry->word = pRegister - _pPadsVirtMem;
+  }
+  else
+  {
+    pEntry->block = REGISTER_BLOCK_CLOCK;
+    pEntry->word = pRegister - _pClockVirtMem;
+  }
+}
+
+
+enum RaspberryPiModel get_detected_pi_model()
+{
+  return _piModel;
+}
+
+
+void use_mock_registers(bool enable, enum RaspberryPiModel mockModel)
+{
+  _mockRegisters = enable;
+  _mockPiModel = mockModel;
+}
+
+
+bool is_mock_registers()
+{
+  return _mockRegisters;
+}
+
+
+size_t read_register_trace(REGISTER_WRITE *buffTrace, size_t buffLen, uint64_t *pCursor)
+{
+  uint64_t head = __atomic_load_n(&_registerTraceHead, __ATOMIC_ACQUIRE);
+  size_t count = 0;
+
+  // Entries older than the ring buffer length have been overwritten.
+  if (head - *pCursor > REGISTER_TRACE_LENGTH)
+    *pCursor = head - REGISTER_TRACE_LENGTH;
+
+  while (*pCursor < head && count < buffLen)
+  {
+    buffTrace[count++] = _registerTrace[*pCursor % REGISTER_TRACE_LENGTH];
+    (*pCursor)++;
+  }
+
+  return count;
+}
+
+
+void mock_bus_write(uint32_t busAddress, uint32_t value)
+{
+  // Emulates a DMA engine write to a peripheral bus address.
+  uint32_t offset = busAddress - BCM_BUS_PERI_BASE;
+
+  if (offset >= GPIO_REGISTER_OFFSET && offset < GPIO_REGISTER_OFFSET + getpagesize())
+    write_register(_pGpioVirtMem + (offset - GPIO_REGISTER_OFFSET) / sizeof(uint32_t), value);
+  else if (offset >= CLOCK_REGISTER_OFFSET && offset < CLOCK_REGISTER_OFFSET + getpagesize())
+    write_register(_pClockVirtMem + (offset - CLOCK_REGISTER_OFFSET) / sizeof(uint32_t), value);
+}
+
+
+double trace_clock_divisor(const REGISTER_WRITE *pEntry, enum ClockOutput output)
+{
+  // RP1 splits the divisor over two registers. The fraction is always
+  // written first, so it is remembered until the integer part follows.
+  if (_piModel == PI_MODEL_5)
+  {
+    static uint32_t lastFrac[CLOCK_OUTPUT_COUNT];
+
+    if (pEntry->block != REGISTER_BLOCK_CLOCK)
+      return -1.0;
+
+    if (pEntry->word == RP1_CLK_GP_DIV_FRAC(output))
+      lastFrac[output] = pEntry->value;
+
+    if (pEntry->word != RP1_CLK_GP_DIV_INT(output))
+      return -1.0;
+
+    return pEntry->value + (lastFrac[output] >> (32 - RP1_DIV_FRAC_BITS)) / (double)(1 << RP1_DIV_FRAC_BITS);
+  }
+
+  if (pEntry->block != REGISTER_BLOCK_CLOCK || pEntry->word != _clockOutputPins[output].divWord)
+    return -1.0;
+
+  return ((pEntry->value >> 12) & 0xfff) + (pEntry->value & 0xfff) / 1024.0;
+}
+
+
+int trace_clock_output_state(const REGISTER_WRITE *pEntry, enum ClockOutput output)
+{
+  int pin = _clockOutputPins[output].gpioPin;
+  if (_piModel == PI_MODEL_5)
+  {
+    if (pEntry->block != REGISTER_BLOCK_PADS || pEntry->word != RP1_PADS_GPIO(pin))
+      return -1;
+
+    return !(pEntry->value & RP1_PADS_OD);
+  }
+
+  if (pEntry->block != REGISTER_BLOCK_GPIO || pEntry->word != GPIO_FSEL_REGISTER(pin))
+    return -1;
+
+  return ((pEntry->value >> ((pin % 10) * 3)) & 7) == 4;
+}
+
+
+volatile uint32_t *map_bcm_register(off_t registerOffset)
 {
   off_t baseAddress = 0;
+
+  // Mock registers are backed by anonymous memory so that
+  // register level code can run on machines without a BCM SoC.
+  if (_mockRegisters)
+  {
+    uint32_t *pMockMem = (uint32_t*)mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pMockMem == MAP_FAILED)
+    {
+      perror("Failed to allocate mock registers");
+      return NULL;
+    }
+
+    return pMockMem;
+  }
+
   switch (_piModel)
   {
     case PI_MODEL_1:
@@ -282,6 +515,10 @@ static uint32_t *map_bcm_register(off_t registerOffset)
       baseAddress = BCM2711_PERI_BASE;
       break;
 
+    case PI_MODEL_5:
+      baseAddress = RP1_PERI_BASE;
+      break;
+
     default:
       fprintf(stderr, "Error: Raspberry Pi model not supported. (%d)\n", _piModel);
       return NULL;
@@ -316,13 +553,28 @@ static uint32_t *map_bcm_register(off_t registerOffset)
 
 bool gpio_init()
 {
-  _piModel = get_pi_model();
+  _piModel = _mockRegisters ? _mockPiModel : get_pi_model();
   if (_piModel == PI_MODEL_UNKNOWN)
   {
     fprintf(stderr, "Error: Raspberry Pi model not supported.\n");
     return false;
   }
 
+  // The Pi 5 clock and GPIO blocks are in the RP1 I/O controller.
+  if (_piModel == PI_MODEL_5)
+  {
+    _pGpioVirtMem = map_bcm_register(RP1_GPIO_REGISTER_OFFSET);
+    _pPadsVirtMem = map_bcm_register(RP1_PADS_REGISTER_OFFSET);
+    _pClockVirtMem = map_bcm_register(RP1_CLOCK_REGISTER_OFFSET);
+    if (_pGpioVirtMem == NULL || _pPadsVirtMem == NULL || _pClockVirtMem == NULL)
+    {
+      fprintf(stderr, "Failed to map RP1 registers. Ensure program is run with root privileges.\n");
+      return false;
+    }
+
+    return true;
+  }
+
   _pGpioVirtMem = map_bcm_register(GPIO_REGISTER_OFFSET);
   if (_pGpioVirtMem == NULL)
   {
@@ -336,13 +588,51 @@ bool gpio_init()
     fprintf(stderr, "Failed to map clock registers. Ensure program is run with root privileges.\n");
     return false;
   }
+
+  _pTimerVirtMem = map_bcm_register(TIMER_REGISTER_OFFSET);
+  if (_pTimerVirtMem == NULL)
+  {
+    fprintf(stderr, "Failed to map system timer registers. Ensure program is run with root privileges.\n");
+    return false;
+  }
   
   return true;
 }
 
 
-double start_clock(uint32_t requestedFrequency)
+bool read_system_timer(uint64_t *pTicks)
 {
+  // Reads the 64-bit microsecond count of the BCM system timer. Mock
+  // registers can't count, so a mock timer runs from CLOCK_MONOTONIC.
+  if (_pTimerVirtMem == NULL)
+    return false;
+
+  if (_mockRegisters)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *pTicks = TIMESPEC_TO_NS(now) / 1000;
+    return true;
+  }
+
+  // The high word is read again in case the low word wrapped in between.
+  uint32_t high, low;
+  do
+  {
+    high = _pTimerVirtMem[TIMER_CHI_OFFSET];
+    low = _pTimerVirtMem[TIMER_CLO_OFFSET];
+  } while (high != _pTimerVirtMem[TIMER_CHI_OFFSET]);
+
+  *pTicks = ((uint64_t)high << 32) | low;
+  return true;
+}
+
+
+double start_clock(enum ClockOutput output, uint32_t requestedFrequency)
+{
+  if (_piModel == PI_MODEL_5)
+    return start_clock_rp1(output, requestedFrequency);
+
   // Reference: https://www.raspberrypi.org/app/uploads/2012/02/BCM2835-ARM-Peripherals.pdf, Page 105
 
   // Find the best clock source to get closest to the requested frequency (lowest error) with MASH=1.
@@ -395,18 +685,24 @@ double start_clock(uint32_t requestedFrequency)
   if (bestClockSourceIndex < 0)
     return -1.0;  // Unable to find any suitable clock source
 
-  stop_clock();
+  stop_clock(output);
 
   uint32_t src  = _clockSources[bestClockSourceIndex].clockSource;
   uint32_t mash = 1;  // Good approximation, low jitter
+  volatile uint32_t *pCtl = _pClockVirtMem + _clockOutputPins[output].ctlWord;
+  volatile uint32_t *pDiv = _pClockVirtMem + _clockOutputPins[output].divWord;
 
-  *(_pClockVirtMem + CLK_GP0DIV) = CLK_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF);
+  write_register(pDiv, CLK_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF));
   usleep(10);
-  *(_pClockVirtMem + CLK_GP0CTL) = CLK_PASSWD | CLK_CTL_MASH(mash) | CLK_CTL_SRC(src);
+  write_register(pCtl, CLK_PASSWD | CLK_CTL_MASH(mash) | CLK_CTL_SRC(src));
   usleep(10);
-  *(_pClockVirtMem + CLK_GP0CTL) |= CLK_PASSWD | CLK_CTL_ENAB;
+  write_register(pCtl, *pCtl | CLK_PASSWD | CLK_CTL_ENAB);
 
-  printf("Choose clock %d at %.4lf MHz / %.4lf = %.4lf Hz\n\n",
+  _clockSourceFrequency[output] = _clockSources[bestClockSourceIndex].clockFrequency;
+  _clockSourceName[output] = _clockSources[bestClockSourceIndex].clockString;
+
+  printf("GPCLK%d: Choose clock %d at %.4lf MHz / %.4lf = %.4lf Hz\n\n",
+         output,
          _clockSources[bestClockSourceIndex].clockSource,
          _clockSources[bestClockSourceIndex].clockFrequency / 1e6,
          divI + divF / 1024.0,
@@ -417,26 +713,312 @@ double start_clock(uint32_t requestedFrequency)
 }
 
 
-void stop_clock()
+double adopt_clock(enum ClockOutput output, uint32_t requestedFrequency)
 {
-  *(_pClockVirtMem + CLK_GP0CTL) = CLK_PASSWD | (*(_pClockVirtMem + CLK_GP0CTL) & ~CLK_CTL_ENAB);
+  // Takes over a clock left running by another process without writing
+  // to it. Returns the running frequency, or -1 if the clock is stopped
+  // or not close to the requested frequency.
+  if (_piModel == PI_MODEL_5)
+    return adopt_clock_rp1(output, requestedFrequency);
+
+  update_clock_source_frequencies();
+
+  uint32_t ctl = *(_pClockVirtMem + _clockOutputPins[output].ctlWord);
+  uint32_t divisor = get_clock_divisor(output);
+  if (!(ctl & CLK_CTL_ENAB) || !(ctl & CLK_CTL_BUSY) || divisor < (2 << 10))
+    return -1.0;
+
+  for (size_t i = 0; i < ARRAY_LENGTH(_clockSources); i++)
+  {
+    if (_clockSources[i].clockSource != (int)(ctl & 0xf) || !_clockSources[i].enableForUse)
+      continue;
+
+    double frequency = _clockSources[i].clockFrequency / (divisor / 1024.0);
+    if (fabs(frequency - requestedFrequency) > requestedFrequency * CLOCK_ADOPT_TOLERANCE)
+      return -1.0;
+
+    _clockSourceFrequency[output] = _clockSources[i].clockFrequency;
+    _clockSourceName[output] = _clockSources[i].clockString;
+
+    printf("GPCLK%d: Adopt running clock %d at %.4lf MHz / %.4lf = %.4lf Hz\n\n",
+           output, _clockSources[i].clockSource, _clockSources[i].clockFrequency / 1e6,
+           divisor / 1024.0, frequency);
+
+    fflush(stdout);
+    return frequency;
+  }
+
+  return -1.0;
+}
+
+
+void stop_clock(enum ClockOutput output)
+{
+  if (_piModel == PI_MODEL_5)
+  {
+    stop_clock_rp1(output);
+    return;
+  }
+
+  volatile uint32_t *pCtl = _pClockVirtMem + _clockOutputPins[output].ctlWord;
+
+  write_register(pCtl, CLK_PASSWD | (*pCtl & ~CLK_CTL_ENAB));
 
   // Wait until clock confirms not to be busy anymore
-  while (*(_pClockVirtMem + CLK_GP0CTL) & CLK_CTL_BUSY)
+  while (*pCtl & CLK_CTL_BUSY)
     usleep(10);
 
-  enable_clock_output(false);
+  enable_clock_output(output, false);
 }
 
 
-void enable_clock_output(bool on)
+bool wait_clock_stable(enum ClockOutput output, uint32_t timeoutUs)
 {
-  if (on)
+  // A BCM clock generator sets BUSY once it is running from its source.
+  // RP1 has no equivalent flag, so the enable bit is read back instead.
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (true)
   {
-    GPIO_ALT0(4);  // Pinmux GPIO4 into outputting clock
+    if (_piModel == PI_MODEL_5)
+    {
+      if (*(_pClockVirtMem + RP1_CLK_GP_CTRL(output)) & RP1_CLK_CTRL_ENABLE)
+        return true;
+    }
+    else if (*(_pClockVirtMem + _clockOutputPins[output].ctlWord) & CLK_CTL_BUSY)
+    {
+      return true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_nsec - start.tv_nsec) / 1000 > timeoutUs)
+      return false;
+
+    usleep(10);
   }
-  else
+}
+
+
+void enable_clock_output(enum ClockOutput output, bool on)
+{
+  set_clock_outputs(1 << output, on ? (1 << output) : 0);
+}
+
+
+void set_clock_outputs(uint32_t outputMask, uint32_t onMask)
+{
+  if (_piModel == PI_MODEL_5)
+  {
+    set_clock_outputs_rp1(outputMask, onMask);
+    return;
+  }
+
+  write_register(_pGpioVirtMem + GPIO_FSEL_REGISTER(4), get_clock_outputs_fsel(outputMask, onMask));
+}
+
+
+uint32_t get_clock_outputs_fsel(uint32_t outputMask, uint32_t onMask)
+{
+  // Returns the GPFSEL0 value with each output in outputMask pinmuxed
+  // into outputting its clock if it is in onMask, or to input if not.
+  // Pins of outputs outside outputMask are left as they are.
+  // There is no equivalent single register on RP1.
+  if (_piModel == PI_MODEL_5)
+    return 0;
+
+  uint32_t fsel = *(_pGpioVirtMem + GPIO_FSEL_REGISTER(4));
+
+  for (int i = 0; i < CLOCK_OUTPUT_COUNT; i++)
   {
-    GPIO_INPUT(4);
+    if (!(outputMask & (1 << i)))
+      continue;
+
+    if (onMask & (1 << i))
+      fsel = GPIO_FSEL_ALT0(fsel, _clockOutputPins[i].gpioPin);
+    else
+      fsel = GPIO_FSEL_INPUT(fsel, _clockOutputPins[i].gpioPin);
   }
+
+  return fsel;
+}
+
+
+double get_clock_source_frequency(enum ClockOutput output)
+{
+  return _clockSourceFrequency[output];
+}
+
+
+const char *get_clock_source_name(enum ClockOutput output)
+{
+  return _clockSourceName[output] != NULL ? _clockSourceName[output] : "none";
+}
+
+
+uint32_t get_clock_divisor(enum ClockOutput output)
+{
+  if (_piModel == PI_MODEL_5)
+  {
+    uint32_t divInt = *(_pClockVirtMem + RP1_CLK_GP_DIV_INT(output));
+    uint32_t divFrac = *(_pClockVirtMem + RP1_CLK_GP_DIV_FRAC(output)) >> (32 - RP1_DIV_FRAC_BITS);
+    return (divInt << 10) | (divFrac >> (RP1_DIV_FRAC_BITS - 10));
+  }
+
+  // Divisor in units of 1/1024 (DIVI << 10 | DIVF)
+  uint32_t div = *(_pClockVirtMem + _clockOutputPins[output].divWord);
+  return (((div >> 12) & 0xfff) << 10) | (div & 0x3ff);
+}
+
+
+void set_clock_divisor(enum ClockOutput output, uint32_t divisor)
+{
+  // The divisor may be changed while the clock is running.
+  // MASH smooths the transition between the old and new values.
+  // On RP1 the new value takes effect when the integer part is written.
+  if (_piModel == PI_MODEL_5)
+  {
+    write_register(_pClockVirtMem + RP1_CLK_GP_DIV_FRAC(output), (divisor & 0x3ff) << (32 - 10));
+    write_register(_pClockVirtMem + RP1_CLK_GP_DIV_INT(output), divisor >> 10);
+    return;
+  }
+
+  write_register(_pClockVirtMem + _clockOutputPins[output].divWord,
+                 CLK_PASSWD | CLK_DIV_DIVI(divisor >> 10) | CLK_DIV_DIVF(divisor & 0x3ff));
+}
+
+
+static double start_clock_rp1(enum ClockOutput output, uint32_t requestedFrequency)
+{
+  // RP1 general purpose clocks have a 16.16 fractional divisor, so the fixed
+  // 50 MHz crystal gets much closer to every carrier than the BCM sources.
+  // Reference: https://datasheets.raspberrypi.com/rp1/rp1-peripherals.pdf
+  uint64_t div = llround(RP1_XOSC_FREQUENCY / requestedFrequency * (1 << RP1_DIV_FRAC_BITS));
+  uint32_t divI = div >> RP1_DIV_FRAC_BITS;
+  uint32_t divF = div & ((1 << RP1_DIV_FRAC_BITS) - 1);
+  if (divI < 1 || divI > 0xffff)
+    return -1.0;
+
+  double resultFreq = RP1_XOSC_FREQUENCY / ((double)div / (1 << RP1_DIV_FRAC_BITS));
+  printf("Clock Source:\n");
+  printf("RP1 - xosc - %9.4lf MHz : Result = %.4lf Hz, Error = %.4lf Hz\n\n",
+         RP1_XOSC_FREQUENCY / 1e6, resultFreq, fabs(requestedFrequency - resultFreq));
+
+  stop_clock_rp1(output);
+
+  // The pin stays on its clock function. Keying is done by switching
+  // the pad output driver, which leaves the pin floating when off.
+  int pin = _clockOutputPins[output].gpioPin;
+  volatile uint32_t *pGpioCtrl = _pGpioVirtMem + RP1_GPIO_CTRL(pin);
+  write_register(pGpioCtrl, (*pGpioCtrl & ~RP1_GPIO_FUNCSEL_MASK) | RP1_GPIO_FUNCSEL_GPCLK);
+
+  write_register(_pClockVirtMem + RP1_CLK_GP_DIV_FRAC(output), divF << (32 - RP1_DIV_FRAC_BITS));
+  write_register(_pClockVirtMem + RP1_CLK_GP_DIV_INT(output), divI);
+  write_register(_pClockVirtMem + RP1_CLK_GP_CTRL(output), RP1_CLK_CTRL_AUXSRC(RP1_CLK_AUXSRC_XOSC));
+  usleep(10);
+  write_register(_pClockVirtMem + RP1_CLK_GP_CTRL(output), *(_pClockVirtMem + RP1_CLK_GP_CTRL(output)) | RP1_CLK_CTRL_ENABLE);
+  write_register(_pClockVirtMem + RP1_CLK_GPCLK_OE_CTRL, *(_pClockVirtMem + RP1_CLK_GPCLK_OE_CTRL) | (1 << output));
+
+  _clockSourceFrequency[output] = RP1_XOSC_FREQUENCY;
+  _clockSourceName[output] = "xosc";
+
+  printf("GPCLK%d: Choose RP1 xosc at %.4lf MHz / %.6lf = %.4lf Hz\n\n",
+         output, RP1_XOSC_FREQUENCY / 1e6, (double)div / (1 << RP1_DIV_FRAC_BITS), resultFreq);
+
+  fflush(stdout);
+  return resultFreq;
+}
+
+
+static double adopt_clock_rp1(enum ClockOutput output, uint32_t requestedFrequency)
+{
+  uint32_t ctrl = *(_pClockVirtMem + RP1_CLK_GP_CTRL(output));
+  if (!(ctrl & RP1_CLK_CTRL_ENABLE) || (ctrl & RP1_CLK_CTRL_AUXSRC(0x1f)) != RP1_CLK_CTRL_AUXSRC(RP1_CLK_AUXSRC_XOSC) ||
+      !(*(_pClockVirtMem + RP1_CLK_GPCLK_OE_CTRL) & (1 << output)))
+  {
+    return -1.0;
+  }
+
+  uint64_t div = ((uint64_t)*(_pClockVirtMem + RP1_CLK_GP_DIV_INT(output)) << RP1_DIV_FRAC_BITS) |
+                 (*(_pClockVirtMem + RP1_CLK_GP_DIV_FRAC(output)) >> (32 - RP1_DIV_FRAC_BITS));
+  if (div < (1 << RP1_DIV_FRAC_BITS))
+    return -1.0;
+
+  double frequency = RP1_XOSC_FREQUENCY / ((double)div / (1 << RP1_DIV_FRAC_BITS));
+  if (fabs(frequency - requestedFrequency) > requestedFrequency * CLOCK_ADOPT_TOLERANCE)
+    return -1.0;
+
+  _clockSourceFrequency[output] = RP1_XOSC_FREQUENCY;
+  _clockSourceName[output] = "xosc";
+
+  printf("GPCLK%d: Adopt running RP1 xosc at %.4lf MHz / %.6lf = %.4lf Hz\n\n",
+         output, RP1_XOSC_FREQUENCY / 1e6, (double)div / (1 << RP1_DIV_FRAC_BITS), frequency);
+
+  fflush(stdout);
+  return frequency;
+}
+
+
+static void stop_clock_rp1(enum ClockOutput output)
+{
+  set_clock_outputs_rp1(1 << output, 0);
+
+  write_register(_pClockVirtMem + RP1_CLK_GPCLK_OE_CTRL, *(_pClockVirtMem + RP1_CLK_GPCLK_OE_CTRL) & ~(1 << output));
+  write_register(_pClockVirtMem + RP1_CLK_GP_CTRL(output), *(_pClockVirtMem + RP1_CLK_GP_CTRL(output)) & ~RP1_CLK_CTRL_ENABLE);
+}
+
+
+static void set_clock_outputs_rp1(uint32_t outputMask, uint32_t onMask)
+{
+  // Each RP1 pin has its own pad register, so coalesced edges
+  // take one write per output rather than a single write.
+  for (int i = 0; i < CLOCK_OUTPUT_COUNT; i++)
+  {
+    if (!(outputMask & (1 << i)))
+      continue;
+
+    volatile uint32_t *pPad = _pPadsVirtMem + RP1_PADS_GPIO(_clockOutputPins[i].gpioPin);
+    if (onMask & (1 << i))
+      write_register(pPad, *pPad & ~RP1_PADS_OD);
+    else
+      write_register(pPad, *pPad | RP1_PADS_OD | RP1_PADS_IE);
+  }
+}
+
+
+double start_pwm_clock(uint32_t requestedFrequency)
+{
+  // The PWM clock only paces DMA transfers, so it must be an exact integer
+  // division of PLLD. No MASH noise shaping is used.
+  update_clock_source_frequencies();
+
+  double plldFrequency = 0;
+  for (size_t i = 0; i < ARRAY_LENGTH(_clockSources); i++)
+  {
+    if (_clockSources[i].clockSource == 6)
+      plldFrequency = _clockSources[i].clockFrequency;
+  }
+
+  uint32_t divI = lround(plldFrequency / requestedFrequency);
+  if (divI < 2 || divI > 4095)
+    return -1.0;
+
+  stop_pwm_clock();
+
+  write_register(_pClockVirtMem + CLK_PWMDIV, CLK_PASSWD | CLK_DIV_DIVI(divI));
+  usleep(10);
+  write_register(_pClockVirtMem + CLK_PWMCTL, CLK_PASSWD | CLK_CTL_SRC(6));
+  usleep(10);
+  write_register(_pClockVirtMem + CLK_PWMCTL, *(_pClockVirtMem + CLK_PWMCTL) | CLK_PASSWD | CLK_CTL_ENAB);
+
+  return plldFrequency / divI;
+}
+
+
+void stop_pwm_clock()
+{
+  write_register(_pClockVirtMem + CLK_PWMCTL, CLK_PASSWD | (*(_pClockVirtMem + CLK_PWMCTL) & ~CLK_CTL_ENAB));
+
+  while (*(_pClockVirtMem + CLK_PWMCTL) & CLK_CTL_BUSY)
+    usleep(10);
 }
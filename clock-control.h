@@ -34,10 +34,67 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+enum RaspberryPiModel
+{
+  PI_MODEL_1 = 1,
+  PI_MODEL_2 = 2,
+  PI_MODEL_3 = 3,
+  PI_MODEL_4 = 4,
+  PI_MODEL_5 = 5,
+  PI_MODEL_UNKNOWN = -1
+};
+
+enum ClockOutput
+{
+  CLOCK_OUTPUT_GP0 = 0,  // GPCLK0 on GPIO4
+  CLOCK_OUTPUT_GP1 = 1,  // GPCLK1 on GPIO5
+  CLOCK_OUTPUT_GP2 = 2,  // GPCLK2 on GPIO6
+  CLOCK_OUTPUT_COUNT = 3
+};
+
+enum RegisterBlock
+{
+  REGISTER_BLOCK_GPIO,
+  REGISTER_BLOCK_CLOCK,
+  REGISTER_BLOCK_PADS   // RP1 only
+};
+
+typedef struct
+{
+  struct timespec time;      // CLOCK_REALTIME time of write
+  enum RegisterBlock block;  // Register block written
+  uint32_t word;             // Register word offset within block
+  uint32_t value;            // Value written
+} REGISTER_WRITE;
 
 bool gpio_init();
-double start_clock(uint32_t requestedFrequency);
-void stop_clock();
-void enable_clock_output(bool on);
+double start_clock(enum ClockOutput output, uint32_t requestedFrequency);
+double adopt_clock(enum ClockOutput output, uint32_t requestedFrequency);
+void stop_clock(enum ClockOutput output);
+bool wait_clock_stable(enum ClockOutput output, uint32_t timeoutUs);
+void enable_clock_output(enum ClockOutput output, bool on);
+void set_clock_outputs(uint32_t outputMask, uint32_t onMask);
+uint32_t get_clock_outputs_fsel(uint32_t outputMask, uint32_t onMask);
+double get_clock_source_frequency(enum ClockOutput output);
+const char *get_clock_source_name(enum ClockOutput output);
+uint32_t get_clock_divisor(enum ClockOutput output);
+void set_clock_divisor(enum ClockOutput output, uint32_t divisor);
+
+double start_pwm_clock(uint32_t requestedFrequency);
+void stop_pwm_clock();
+volatile uint32_t *map_bcm_register(off_t registerOffset);
+enum RaspberryPiModel get_detected_pi_model();
+bool read_system_timer(uint64_t *pTicks);
+
+void use_mock_registers(bool enable, enum RaspberryPiModel mockModel);
+bool is_mock_registers();
+void mock_bus_write(uint32_t busAddress, uint32_t value);
+size_t read_register_trace(REGISTER_WRITE *buffTrace, size_t buffLen, uint64_t *pCursor);
+int trace_clock_output_state(const REGISTER_WRITE *pEntry, enum ClockOutput output);
+double trace_clock_divisor(const REGISTER_WRITE *pEntry, enum ClockOutput output);
 
 #endif  // __CLOCK_CONTROL_H__
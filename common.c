@@ -0,0 +1,54 @@
+/*
+common.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include "common.h"
+
+
+// Small helpers shared by several modules.
+
+
+int compare_int64(const void *a, const void *b)
+{
+  // For qsort() of int64_t values in ascending order.
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+
+bool start_helper_thread(pthread_t *pThreadId, void *(*pRoutine)(void *))
+{
+  // Helper threads are created with every signal blocked, so SIGINT and
+  // SIGTERM still reach the real-time thread and SIGHUP the main thread.
+  sigset_t allSignals, oldSignals;
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+
+  int result = pthread_create(pThreadId, NULL, pRoutine, NULL);
+  pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+  return (result == 0);
+}
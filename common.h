@@ -0,0 +1,32 @@
+/*
+common.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __COMMON_H__
+#define __COMMON_H__
+
+#include <stdbool.h>
+#include <pthread.h>
+
+int compare_int64(const void *a, const void *b);
+bool start_helper_thread(pthread_t *pThreadId, void *(*pRoutine)(void *));
+
+#endif  // __COMMON_H__
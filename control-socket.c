@@ -0,0 +1,612 @@
+/*
+control-socket.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "macros.h"
+#include "runtime-config.h"
+#include "control-socket.h"
+
+
+// The control socket is served by the main thread. Commands are handed to
+// the real-time thread through a single producer, single consumer ring,
+// which it checks once per second between edges. Frame and statistics
+// requests are answered through a second ring in the other direction, so
+// neither thread ever waits on the other.
+
+
+typedef struct
+{
+  int fd;
+  char buffer[256];
+  size_t length;
+  uint32_t pendingRequestId;  // Zero when no reply is awaited
+  time_t pendingSince;
+} CONTROL_CLIENT;
+
+
+static CONTROL_COMMAND _commandQueue[CONTROL_QUEUE_LENGTH];
+static uint32_t _commandHead = 0;  // Written by the main thread only
+static uint32_t _commandTail = 0;  // Written by the real-time thread only
+
+static CONTROL_REPLY _replyQueue[CONTROL_QUEUE_LENGTH];
+static uint32_t _replyHead = 0;    // Written by the real-time thread only
+static uint32_t _replyTail = 0;    // Written by the main thread only
+
+static int _listenFd = -1;
+static char _socketPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static ino_t _socketInode = 0;
+static int _handoffFd = -1;  // Connection to the process being taken over from
+static CONTROL_CLIENT _clients[CONTROL_MAX_CLIENTS];
+static uint32_t _nextRequestId = 1;
+
+
+static bool command_push(const CONTROL_COMMAND *pCommand);
+static bool reply_pop(CONTROL_REPLY *pReply);
+static void client_send(CONTROL_CLIENT *pClient, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void client_close(CONTROL_CLIENT *pClient);
+static void handle_command(CONTROL_CLIENT *pClient, char *line);
+static void handle_reply(CONTROL_CLIENT *pClient, const CONTROL_REPLY *pReply);
+static bool bind_socket(void);
+static time_t handoff_exchange(int fd, const char *request);
+
+
+static bool command_push(const CONTROL_COMMAND *pCommand)
+{
+  uint32_t head = _commandHead;
+  if (head - __atomic_load_n(&_commandTail, __ATOMIC_ACQUIRE) >= CONTROL_QUEUE_LENGTH)
+    return false;
+
+  _commandQueue[head % CONTROL_QUEUE_LENGTH] = *pCommand;
+  __atomic_store_n(&_commandHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+bool control_command_pop(CONTROL_COMMAND *pCommand)
+{
+  uint32_t tail = _commandTail;
+  if (__atomic_load_n(&_commandHead, __ATOMIC_ACQUIRE) == tail)
+    return false;
+
+  *pCommand = _commandQueue[tail % CONTROL_QUEUE_LENGTH];
+  __atomic_store_n(&_commandTail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+bool control_reply_push(const CONTROL_REPLY *pReply)
+{
+  uint32_t head = _replyHead;
+  if (head - __atomic_load_n(&_replyTail, __ATOMIC_ACQUIRE) >= CONTROL_QUEUE_LENGTH)
+    return false;
+
+  _replyQueue[head % CONTROL_QUEUE_LENGTH] = *pReply;
+  __atomic_store_n(&_replyHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+static bool reply_pop(CONTROL_REPLY *pReply)
+{
+  uint32_t tail = _replyTail;
+  if (__atomic_load_n(&_replyHead, __ATOMIC_ACQUIRE) == tail)
+    return false;
+
+  *pReply = _replyQueue[tail % CONTROL_QUEUE_LENGTH];
+  __atomic_store_n(&_replyTail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+static void client_send(CONTROL_CLIENT *pClient, const char *format, ...)
+{
+  char message[512];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  if (length > (int)sizeof(message) - 1)
+    length = sizeof(message) - 1;
+
+  // Replies are short, so a client too slow to take one is dropped.
+  if (length > 0 && send(pClient->fd, message, length, MSG_NOSIGNAL | MSG_DONTWAIT) != length)
+    client_close(pClient);
+}
+
+
+static void client_close(CONTROL_CLIENT *pClient)
+{
+  if (pClient->fd >= 0)
+    close(pClient->fd);
+
+  pClient->fd = -1;
+  pClient->length = 0;
+  pClient->pendingRequestId = 0;
+}
+
+
+static void handle_command(CONTROL_CLIENT *pClient, char *line)
+{
+  char *sp = NULL;
+  char *name = strtok_r(line, " \t\r", &sp);
+  char *argument = strtok_r(NULL, " \t\r", &sp);
+  if (name == NULL)
+    return;
+
+  CONTROL_COMMAND command = { 0 };
+  if (!strcasecmp(name, "pause"))
+  {
+    command.type = CONTROL_PAUSE;
+  }
+  else if (!strcasecmp(name, "resume"))
+  {
+    command.type = CONTROL_RESUME;
+  }
+  else if (!strcasecmp(name, "carrier") && argument != NULL && !strcasecmp(argument, "on"))
+  {
+    command.type = CONTROL_CARRIER_ON;
+  }
+  else if (!strcasecmp(name, "carrier") && argument != NULL && !strcasecmp(argument, "off"))
+  {
+    command.type = CONTROL_CARRIER_OFF;
+  }
+  else if (!strcasecmp(name, "offset") && argument != NULL && sscanf(argument, "%lf", &command.hourOffset) == 1)
+  {
+    command.type = CONTROL_OFFSET;
+  }
+  else if (!strcasecmp(name, "frame"))
+  {
+    command.type = CONTROL_FRAME;
+  }
+  else if (!strcasecmp(name, "stats"))
+  {
+    command.type = CONTROL_STATS;
+  }
+  else if (!strcasecmp(name, "handoff") && argument != NULL && !strcasecmp(argument, "commit"))
+  {
+    command.type = CONTROL_HANDOFF_COMMIT;
+  }
+  else if (!strcasecmp(name, "handoff"))
+  {
+    command.type = CONTROL_HANDOFF;
+  }
+  else if (!strcasecmp(name, "help"))
+  {
+    client_send(pClient, "Commands: pause, resume, carrier on|off, offset HOURS, frame, stats, handoff [commit]\nOK\n");
+    return;
+  }
+  else
+  {
+    client_send(pClient, "ERROR Unknown command or argument\n");
+    return;
+  }
+
+  if (command.type == CONTROL_FRAME || command.type == CONTROL_STATS ||
+      command.type == CONTROL_HANDOFF || command.type == CONTROL_HANDOFF_COMMIT)
+  {
+    command.requestId = _nextRequestId++;
+    if (_nextRequestId == 0)
+      _nextRequestId = 1;
+  }
+
+  if (!command_push(&command))
+  {
+    client_send(pClient, "ERROR Command queue full\n");
+    return;
+  }
+
+  // Wake the real-time thread if it is sleeping through an off window.
+  runtime_config_wake();
+
+  if (command.requestId != 0)
+  {
+    pClient->pendingRequestId = command.requestId;
+    pClient->pendingSince = time(NULL);
+  }
+  else
+  {
+    client_send(pClient, "OK\n");
+  }
+}
+
+
+static void handle_reply(CONTROL_CLIENT *pClient, const CONTROL_REPLY *pReply)
+{
+  static const char * const ScheduleStateNames[] =
+  {
+    [SCHEDULE_OFF]      = "Off",
+    [SCHEDULE_PRE_ROLL] = "Pre-Roll",
+    [SCHEDULE_ON]       = "On"
+  };
+
+  struct tm timeParts;
+  char dateString[] = "1970-01-01 00:00:00";
+  localtime_r(&pReply->minuteStart, &timeParts);
+  strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
+
+  if (pReply->type == CONTROL_HANDOFF || pReply->type == CONTROL_HANDOFF_COMMIT)
+  {
+    if (pReply->minuteStart != 0)
+      client_send(pClient, "Handoff = %s (%jd)\nOK\n", dateString, (intmax_t)pReply->minuteStart);
+    else if (pReply->type == CONTROL_HANDOFF)
+      client_send(pClient, "ERROR Handoff not supported in this mode\n");
+    else
+      client_send(pClient, "ERROR No handoff to commit before its minute\n");
+    return;
+  }
+
+  if (pReply->type == CONTROL_STATS)
+  {
+    const TRANSMIT_STATS *pStats = &pReply->stats;
+    client_send(pClient,
+                "Minute = %s\n"
+                "Minutes On = %" PRIu64 ", Minutes Off = %" PRIu64 "\n"
+                "Edge Groups = %" PRIu64 ", Late = %" PRIu64 "\n"
+                "Lateness: Last = %.1lf us, Max = %.1lf us\n"
+                "Edge Advance: On = %.1lf us, Off = %.1lf us\n"
+                "Mean Error: On = %+.1lf us, Off = %+.1lf us, Frozen Edges = %" PRIu64 "\n"
+                "Deadline Misses: Stretched = %" PRIu64 ", Skipped Seconds = %" PRIu64 ", Abandoned Minutes = %" PRIu64 "\n"
+                "OK\n",
+                dateString, pStats->minutesOn, pStats->minutesOff, pStats->edgeGroups, pStats->lateGroups,
+                pStats->lastLatenessNs / 1e3, pStats->maxLatenessNs / 1e3,
+                pStats->advanceNs[EDGE_TRANSITION_ON] / 1e3, pStats->advanceNs[EDGE_TRANSITION_OFF] / 1e3,
+                pStats->meanErrorNs[EDGE_TRANSITION_ON] / 1e3, pStats->meanErrorNs[EDGE_TRANSITION_OFF] / 1e3,
+                pStats->frozenEdges, pStats->deadlineMisses[DEADLINE_STRETCH],
+                pStats->deadlineMisses[DEADLINE_SKIP_SECOND], pStats->deadlineMisses[DEADLINE_ABANDON_MINUTE]);
+    return;
+  }
+
+  client_send(pClient, "Minute = %s, Offset = %" PRId32 " min, Schedule = %s, Paused = %s, Carrier Only = %s\n",
+              dateString, pReply->minuteOffset, ScheduleStateNames[pReply->scheduleState],
+              pReply->paused ? "Yes" : "No", pReply->carrierOnly ? "Yes" : "No");
+
+  for (int i = 0; i < pReply->outputCount && pClient->fd >= 0; i++)
+  {
+    // Modulation times are in ms for each second of the frame.
+    char modulation[60 * 4 + 1] = "";
+    size_t length = 0;
+    for (int second = 0; second < 60 && length < sizeof(modulation); second++)
+    {
+      int ms = get_modulation_for_second(pReply->timeServices[i], pReply->minuteBits[i], second);
+      length += snprintf(modulation + length, sizeof(modulation) - length, "%03d ", ms < 0 ? 0 : ms);
+    }
+
+    client_send(pClient, "GPCLK%d: Bits = 0x%016" PRIx64 ", Modulation = %s\n", i, pReply->minuteBits[i], modulation);
+  }
+
+  if (pClient->fd >= 0)
+    client_send(pClient, "OK\n");
+}
+
+
+bool control_socket_open(const char *path, bool handoff)
+{
+  // During a handoff the running process keeps its socket until the
+  // handoff is committed, so it can still be reached if this process
+  // fails to start. Otherwise a process still answering at path means
+  // another transmitter is driving the outputs.
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "Error: Control socket path is too long.\n");
+    return false;
+  }
+
+  strcpy(address.sun_path, path);
+  strcpy(_socketPath, path);
+
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    _clients[i].fd = -1;
+
+  if (handoff)
+    return true;
+
+  int probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int result = (probeFd >= 0) ? connect(probeFd, (struct sockaddr *)&address, sizeof(address)) : -1;
+  int probeErrno = errno;
+  if (probeFd >= 0)
+    close(probeFd);
+
+  if (result == 0)
+  {
+    fprintf(stderr, "Error: Another transmitter is serving the control socket %s. Use --handoff to take over.\n", path);
+    return false;
+  }
+
+  if (probeErrno != ECONNREFUSED && probeErrno != ENOENT)
+  {
+    fprintf(stderr, "Failed to check control socket %s (%s).\n", path, strerror(probeErrno));
+    return false;
+  }
+
+  return bind_socket();
+}
+
+
+static bool bind_socket(void)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  strcpy(address.sun_path, _socketPath);
+
+  _listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_listenFd < 0)
+  {
+    perror("Failed to create control socket");
+    return false;
+  }
+
+  // A socket left behind by an earlier run would make bind() fail.
+  unlink(_socketPath);
+
+  if (bind(_listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(_listenFd, CONTROL_MAX_CLIENTS) < 0)
+  {
+    perror("Failed to bind control socket");
+    close(_listenFd);
+    _listenFd = -1;
+    return false;
+  }
+
+  struct stat socketStat;
+  if (stat(_socketPath, &socketStat) == 0)
+    _socketInode = socketStat.st_ino;
+
+  return true;
+}
+
+
+void control_socket_serve(int timeoutMs)
+{
+  // Waits up to timeoutMs for socket activity and handles it.
+  // Without a control socket, this only waits.
+  struct pollfd pollFds[1 + CONTROL_MAX_CLIENTS];
+  int pollCount = 0;
+  bool pending = false;
+
+  if (_listenFd >= 0)
+  {
+    pollFds[pollCount++] = (struct pollfd){ .fd = _listenFd, .events = POLLIN };
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    {
+      pending |= (_clients[i].pendingRequestId != 0);
+      pollFds[pollCount++] = (struct pollfd){ .fd = _clients[i].fd, .events = POLLIN };
+    }
+  }
+
+  // Replies are checked for often while one is awaited.
+  if (pending && timeoutMs > 50)
+    timeoutMs = 50;
+
+  if (poll(pollFds, pollCount, timeoutMs) > 0)
+  {
+    if (pollFds[0].revents & POLLIN)
+    {
+      int fd = accept4(_listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      for (int i = 0; fd >= 0 && i < CONTROL_MAX_CLIENTS; i++)
+      {
+        if (_clients[i].fd < 0)
+        {
+          _clients[i].fd = fd;
+          fd = -1;
+        }
+      }
+
+      if (fd >= 0)
+        close(fd);
+    }
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    {
+      CONTROL_CLIENT *pClient = &_clients[i];
+      if (pClient->fd < 0 || pollFds[1 + i].fd != pClient->fd || !(pollFds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      ssize_t count = read(pClient->fd, pClient->buffer + pClient->length, sizeof(pClient->buffer) - 1 - pClient->length);
+      if (count <= 0)
+      {
+        client_close(pClient);
+        continue;
+      }
+
+      pClient->length += count;
+      if (pClient->length >= sizeof(pClient->buffer) - 1 && memchr(pClient->buffer, '\n', pClient->length) == NULL)
+      {
+        client_send(pClient, "ERROR Line too long\n");
+        client_close(pClient);
+      }
+    }
+  }
+
+  // Complete lines are handled one at a time, waiting for each reply.
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+  {
+    CONTROL_CLIENT *pClient = &_clients[i];
+    char *newline;
+
+    while (pClient->fd >= 0 && pClient->pendingRequestId == 0 &&
+           (newline = memchr(pClient->buffer, '\n', pClient->length)) != NULL)
+    {
+      *newline = '\0';
+      size_t lineLength = newline - pClient->buffer + 1;
+      handle_command(pClient, pClient->buffer);
+      if (pClient->fd < 0)
+        break;
+
+      memmove(pClient->buffer, pClient->buffer + lineLength, pClient->length - lineLength);
+      pClient->length -= lineLength;
+    }
+
+    if (pClient->fd >= 0 && pClient->pendingRequestId != 0 && time(NULL) - pClient->pendingSince > CONTROL_REPLY_TIMEOUT)
+    {
+      client_send(pClient, "ERROR No reply from transmitter thread\n");
+      pClient->pendingRequestId = 0;
+    }
+  }
+
+  CONTROL_REPLY reply;
+  while (reply_pop(&reply))
+  {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    {
+      if (_clients[i].fd >= 0 && _clients[i].pendingRequestId == reply.requestId)
+      {
+        _clients[i].pendingRequestId = 0;
+        handle_reply(&_clients[i], &reply);
+      }
+    }
+  }
+}
+
+
+void control_socket_close(void)
+{
+  if (_handoffFd >= 0)
+  {
+    close(_handoffFd);
+    _handoffFd = -1;
+  }
+
+  if (_listenFd < 0)
+    return;
+
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+    client_close(&_clients[i]);
+
+  close(_listenFd);
+  _listenFd = -1;
+
+  // After a handoff the path belongs to the new process's socket.
+  struct stat socketStat;
+  if (stat(_socketPath, &socketStat) == 0 && socketStat.st_ino == _socketInode)
+    unlink(_socketPath);
+}
+
+
+time_t control_socket_request_handoff(const char *path)
+{
+  // Asks a process already serving the control socket at path to hand
+  // over. Returns the first minute this process is to transmit, zero if
+  // no process is listening, or -1 if the handoff was refused. The
+  // connection is kept for the commit.
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(address.sun_path))
+    return -1;
+
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+  {
+    close(fd);
+    return (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+  }
+
+  time_t minuteStart = handoff_exchange(fd, "handoff\n");
+  if (minuteStart < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  _handoffFd = fd;
+  return minuteStart;
+}
+
+
+bool control_socket_commit_handoff(void)
+{
+  // Tells the running process that this one is ready to key the handoff
+  // minute, then takes over the socket path. Until then the running
+  // process keeps the outputs and drops the handoff at its minute.
+  if (_handoffFd < 0)
+    return false;
+
+  time_t minuteStart = handoff_exchange(_handoffFd, "handoff commit\n");
+  close(_handoffFd);
+  _handoffFd = -1;
+
+  if (minuteStart < 0)
+    return false;
+
+  bind_socket();
+  return true;
+}
+
+
+static time_t handoff_exchange(int fd, const char *request)
+{
+  // Sends a handoff request and returns the minute in the reply, or -1.
+  size_t requestLength = strlen(request);
+  char reply[256];
+  size_t length = 0;
+  struct pollfd pollFd = { .fd = fd, .events = POLLIN };
+
+  if (send(fd, request, requestLength, MSG_NOSIGNAL) != (ssize_t)requestLength)
+  {
+    fprintf(stderr, "Handoff refused: Connection lost\n");
+    return -1;
+  }
+
+  while (length < sizeof(reply) - 1 && poll(&pollFd, 1, CONTROL_HANDOFF_TIMEOUT * 1000) > 0)
+  {
+    ssize_t count = read(fd, reply + length, sizeof(reply) - 1 - length);
+    if (count <= 0)
+      break;
+
+    length += count;
+    reply[length] = '\0';
+    if (strstr(reply, "OK\n") != NULL || strstr(reply, "ERROR") != NULL)
+      break;
+  }
+
+  reply[length] = '\0';
+
+  intmax_t minuteStart = 0;
+  char *pMinute = strchr(reply, '(');
+  if (strstr(reply, "OK\n") == NULL || pMinute == NULL || sscanf(pMinute, "(%jd)", &minuteStart) != 1 || minuteStart <= 0)
+  {
+    fprintf(stderr, "Handoff refused: %s", length > 0 ? reply : "No reply\n");
+    return -1;
+  }
+
+  return minuteStart;
+}
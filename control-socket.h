@@ -0,0 +1,104 @@
+/*
+control-socket.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __CONTROL_SOCKET_H__
+#define __CONTROL_SOCKET_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "clock-control.h"
+#include "time-services.h"
+#include "schedule.h"
+#include "edge-compensation.h"
+
+#define CONTROL_QUEUE_LENGTH   16  // Must be a power of two
+#define CONTROL_MAX_CLIENTS    4
+#define CONTROL_REPLY_TIMEOUT  90  // Seconds to wait for the real-time thread
+#define CONTROL_HANDOFF_TIMEOUT 10  // Seconds to wait for a handoff reply
+
+enum ControlCommandType
+{
+  CONTROL_PAUSE,
+  CONTROL_RESUME,
+  CONTROL_CARRIER_ON,
+  CONTROL_CARRIER_OFF,
+  CONTROL_OFFSET,
+  CONTROL_FRAME,
+  CONTROL_STATS,
+  CONTROL_HANDOFF,
+  CONTROL_HANDOFF_COMMIT,
+};
+
+typedef struct
+{
+  enum ControlCommandType type;
+  uint32_t requestId;  // Matches a reply to the client that asked
+  double hourOffset;   // For CONTROL_OFFSET
+} CONTROL_COMMAND;
+
+enum DeadlinePolicy
+{
+  DEADLINE_STRETCH,         // Key the late edge, stretching or shortening the pulse
+  DEADLINE_SKIP_SECOND,     // Leave the carrier on for the rest of the second
+  DEADLINE_ABANDON_MINUTE,  // Leave the carrier on until the next minute
+  DEADLINE_POLICY_COUNT
+};
+
+typedef struct
+{
+  uint64_t minutesOn;        // Minutes keyed with the time signal or carrier
+  uint64_t minutesOff;       // Minutes with the outputs off
+  uint64_t edgeGroups;       // Edge groups keyed by the CPU
+  uint64_t lateGroups;       // Groups keyed later than the late threshold
+  int64_t lastLatenessNs;    // Lateness of the most recent group
+  int64_t maxLatenessNs;     // Worst lateness seen
+  int64_t advanceNs[EDGE_TRANSITION_COUNT];    // Edge advance of on and off transitions
+  int64_t meanErrorNs[EDGE_TRANSITION_COUNT];  // Mean lateness with the advance applied
+  uint64_t frozenEdges;      // Edges ignored by the timing compensation
+  uint64_t deadlineMisses[DEADLINE_POLICY_COUNT];  // Wake-ups past the deadline by action taken
+} TRANSMIT_STATS;
+
+typedef struct
+{
+  uint32_t requestId;
+  enum ControlCommandType type;
+  time_t minuteStart;        // Minute currently being transmitted, or handoff minute
+  int32_t minuteOffset;      // Offset of the transmitted time in minutes
+  enum ScheduleState scheduleState;
+  bool paused;
+  bool carrierOnly;
+  uint8_t outputCount;
+  enum TimeService timeServices[CLOCK_OUTPUT_COUNT];
+  uint64_t minuteBits[CLOCK_OUTPUT_COUNT];
+  TRANSMIT_STATS stats;
+} CONTROL_REPLY;
+
+bool control_socket_open(const char *path, bool handoff);
+void control_socket_serve(int timeoutMs);
+void control_socket_close(void);
+time_t control_socket_request_handoff(const char *path);
+bool control_socket_commit_handoff(void);
+bool control_command_pop(CONTROL_COMMAND *pCommand);
+bool control_reply_push(const CONTROL_REPLY *pReply);
+
+#endif  // __CONTROL_SOCKET_H__
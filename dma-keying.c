@@ -0,0 +1,862 @@
+/*
+dma-keying.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "macros.h"
+#include "common.h"
+#include "clock-control.h"
+#include "timestamp.h"
+#include "dma-keying.h"
+
+// Reference: https://www.raspberrypi.org/app/uploads/2012/02/BCM2835-ARM-Peripherals.pdf, Page 38 (DMA), Page 138 (PWM)
+
+// Peripheral Register Offsets
+#define DMA_REGISTER_OFFSET 0x00007000
+#define PWM_REGISTER_OFFSET 0x0020c000
+
+// Peripheral Bus Addresses
+#define BUS_GPIO_GPFSEL0 0x7e200000
+#define BUS_PWM_FIF1     0x7e20c018
+
+// DMA channel 10 is a lite channel left free by the kernel on all Pi models.
+#define DMA_CHANNEL 10
+
+// DMA Register Word Offsets (relative to channel base)
+#define DMA_CS        0
+#define DMA_CONBLK_AD 1
+#define DMA_TXFR_LEN  5
+#define DMA_DEBUG     8
+
+#define DMA_CHANNEL_WORDS (0x100 / 4)
+#define DMA_ENABLE        (0xff0 / 4)  // Relative to DMA register base
+
+// DMA Control Macros
+#define DMA_CS_RESET                       (1 << 31)
+#define DMA_CS_ABORT                       (1 << 30)
+#define DMA_CS_WAIT_FOR_OUTSTANDING_WRITES (1 << 28)
+#define DMA_CS_PANIC_PRIORITY(x)           ((x) << 20)
+#define DMA_CS_PRIORITY(x)                 ((x) << 16)
+#define DMA_CS_INT                         (1 << 2)
+#define DMA_CS_END                         (1 << 1)
+#define DMA_CS_ACTIVE                      (1 << 0)
+
+#define DMA_TI_NO_WIDE_BURSTS (1 << 26)
+#define DMA_TI_PERMAP(x)      ((x) << 16)
+#define DMA_TI_DEST_DREQ      (1 << 6)
+#define DMA_TI_WAIT_RESP      (1 << 3)
+
+#define DMA_PERMAP_PWM 5
+
+// PWM Register Word Offsets
+#define PWM_CTL  0
+#define PWM_DMAC 2
+#define PWM_RNG1 4
+
+// PWM Control Macros
+#define PWM_CTL_CLRF1     (1 << 6)
+#define PWM_CTL_USEF1     (1 << 5)
+#define PWM_CTL_PWEN1     (1 << 0)
+
+#define PWM_DMAC_ENAB     (1 << 31)
+#define PWM_DMAC_PANIC(x) ((x) << 8)
+#define PWM_DMAC_DREQ(x)  ((x) << 0)
+
+// Pacing
+// The PWM serializer consumes one FIFO word per tick. Each gap between edges
+// is a DREQ paced transfer of that many words, so edge timing comes entirely
+// from the PWM clock. With a DREQ threshold of one, the DMA engine stays one
+// word ahead of the PWM, so every edge lands one tick before its word count.
+#define PWM_CLOCK_FREQUENCY      10000000  // 10 MHz (PLLD / 50 Pi1-3, PLLD / 75 Pi4)
+#define DMA_TICK_US              100
+#define PWM_RANGE                (PWM_CLOCK_FREQUENCY / 1000000 * DMA_TICK_US)
+#define DMA_TICKS_PER_MINUTE     (60 * 1000000 / DMA_TICK_US)
+#define DMA_FIFO_LEAD_TICKS      1
+#define DMA_MAX_GAP_TICKS        16000     // Lite channel TXFR_LEN limit is 65535 bytes
+#define DMA_MAX_CORRECTION_TICKS 100
+#define DMA_START_LEAD_NS        100000000
+
+#define DMA_MAX_CONTROL_BLOCKS (2 * DMA_MAX_EDGES + DMA_TICKS_PER_MINUTE / DMA_MAX_GAP_TICKS + 4)
+
+// Mailbox Interface
+// Reference: https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
+#define MAILBOX_IOCTL        _IOWR(100, 0, char*)
+#define MAILBOX_TAG_ALLOCATE 0x3000c
+#define MAILBOX_TAG_LOCK     0x3000d
+#define MAILBOX_TAG_UNLOCK   0x3000e
+#define MAILBOX_TAG_RELEASE  0x3000f
+
+#define MEM_FLAG_DIRECT           (1 << 2)  // 0xC alias uncached
+#define MEM_FLAG_L1_NONALLOCATING (3 << 2)  // Required for BCM2835
+
+#define BUS_TO_PHYS(x) ((x) & ~0xc0000000)
+
+#define MOCK_BUS_ADDRESS  0xde000000
+#define MOCK_CHUNK_TICKS  10
+#define MOCK_TRACE_TOLERANCE_NS  (DMA_TICK_US * 1000LL * MOCK_CHUNK_TICKS * 10)  // Write to edge match window
+
+
+typedef struct
+{
+  uint32_t transferInfo;
+  uint32_t sourceAddress;
+  uint32_t destinationAddress;
+  uint32_t transferLength;
+  uint32_t stride;
+  uint32_t nextControlBlock;
+  uint32_t reserved[2];
+} DMA_CONTROL_BLOCK;
+
+// Uncached memory shared with the DMA engine
+typedef struct
+{
+  DMA_CONTROL_BLOCK controlBlocks[2][DMA_MAX_CONTROL_BLOCKS];
+  DMA_CONTROL_BLOCK leadBlock;
+  DMA_CONTROL_BLOCK idleBlock;
+  uint32_t fselValues[2][DMA_MAX_EDGES];
+  uint32_t pacingWord;
+} DMA_MEMORY;
+
+// Host side copy of what was loaded into each chain
+typedef struct
+{
+  time_t minuteStart;                           // Start of minute keyed by this chain
+  uint32_t blockCount;                          // Control blocks used
+  uint32_t finalGapBlock;                       // Last gap block (timing correction target)
+  uint32_t finalGapTicks;                       // Uncorrected length of last gap block
+  bool corrected;                               // Timing correction already applied
+  uint32_t blockTicks[DMA_MAX_CONTROL_BLOCKS];  // Ticks elapsed before each block starts
+  size_t edgeCount;
+  DMA_EDGE edges[DMA_MAX_EDGES];
+  bool edgeWritten[DMA_MAX_EDGES];              // Mock only: edge matched to a register write
+  bool audited;                                 // Mock only: unwritten edges already counted
+} DMA_CHAIN;
+
+
+static void init_idle_chain(int chain);
+static uint32_t add_gap_blocks(int chain, uint32_t blockIndex, uint32_t *pTick, uint32_t targetTick);
+static int find_chain(uint32_t busAddress, uint32_t *pBlockIndex);
+static uint32_t virt_to_bus(const volatile void *pVirt);
+static volatile void *bus_to_virt(uint32_t busAddress);
+static uint32_t mailbox_call(int fd, uint32_t tag, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+static bool alloc_dma_memory();
+static void free_dma_memory();
+static void verify_mock_trace(DMA_TIMING *pTiming);
+static void audit_mock_chain(int chain, int64_t nowNs);
+static void *thread_mock_dma(void *arg);
+
+
+static volatile uint32_t *_pDmaRegisters;
+static volatile uint32_t *_pDmaChannel;
+static volatile uint32_t *_pPwmRegisters;
+
+static volatile DMA_MEMORY *_pDmaMemory;
+static uint32_t _dmaBusAddress;
+static uint32_t _dmaMemoryHandle;
+static size_t _dmaMemorySize;
+static int _mailboxFd = -1;
+
+static DMA_CHAIN _chains[2];
+static int _nextChain = 0;
+static bool _dmaRunning = false;
+static double _tickNs = DMA_TICK_US * 1e3;
+
+static pthread_t _mockThreadId;
+static volatile bool _mockRun = false;
+static struct timespec _mockStartTime;
+static volatile uint64_t _mockBlockStartWords;
+static uint64_t _traceCursor = 0;
+static DMA_TIMING _mockVerify;
+
+
+static void init_idle_chain(int chain)
+{
+  // Every chain ends in the idle block, which paces forever without
+  // touching the GPIO. A chain is only linked on to the next minute once
+  // that minute is fully loaded, so a late refill stops the keying rather
+  // than repeating an old minute. An unloaded chain is a single gap that
+  // falls straight into the idle block.
+  volatile DMA_CONTROL_BLOCK *pIdle = &_pDmaMemory->idleBlock;
+  pIdle->transferInfo = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_PWM);
+  pIdle->sourceAddress = virt_to_bus(&_pDmaMemory->pacingWord);
+  pIdle->destinationAddress = BUS_PWM_FIF1;
+  pIdle->transferLength = DMA_MAX_GAP_TICKS * sizeof(uint32_t);
+  pIdle->stride = 0;
+  pIdle->nextControlBlock = virt_to_bus(pIdle);
+
+  volatile DMA_CONTROL_BLOCK *pBlock = &_pDmaMemory->controlBlocks[chain][0];
+  *pBlock = *pIdle;
+  pBlock->nextControlBlock = virt_to_bus(pIdle);
+
+  _chains[chain].minuteStart = 0;
+  _chains[chain].blockCount = 1;
+  _chains[chain].finalGapBlock = 0;
+  _chains[chain].finalGapTicks = DMA_MAX_GAP_TICKS;
+  _chains[chain].corrected = true;
+  _chains[chain].blockTicks[0] = 0;
+  _chains[chain].edgeCount = 0;
+}
+
+
+static uint32_t add_gap_blocks(int chain, uint32_t blockIndex, uint32_t *pTick, uint32_t targetTick)
+{
+  volatile DMA_CONTROL_BLOCK *pBlocks = _pDmaMemory->controlBlocks[chain];
+
+  while (*pTick < targetTick && blockIndex < DMA_MAX_CONTROL_BLOCKS)
+  {
+    uint32_t ticks = targetTick - *pTick;
+    if (ticks > DMA_MAX_GAP_TICKS)
+      ticks = DMA_MAX_GAP_TICKS;
+
+    pBlocks[blockIndex].transferInfo = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_PWM);
+    pBlocks[blockIndex].sourceAddress = virt_to_bus(&_pDmaMemory->pacingWord);
+    pBlocks[blockIndex].destinationAddress = BUS_PWM_FIF1;
+    pBlocks[blockIndex].transferLength = ticks * sizeof(uint32_t);
+    pBlocks[blockIndex].stride = 0;
+    pBlocks[blockIndex].nextControlBlock = virt_to_bus(&pBlocks[blockIndex + 1]);
+
+    _chains[chain].blockTicks[blockIndex] = *pTick;
+    _chains[chain].finalGapBlock = blockIndex;
+    _chains[chain].finalGapTicks = ticks;
+
+    *pTick += ticks;
+    blockIndex++;
+  }
+
+  return blockIndex;
+}
+
+
+static int find_chain(uint32_t busAddress, uint32_t *pBlockIndex)
+{
+  for (int chain = 0; chain < 2; chain++)
+  {
+    uint32_t first = virt_to_bus(&_pDmaMemory->controlBlocks[chain][0]);
+    uint32_t last = virt_to_bus(&_pDmaMemory->controlBlocks[chain][DMA_MAX_CONTROL_BLOCKS - 1]);
+
+    if (busAddress >= first && busAddress <= last)
+    {
+      *pBlockIndex = (busAddress - first) / sizeof(DMA_CONTROL_BLOCK);
+      return chain;
+    }
+  }
+
+  return -1;
+}
+
+
+static uint32_t virt_to_bus(const volatile void *pVirt)
+{
+  return _dmaBusAddress + (uint32_t)((const volatile uint8_t*)pVirt - (const volatile uint8_t*)_pDmaMemory);
+}
+
+
+static volatile void *bus_to_virt(uint32_t busAddress)
+{
+  return (volatile uint8_t*)_pDmaMemory + (busAddress - _dmaBusAddress);
+}
+
+
+static uint32_t mailbox_call(int fd, uint32_t tag, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+  uint32_t buffer[9] =
+  {
+    sizeof(buffer),  // Buffer size
+    0,               // Process request
+    tag,             // Tag identifier
+    12,              // Value buffer size
+    12,              // Request size
+    arg0, arg1, arg2,
+    0                // End tag
+  };
+
+  if (ioctl(fd, MAILBOX_IOCTL, buffer) < 0)
+    return 0;
+
+  return buffer[5];
+}
+
+
+static bool alloc_dma_memory()
+{
+  long pageSize = getpagesize();
+  _dmaMemorySize = (sizeof(DMA_MEMORY) + pageSize - 1) / pageSize * pageSize;
+
+  if (is_mock_registers())
+  {
+    void *pMem = NULL;
+    if (posix_memalign(&pMem, pageSize, _dmaMemorySize))
+      return false;
+
+    _pDmaMemory = pMem;
+    _dmaBusAddress = MOCK_BUS_ADDRESS;
+    return true;
+  }
+
+  // DMA control blocks must live in memory the GPU allocated for us, since
+  // the DMA engine only understands bus addresses and bypasses the ARM cache.
+  _mailboxFd = open("/dev/vcio", 0);
+  if (_mailboxFd < 0)
+  {
+    perror("Failed to open /dev/vcio");
+    return false;
+  }
+
+  uint32_t memFlags = (get_detected_pi_model() == PI_MODEL_1) ? MEM_FLAG_L1_NONALLOCATING : MEM_FLAG_DIRECT;
+  _dmaMemoryHandle = mailbox_call(_mailboxFd, MAILBOX_TAG_ALLOCATE, _dmaMemorySize, pageSize, memFlags);
+  if (_dmaMemoryHandle == 0)
+  {
+    fprintf(stderr, "Failed to allocate DMA memory from mailbox.\n");
+    return false;
+  }
+
+  _dmaBusAddress = mailbox_call(_mailboxFd, MAILBOX_TAG_LOCK, _dmaMemoryHandle, 0, 0);
+  if (_dmaBusAddress == 0)
+  {
+    fprintf(stderr, "Failed to lock DMA memory.\n");
+    return false;
+  }
+
+  int fd = open("/dev/mem", O_RDWR | O_SYNC);
+  if (fd < 0)
+  {
+    perror("Failed to open /dev/mem");
+    return false;
+  }
+
+  void *pMem = mmap(NULL, _dmaMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, BUS_TO_PHYS(_dmaBusAddress));
+  close(fd);
+
+  if (pMem == MAP_FAILED)
+  {
+    perror("Failed to map DMA memory");
+    return false;
+  }
+
+  _pDmaMemory = pMem;
+  return true;
+}
+
+
+static void free_dma_memory()
+{
+  if (_pDmaMemory == NULL)
+    return;
+
+  if (is_mock_registers())
+  {
+    free((void*)_pDmaMemory);
+    _pDmaMemory = NULL;
+    return;
+  }
+
+  munmap((void*)_pDmaMemory, _dmaMemorySize);
+  _pDmaMemory = NULL;
+
+  if (_mailboxFd >= 0)
+  {
+    mailbox_call(_mailboxFd, MAILBOX_TAG_UNLOCK, _dmaMemoryHandle, 0, 0);
+    mailbox_call(_mailboxFd, MAILBOX_TAG_RELEASE, _dmaMemoryHandle, 0, 0);
+    close(_mailboxFd);
+    _mailboxFd = -1;
+  }
+}
+
+
+bool dma_keying_init()
+{
+  // The Pi 5 GPIO and clocks are behind RP1, which the BCM DMA engine cannot reach.
+  if (get_detected_pi_model() == PI_MODEL_5)
+  {
+    fprintf(stderr, "Error: DMA keying is not supported on Raspberry Pi 5.\n");
+    return false;
+  }
+
+  _pDmaRegisters = map_bcm_register(DMA_REGISTER_OFFSET);
+  _pPwmRegisters = map_bcm_register(PWM_REGISTER_OFFSET);
+  if (_pDmaRegisters == NULL || _pPwmRegisters == NULL)
+  {
+    fprintf(stderr, "Failed to map DMA and PWM registers.\n");
+    return false;
+  }
+
+  _pDmaChannel = _pDmaRegisters + DMA_CHANNEL * DMA_CHANNEL_WORDS;
+
+  if (!alloc_dma_memory())
+  {
+    fprintf(stderr, "Failed to allocate DMA memory.\n");
+    return false;
+  }
+
+  memset((void*)_pDmaMemory, 0, sizeof(DMA_MEMORY));
+  init_idle_chain(0);
+  init_idle_chain(1);
+  _nextChain = 0;
+
+  // Set up PWM channel 1 as a FIFO consumer that raises DREQ once per tick.
+  _pPwmRegisters[PWM_CTL] = 0;
+  usleep(10);
+
+  double pwmFrequency = start_pwm_clock(PWM_CLOCK_FREQUENCY);
+  if (pwmFrequency <= 0)
+  {
+    fprintf(stderr, "Failed to start PWM clock.\n");
+    return false;
+  }
+
+  _tickNs = PWM_RANGE * 1e9 / pwmFrequency;
+
+  _pPwmRegisters[PWM_RNG1] = PWM_RANGE;
+  _pPwmRegisters[PWM_DMAC] = PWM_DMAC_ENAB | PWM_DMAC_PANIC(1) | PWM_DMAC_DREQ(1);
+  _pPwmRegisters[PWM_CTL] = PWM_CTL_CLRF1;
+  usleep(10);
+  _pPwmRegisters[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1;
+
+  _pDmaRegisters[DMA_ENABLE] |= (1 << DMA_CHANNEL);
+  _pDmaChannel[DMA_CS] = DMA_CS_RESET;
+  usleep(10);
+
+  printf("DMA keying on channel %d with %.4lf us ticks (PWM clock %.4lf MHz)\n\n",
+         DMA_CHANNEL, _tickNs / 1e3, pwmFrequency / 1e6);
+  fflush(stdout);
+
+  return true;
+}
+
+
+bool dma_keying_load_minute(time_t minuteStart, const DMA_EDGE *edges, size_t count)
+{
+  if (count > DMA_MAX_EDGES)
+  {
+    fprintf(stderr, "Error: Too many DMA keying edges (%zu).\n", count);
+    return false;
+  }
+
+  int chain = _nextChain;
+  uint32_t activeBlock;
+
+  // We always load the chain the DMA engine is not running. If it is already
+  // running this chain, the previous refill was more than a minute late.
+  // If it has fallen into the idle block, a refill was missed and keying
+  // has stopped.
+  uint32_t activeAddress = _dmaRunning ? _pDmaChannel[DMA_CONBLK_AD] : 0;
+  if (_dmaRunning && find_chain(activeAddress, &activeBlock) == chain)
+  {
+    fprintf(stderr, "Error: DMA keying chain overrun.\n");
+    return false;
+  }
+
+  if (_dmaRunning && activeAddress == virt_to_bus(&_pDmaMemory->idleBlock))
+  {
+    fprintf(stderr, "Error: DMA keying ran out of loaded minutes.\n");
+    return false;
+  }
+
+  volatile DMA_CONTROL_BLOCK *pBlocks = _pDmaMemory->controlBlocks[chain];
+  volatile uint32_t *pFselValues = _pDmaMemory->fselValues[chain];
+  DMA_CHAIN *pChain = &_chains[chain];
+
+  uint32_t blockIndex = 0;
+  uint32_t tick = 0;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    uint32_t edgeTick = (edges[i].offsetUs + DMA_TICK_US / 2) / DMA_TICK_US;
+    if (edgeTick < tick || edgeTick >= DMA_TICKS_PER_MINUTE)
+    {
+      fprintf(stderr, "Error: DMA keying edges must be sorted within the minute.\n");
+      return false;
+    }
+
+    blockIndex = add_gap_blocks(chain, blockIndex, &tick, edgeTick);
+    if (blockIndex >= DMA_MAX_CONTROL_BLOCKS - 1)
+    {
+      fprintf(stderr, "Error: Too many DMA control blocks.\n");
+      return false;
+    }
+
+    pFselValues[i] = edges[i].fsel;
+
+    pBlocks[blockIndex].transferInfo = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP;
+    pBlocks[blockIndex].sourceAddress = virt_to_bus(&pFselValues[i]);
+    pBlocks[blockIndex].destinationAddress = BUS_GPIO_GPFSEL0;
+    pBlocks[blockIndex].transferLength = sizeof(uint32_t);
+    pBlocks[blockIndex].stride = 0;
+    pBlocks[blockIndex].nextControlBlock = virt_to_bus(&pBlocks[blockIndex + 1]);
+    pChain->blockTicks[blockIndex] = tick;
+    blockIndex++;
+  }
+
+  blockIndex = add_gap_blocks(chain, blockIndex, &tick, DMA_TICKS_PER_MINUTE);
+  if (tick != DMA_TICKS_PER_MINUTE)
+  {
+    fprintf(stderr, "Error: Too many DMA control blocks.\n");
+    return false;
+  }
+
+  // The last gap of the minute falls into the idle block until the
+  // following minute has been loaded into the other chain.
+  pBlocks[blockIndex - 1].nextControlBlock = virt_to_bus(&_pDmaMemory->idleBlock);
+
+  // The minute this chain last keyed is over, so any of its edges still
+  // without a register write are counted before it is replaced.
+  if (is_mock_registers())
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    audit_mock_chain(chain, TIMESPEC_TO_NS(now));
+  }
+
+  pChain->minuteStart = minuteStart;
+  pChain->blockCount = blockIndex;
+  pChain->corrected = false;
+  pChain->edgeCount = count;
+  memcpy(pChain->edges, edges, count * sizeof(DMA_EDGE));
+  memset(pChain->edgeWritten, 0, sizeof(pChain->edgeWritten));
+  pChain->audited = false;
+
+  __sync_synchronize();
+  _nextChain = !chain;
+
+  // Only now that this chain is complete is the previous minute linked on
+  // to it. This is safe while the DMA has not yet loaded that minute's
+  // final gap block, which is at most DMA_MAX_GAP_TICKS long.
+  DMA_CHAIN *pPrevious = &_chains[!chain];
+  if (pPrevious->minuteStart == minuteStart - 60)
+  {
+    _pDmaMemory->controlBlocks[!chain][pPrevious->blockCount - 1].nextControlBlock = virt_to_bus(&pBlocks[0]);
+    __sync_synchronize();
+  }
+
+  return true;
+}
+
+
+bool dma_keying_start(time_t minuteStart)
+{
+  if (_chains[0].minuteStart != minuteStart)
+  {
+    fprintf(stderr, "Error: DMA keying start minute is not loaded.\n");
+    return false;
+  }
+
+  struct timespec targetWait = { .tv_sec = minuteStart - 1, .tv_nsec = 1000000000 - DMA_START_LEAD_NS };
+  clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+
+  // The lead block burns off the time remaining until the minute starts.
+  // The first FIFO words are accepted immediately, so they are added on top.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t leadNs = (minuteStart - now.tv_sec) * 1000000000LL - now.tv_nsec;
+  if (leadNs < 0)
+  {
+    fprintf(stderr, "Error: DMA keying started too late.\n");
+    return false;
+  }
+
+  uint32_t leadTicks = lround(leadNs / _tickNs) + DMA_FIFO_LEAD_TICKS;
+
+  volatile DMA_CONTROL_BLOCK *pLead = &_pDmaMemory->leadBlock;
+  pLead->transferInfo = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_PWM);
+  pLead->sourceAddress = virt_to_bus(&_pDmaMemory->pacingWord);
+  pLead->destinationAddress = BUS_PWM_FIF1;
+  pLead->transferLength = leadTicks * sizeof(uint32_t);
+  pLead->stride = 0;
+  pLead->nextControlBlock = virt_to_bus(&_pDmaMemory->controlBlocks[0][0]);
+  __sync_synchronize();
+
+  _pDmaChannel[DMA_CS] = DMA_CS_INT | DMA_CS_END;
+  _pDmaChannel[DMA_CONBLK_AD] = virt_to_bus(pLead);
+  _pDmaChannel[DMA_DEBUG] = 7;  // Clear error flags
+  _pDmaChannel[DMA_CS] = DMA_CS_WAIT_FOR_OUTSTANDING_WRITES | DMA_CS_PANIC_PRIORITY(15) |
+                         DMA_CS_PRIORITY(15) | DMA_CS_ACTIVE;
+  _dmaRunning = true;
+
+  if (is_mock_registers())
+  {
+    REGISTER_WRITE discard[64];
+    while (read_register_trace(discard, ARRAY_LENGTH(discard), &_traceCursor) > 0)
+      ;
+
+    _mockStartTime = now;
+    _mockRun = true;
+    if (!start_helper_thread(&_mockThreadId, thread_mock_dma))
+    {
+      fprintf(stderr, "Failed to create mock DMA thread.\n");
+      _mockRun = false;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool dma_keying_measure(DMA_TIMING *pTiming)
+{
+  int64_t beforeNs, afterNs;
+  uint32_t blockIndex = 0;
+
+  memset(pTiming, 0, sizeof(DMA_TIMING));
+  pTiming->tickNs = _tickNs;
+  pTiming->edgeCount = _chains[!_nextChain].edgeCount;
+  pTiming->blockCount = _chains[!_nextChain].blockCount;
+
+  if (!_dmaRunning)
+    return false;
+
+  beforeNs = timestamp_now_ns();
+  uint32_t blockAddress = _pDmaChannel[DMA_CONBLK_AD];
+  uint32_t remainingBytes = _pDmaChannel[DMA_TXFR_LEN];
+  afterNs = timestamp_now_ns();
+
+  int chain = find_chain(blockAddress, &blockIndex);
+  if (chain < 0 || _chains[chain].minuteStart == 0 || blockIndex >= _chains[chain].blockCount)
+    return false;
+
+  DMA_CHAIN *pChain = &_chains[chain];
+  volatile DMA_CONTROL_BLOCK *pBlock = &_pDmaMemory->controlBlocks[chain][blockIndex];
+
+  // The other chain's minute is over, so it is pointed back at the idle
+  // block. Nothing links into it again until it is reloaded.
+  DMA_CHAIN *pFinished = &_chains[!chain];
+  if (pFinished->minuteStart != 0 && pFinished->minuteStart < pChain->minuteStart)
+  {
+    _pDmaMemory->controlBlocks[!chain][pFinished->blockCount - 1].nextControlBlock = virt_to_bus(&_pDmaMemory->idleBlock);
+    __sync_synchronize();
+  }
+
+  // The mock DMA thread only updates TXFR_LEN between its paced sleeps,
+  // so derive the remaining length from its pacing model instead.
+  if (is_mock_registers() && (pBlock->transferInfo & DMA_TI_DEST_DREQ))
+  {
+    int64_t elapsedNs = beforeNs - TIMESPEC_TO_NS(_mockStartTime);
+    int64_t doneBytes = ((int64_t)(elapsedNs / _tickNs) + DMA_FIFO_LEAD_TICKS - _mockBlockStartWords) * sizeof(uint32_t);
+
+    if (doneBytes < 0)
+      doneBytes = 0;
+    if (doneBytes > pBlock->transferLength)
+      doneBytes = pBlock->transferLength;
+
+    remainingBytes = pBlock->transferLength - doneBytes;
+  }
+
+  uint32_t ticksDone = pChain->blockTicks[blockIndex];
+  if (pBlock->transferInfo & DMA_TI_DEST_DREQ)
+    ticksDone += (pBlock->transferLength - remainingBytes) / sizeof(uint32_t);
+
+  // Words written lead the edges they time by the FIFO depth in use.
+  int64_t nowNs = (beforeNs + afterNs) / 2 - pChain->minuteStart * NSEC_PER_SEC;
+  pTiming->errorNs = nowNs - llround(((int64_t)ticksDone - DMA_FIFO_LEAD_TICKS) * _tickNs);
+
+  // Shorten or lengthen the final gap of the running minute so the next
+  // minute starts on time. This is only safe before the DMA loads that block.
+  if (!pChain->corrected && blockIndex < pChain->finalGapBlock)
+  {
+    int32_t correction = lround(pTiming->errorNs / _tickNs);
+    if (correction > DMA_MAX_CORRECTION_TICKS)
+      correction = DMA_MAX_CORRECTION_TICKS;
+    if (correction < -DMA_MAX_CORRECTION_TICKS)
+      correction = -DMA_MAX_CORRECTION_TICKS;
+
+    volatile DMA_CONTROL_BLOCK *pFinal = &_pDmaMemory->controlBlocks[chain][pChain->finalGapBlock];
+    pFinal->transferLength = (pChain->finalGapTicks - correction) * sizeof(uint32_t);
+    pChain->corrected = true;
+    pTiming->correctionTicks = correction;
+  }
+
+  if (is_mock_registers())
+    verify_mock_trace(pTiming);
+
+  return true;
+}
+
+
+static void verify_mock_trace(DMA_TIMING *pTiming)
+{
+  // Match GPFSEL writes recorded by the mock registers against the edges we
+  // asked for, on both value and time. Each edge is matched by one write at
+  // most, and writes matching no edge are counted separately from edges
+  // that were never written. The trace buffer is static as this runs on the
+  // real-time thread's small stack.
+  static REGISTER_WRITE trace[256];
+  size_t count;
+
+  while ((count = read_register_trace(trace, ARRAY_LENGTH(trace), &_traceCursor)) > 0)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      if (trace[i].block != REGISTER_BLOCK_GPIO || trace[i].word != 0)
+        continue;
+
+      int bestChain = -1;
+      size_t bestEdge = 0;
+      int64_t bestErrorNs = INT64_MAX;
+      for (int chain = 0; chain < 2; chain++)
+      {
+        for (size_t e = 0; e < _chains[chain].edgeCount; e++)
+        {
+          if (_chains[chain].edgeWritten[e] || _chains[chain].edges[e].fsel != trace[i].value)
+            continue;
+
+          int64_t errorNs = (trace[i].time.tv_sec - _chains[chain].minuteStart) * 1000000000LL +
+                            trace[i].time.tv_nsec - _chains[chain].edges[e].offsetUs * 1000LL;
+          if (llabs(errorNs) < llabs(bestErrorNs))
+          {
+            bestChain = chain;
+            bestEdge = e;
+            bestErrorNs = errorNs;
+          }
+        }
+      }
+
+      if (bestChain < 0 || llabs(bestErrorNs) > MOCK_TRACE_TOLERANCE_NS)
+      {
+        _mockVerify.unmatchedWrites++;
+        continue;
+      }
+
+      _chains[bestChain].edgeWritten[bestEdge] = true;
+      _mockVerify.verifiedEdges++;
+      if (llabs(bestErrorNs) > llabs(_mockVerify.maxTraceErrorNs))
+        _mockVerify.maxTraceErrorNs = bestErrorNs;
+    }
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (int chain = 0; chain < 2; chain++)
+    audit_mock_chain(chain, TIMESPEC_TO_NS(now));
+
+  pTiming->verifiedEdges = _mockVerify.verifiedEdges;
+  pTiming->missedEdges = _mockVerify.missedEdges;
+  pTiming->unmatchedWrites = _mockVerify.unmatchedWrites;
+  pTiming->maxTraceErrorNs = _mockVerify.maxTraceErrorNs;
+}
+
+
+static void audit_mock_chain(int chain, int64_t nowNs)
+{
+  // Once a chain's minute is over and every write it made has had time to
+  // reach the trace, its edges still unmatched were dropped by the chain.
+  DMA_CHAIN *pChain = &_chains[chain];
+  if (pChain->audited || pChain->minuteStart == 0 ||
+      nowNs < (pChain->minuteStart + 60) * NSEC_PER_SEC + MOCK_TRACE_TOLERANCE_NS)
+    return;
+
+  for (size_t e = 0; e < pChain->edgeCount; e++)
+  {
+    if (!pChain->edgeWritten[e])
+      _mockVerify.missedEdges++;
+  }
+
+  pChain->audited = true;
+}
+
+
+void dma_keying_stop()
+{
+  if (_dmaRunning)
+  {
+    if (_mockRun)
+    {
+      _mockRun = false;
+      pthread_join(_mockThreadId, NULL);
+    }
+
+    _pDmaChannel[DMA_CS] = DMA_CS_ABORT;
+    usleep(100);
+    _pDmaChannel[DMA_CS] = DMA_CS_RESET;
+    _dmaRunning = false;
+  }
+
+  if (_pPwmRegisters != NULL)
+  {
+    _pPwmRegisters[PWM_CTL] = 0;
+    _pPwmRegisters[PWM_DMAC] = 0;
+    stop_pwm_clock();
+  }
+
+  free_dma_memory();
+}
+
+
+static void *thread_mock_dma(void *arg)
+{
+  // Walks the control block chain the way the DMA engine would, writing
+  // GPFSEL values through the mock registers and pacing gaps in real time.
+  uint32_t blockAddress = _pDmaChannel[DMA_CONBLK_AD];
+  uint64_t wordsWritten = 0;
+  struct timespec targetWait;
+
+  while (_mockRun && blockAddress != 0)
+  {
+    volatile DMA_CONTROL_BLOCK *pBlock = bus_to_virt(blockAddress);
+    DMA_CONTROL_BLOCK block = *pBlock;
+
+    _mockBlockStartWords = wordsWritten;
+    _pDmaChannel[DMA_CONBLK_AD] = blockAddress;
+    _pDmaChannel[DMA_TXFR_LEN] = block.transferLength;
+
+    if (block.transferInfo & DMA_TI_DEST_DREQ)
+    {
+      uint32_t words = block.transferLength / sizeof(uint32_t);
+      uint32_t done = 0;
+
+      while (_mockRun && done < words)
+      {
+        uint32_t chunk = (words - done > MOCK_CHUNK_TICKS) ? MOCK_CHUNK_TICKS : words - done;
+        done += chunk;
+        wordsWritten += chunk;
+
+        if (wordsWritten > DMA_FIFO_LEAD_TICKS)
+        {
+          int64_t waitNs = _mockStartTime.tv_nsec + llround((wordsWritten - DMA_FIFO_LEAD_TICKS) * _tickNs);
+          targetWait.tv_sec = _mockStartTime.tv_sec + waitNs / 1000000000LL;
+          targetWait.tv_nsec = waitNs % 1000000000LL;
+          clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+        }
+
+        _pDmaChannel[DMA_TXFR_LEN] = (words - done) * sizeof(uint32_t);
+      }
+    }
+    else
+    {
+      mock_bus_write(block.destinationAddress, *(volatile uint32_t*)bus_to_virt(block.sourceAddress));
+    }
+
+    blockAddress = block.nextControlBlock;
+  }
+
+  return NULL;
+}
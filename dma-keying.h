@@ -0,0 +1,58 @@
+/*
+dma-keying.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __DMA_KEYING_H__
+#define __DMA_KEYING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define DMA_MAX_EDGES 512  // Maximum keying edges per minute
+
+typedef struct
+{
+  uint32_t offsetUs;  // Edge time in microseconds from start of minute
+  uint32_t fsel;      // GPFSEL register value to write at edge
+} DMA_EDGE;
+
+typedef struct
+{
+  int64_t errorNs;           // DMA edge time minus system time (positive = late)
+  int32_t correctionTicks;   // Ticks removed from the end of the running minute
+  double tickNs;             // Actual pacing tick length
+  uint32_t edgeCount;        // Edges in the most recently loaded minute
+  uint32_t blockCount;       // Control blocks in the most recently loaded minute
+  uint32_t verifiedEdges;    // Mock only: register writes matched to intended edges
+  uint32_t missedEdges;      // Mock only: intended edges without a matching write
+  uint32_t unmatchedWrites;  // Mock only: register writes matching no intended edge
+  int64_t maxTraceErrorNs;   // Mock only: largest matched register write time error
+} DMA_TIMING;
+
+bool dma_keying_init();
+bool dma_keying_load_minute(time_t minuteStart, const DMA_EDGE *edges, size_t count);
+bool dma_keying_start(time_t minuteStart);
+bool dma_keying_measure(DMA_TIMING *pTiming);
+void dma_keying_stop();
+
+#endif  // __DMA_KEYING_H__
@@ -0,0 +1,164 @@
+/*
+edge-calibration.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include "macros.h"
+#include "common.h"
+#include "clock-control.h"
+#include "timestamp.h"
+#include "edge-calibration.h"
+
+
+// Each board takes a different time from a timer expiring to the keying
+// register write landing. The calibration sleeps to a series of targets
+// as the keying loop does and writes the outputs off each time, which is
+// safe before the first frame. Edges are then advanced by the median.
+
+#define CALIBRATION_JITTER_NS 37000  // Moves each target within the timer tick
+
+
+bool calibrate_edge_latency(uint32_t outputMask, uint32_t sampleCount, int64_t spacingNs, EDGE_CALIBRATION *pCal)
+{
+  // Wake-ups are spacingNs apart, which must leave a thread with a
+  // SCHED_DEADLINE reservation no more than one wake-up per period.
+  // Samples are too many for the real-time thread's small stack.
+  static int64_t latencies[CALIBRATION_MAX_SAMPLES];
+
+  if (sampleCount < 1 || sampleCount > CALIBRATION_MAX_SAMPLES)
+    return false;
+
+  int64_t targetNs = timestamp_now_ns() + spacingNs;
+
+  for (uint32_t i = 0; i < sampleCount; i++)
+  {
+    int64_t sampleTargetNs = targetNs + (i * CALIBRATION_JITTER_NS) % spacingNs;
+    struct timespec target = NS_TO_TIMESPEC(sampleTargetNs);
+    clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &target, NULL);
+
+    set_clock_outputs(outputMask, 0);
+    latencies[i] = timestamp_now_ns() - sampleTargetNs;
+    targetNs += spacingNs;
+  }
+
+  qsort(latencies, sampleCount, sizeof(latencies[0]), compare_int64);
+
+  pCal->samples = sampleCount;
+  pCal->minNs = latencies[0];
+  pCal->medianNs = latencies[sampleCount / 2];
+  pCal->p90Ns = latencies[(sampleCount * 9) / 10];
+  pCal->maxNs = latencies[sampleCount - 1];
+
+  return true;
+}
+
+
+int64_t get_edge_advance(const EDGE_CALIBRATION *pCal)
+{
+  if (pCal->samples == 0 || pCal->medianNs <= 0)
+    return 0;
+
+  return pCal->medianNs < CALIBRATION_MAX_ADVANCE_NS ? pCal->medianNs : CALIBRATION_MAX_ADVANCE_NS;
+}
+
+
+bool load_edge_calibration(const char *path, EDGE_CALIBRATION *pCal)
+{
+  // The file holds one line per host:
+  // HOSTNAME SAMPLES MIN_NS MEDIAN_NS P90_NS MAX_NS
+  char hostName[HOST_NAME_MAX + 1] = "";
+  if (gethostname(hostName, sizeof(hostName) - 1) < 0)
+    return false;
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return false;
+
+  char line[512];
+  char lineHost[256];
+  EDGE_CALIBRATION cal;
+  bool found = false;
+
+  while (!found && fgets(line, sizeof(line), fp) != NULL)
+  {
+    found = (sscanf(line, "%255s %" SCNu32 " %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64, lineHost,
+                    &cal.samples, &cal.minNs, &cal.medianNs, &cal.p90Ns, &cal.maxNs) == 6 &&
+             !strcmp(lineHost, hostName));
+  }
+
+  fclose(fp);
+
+  if (found)
+    *pCal = cal;
+
+  return found;
+}
+
+
+bool save_edge_calibration(const char *path, const EDGE_CALIBRATION *pCal)
+{
+  // Lines of other hosts are kept, so one file can be shared.
+  char hostName[HOST_NAME_MAX + 1] = "";
+  if (gethostname(hostName, sizeof(hostName) - 1) < 0)
+    return false;
+
+  char tempPath[PATH_MAX];
+  if (snprintf(tempPath, sizeof(tempPath), "%s.tmp", path) >= (int)sizeof(tempPath))
+    return false;
+
+  FILE *fpOut = fopen(tempPath, "w");
+  if (fpOut == NULL)
+    return false;
+
+  FILE *fpIn = fopen(path, "r");
+  if (fpIn != NULL)
+  {
+    char line[512];
+    char lineHost[256];
+    while (fgets(line, sizeof(line), fpIn) != NULL)
+    {
+      if (sscanf(line, "%255s", lineHost) == 1 && strcmp(lineHost, hostName))
+        fputs(line, fpOut);
+    }
+
+    fclose(fpIn);
+  }
+
+  fprintf(fpOut, "%s %" PRIu32 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+          hostName, pCal->samples, pCal->minNs, pCal->medianNs, pCal->p90Ns, pCal->maxNs);
+
+  bool written = !ferror(fpOut);
+  if (fclose(fpOut) != 0 || !written || rename(tempPath, path) < 0)
+  {
+    unlink(tempPath);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,47 @@
+/*
+edge-calibration.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __EDGE_CALIBRATION_H__
+#define __EDGE_CALIBRATION_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CALIBRATION_MAX_SAMPLES 10000
+#define CALIBRATION_MAX_ADVANCE_NS 1000000  // Largest edge advance applied
+#define CALIBRATION_SPACING_NS     1000000  // Default time between calibration wake-ups
+
+typedef struct
+{
+  uint32_t samples;  // Wake-ups measured
+  int64_t minNs;     // Latency from target to register write landing
+  int64_t medianNs;
+  int64_t p90Ns;
+  int64_t maxNs;
+} EDGE_CALIBRATION;
+
+bool calibrate_edge_latency(uint32_t outputMask, uint32_t sampleCount, int64_t spacingNs, EDGE_CALIBRATION *pCal);
+int64_t get_edge_advance(const EDGE_CALIBRATION *pCal);
+bool load_edge_calibration(const char *path, EDGE_CALIBRATION *pCal);
+bool save_edge_calibration(const char *path, const EDGE_CALIBRATION *pCal);
+
+#endif  // __EDGE_CALIBRATION_H__
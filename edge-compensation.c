@@ -0,0 +1,76 @@
+/*
+edge-compensation.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <math.h>
+#include "edge-calibration.h"
+#include "edge-compensation.h"
+
+
+// A startup calibration drifts with temperature, load and kernel version,
+// so the edge advance is adjusted by a PI loop on each edge's lateness.
+// The gains are low as lateness is mostly wake-up jitter, and the aim is
+// only to keep the mean near zero.
+
+#define COMPENSATION_KP 0.05
+#define COMPENSATION_KI 0.01
+#define COMPENSATION_MEAN_WEIGHT   (1.0 / 64)
+#define COMPENSATION_ANOMALY_NS    300000  // Lateness taken as a disturbance rather than drift
+#define COMPENSATION_FREEZE_EDGES  8       // Edges ignored after an anomaly
+
+
+void edge_controller_init(EDGE_CONTROLLER *pCtl, int64_t baseNs)
+{
+  *pCtl = (EDGE_CONTROLLER){ .baseNs = baseNs, .integralNs = baseNs, .advanceNs = baseNs };
+}
+
+
+void edge_controller_update(EDGE_CONTROLLER *pCtl, int64_t latenessNs)
+{
+  // A late edge (positive lateness) increases the advance. The advance
+  // is held while edges are disturbed, e.g. by a load spike, and for a
+  // few edges after.
+  if (llabs(latenessNs) > COMPENSATION_ANOMALY_NS)
+  {
+    pCtl->freezeCount = COMPENSATION_FREEZE_EDGES;
+    pCtl->frozenEdges++;
+    return;
+  }
+
+  if (pCtl->freezeCount > 0)
+  {
+    pCtl->freezeCount--;
+    pCtl->frozenEdges++;
+    return;
+  }
+
+  pCtl->meanErrorNs += (latenessNs - pCtl->meanErrorNs) * COMPENSATION_MEAN_WEIGHT;
+
+  // The integral is bounded to the allowed advance so it cannot wind up.
+  pCtl->integralNs = fmin(fmax(pCtl->integralNs + COMPENSATION_KI * latenessNs, 0), CALIBRATION_MAX_ADVANCE_NS);
+
+  double advanceNs = pCtl->integralNs + COMPENSATION_KP * latenessNs;
+  pCtl->advanceNs = llround(fmin(fmax(advanceNs, 0), CALIBRATION_MAX_ADVANCE_NS));
+  pCtl->updates++;
+}
@@ -0,0 +1,50 @@
+/*
+edge-compensation.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __EDGE_COMPENSATION_H__
+#define __EDGE_COMPENSATION_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum EdgeTransition
+{
+  EDGE_TRANSITION_ON,   // Groups turning at least one output on
+  EDGE_TRANSITION_OFF,  // Groups only turning outputs off
+  EDGE_TRANSITION_COUNT
+};
+
+typedef struct
+{
+  int64_t baseNs;        // Starting advance, from calibration
+  double integralNs;     // Integral term, including the base
+  int64_t advanceNs;     // Advance applied to the next edge
+  double meanErrorNs;    // Slow average of lateness with the advance applied
+  uint64_t updates;      // Edges used to adjust the advance
+  uint64_t frozenEdges;  // Edges ignored as or after an anomaly
+  uint32_t freezeCount;  // Edges still to be ignored
+} EDGE_CONTROLLER;
+
+void edge_controller_init(EDGE_CONTROLLER *pCtl, int64_t baseNs);
+void edge_controller_update(EDGE_CONTROLLER *pCtl, int64_t latenessNs);
+
+#endif  // __EDGE_COMPENSATION_H__
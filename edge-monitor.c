@@ -0,0 +1,381 @@
+/*
+edge-monitor.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <libgen.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "macros.h"
+#include "common.h"
+#include "clock-control.h"
+#include "metrics.h"
+#include "edge-monitor.h"
+
+
+// The keyed output, or a detector on the antenna, can be wired back to a
+// second GPIO. Its edges are read from the GPIO character device with
+// kernel timestamps, away from the real-time thread, and matched against
+// the edges that thread intended to key. This gives the true on-pin timing
+// error and catches pulses that never made it out.
+//
+// A detector gives one edge per transition. A direct loopback of the
+// carrier gives a burst of edges at the carrier frequency, which is
+// treated as on until the line stays low for MONITOR_GAP_NS. Either way
+// the result is a series of on and off transitions.
+//
+// With mock registers there is no real output, so when the input is a
+// gpio-sim line, the real-time thread drives its pull at each intended
+// edge instead. Reference: https://docs.kernel.org/admin-guide/gpio/gpio-sim.html
+
+#define MONITOR_PENDING    64          // Unmatched edges held on each side
+#define MONITOR_EVENTS     64          // Events read at a time
+#define MONITOR_POLL_MS    100
+#define MONITOR_EXPIRE_NS  (MONITOR_WINDOW_NS + MONITOR_GAP_NS + 100000000LL)
+#define MONITOR_REPORT_SEC 60
+
+
+typedef struct
+{
+  int64_t timeNs;
+  bool on;
+} MONITOR_EDGE;
+
+typedef struct
+{
+  MONITOR_EDGE edges[MONITOR_PENDING];
+  size_t count;
+} PENDING_EDGES;
+
+
+static MONITOR_EDGE _expectQueue[MONITOR_QUEUE_LENGTH];
+static uint32_t _expectHead = 0;  // Written by the real-time thread only
+static uint32_t _expectTail = 0;  // Written by the monitor thread only
+static bool _lastExpectedOn = false;  // Real-time thread only
+
+static volatile sig_atomic_t _monitorRun = 0;
+static pthread_t _monitorThreadId;
+static int _lineFd = -1;
+static int _simPullFd = -1;  // gpio-sim pull attribute, mock registers only
+
+
+static bool expect_pop(MONITOR_EDGE *pEdge);
+static void pending_add(PENDING_EDGES *pPending, int64_t timeNs, bool on);
+static void pending_remove(PENDING_EDGES *pPending, size_t index);
+static void match_edges(PENDING_EDGES *pExpected, PENDING_EDGES *pObserved, MONITOR_STATS *pStats, int64_t nowNs);
+static void print_report(MONITOR_STATS *pStats);
+static void *thread_edge_monitor(void *arg);
+
+
+static bool expect_pop(MONITOR_EDGE *pEdge)
+{
+  uint32_t tail = _expectTail;
+  if (__atomic_load_n(&_expectHead, __ATOMIC_ACQUIRE) == tail)
+    return false;
+
+  *pEdge = _expectQueue[tail % MONITOR_QUEUE_LENGTH];
+  __atomic_store_n(&_expectTail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+void edge_monitor_expect(int64_t timeNs, bool on)
+{
+  // Called by the real-time thread after each output write. Writes that
+  // leave the monitored output as it was are ignored. A full queue drops
+  // the edge, which is then reported as spurious when it is seen.
+  if (!_monitorRun || on == _lastExpectedOn)
+    return;
+
+  _lastExpectedOn = on;
+
+  if (_simPullFd >= 0)
+  {
+    const char *pPull = on ? "pull-up" : "pull-down";
+    if (pwrite(_simPullFd, pPull, strlen(pPull), 0) < 0)
+      return;
+  }
+
+  uint32_t head = _expectHead;
+  if (head - __atomic_load_n(&_expectTail, __ATOMIC_ACQUIRE) >= MONITOR_QUEUE_LENGTH)
+    return;
+
+  _expectQueue[head % MONITOR_QUEUE_LENGTH] = (MONITOR_EDGE){ .timeNs = timeNs, .on = on };
+  __atomic_store_n(&_expectHead, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void pending_add(PENDING_EDGES *pPending, int64_t timeNs, bool on)
+{
+  // The oldest edge is dropped when full. It is far past being matched.
+  if (pPending->count == MONITOR_PENDING)
+    pending_remove(pPending, 0);
+
+  pPending->edges[pPending->count++] = (MONITOR_EDGE){ .timeNs = timeNs, .on = on };
+}
+
+
+static void pending_remove(PENDING_EDGES *pPending, size_t index)
+{
+  memmove(&pPending->edges[index], &pPending->edges[index + 1],
+          (pPending->count - index - 1) * sizeof(MONITOR_EDGE));
+  pPending->count--;
+}
+
+
+static void match_edges(PENDING_EDGES *pExpected, PENDING_EDGES *pObserved, MONITOR_STATS *pStats, int64_t nowNs)
+{
+  // Each observed transition is matched with the oldest intended one of
+  // the same direction within the window. Either side may arrive first,
+  // so unmatched edges are only given up on once well past the window.
+  for (size_t o = 0; o < pObserved->count; )
+  {
+    MONITOR_EDGE *pSeen = &pObserved->edges[o];
+    size_t e = 0;
+    while (e < pExpected->count && (pExpected->edges[e].on != pSeen->on ||
+           llabs(pSeen->timeNs - pExpected->edges[e].timeNs) > MONITOR_WINDOW_NS))
+    {
+      e++;
+    }
+
+    if (e == pExpected->count)
+    {
+      o++;
+      continue;
+    }
+
+    int64_t errorNs = pSeen->timeNs - pExpected->edges[e].timeNs;
+    if (pStats->matched == 0 || errorNs < pStats->minErrorNs)
+      pStats->minErrorNs = errorNs;
+    if (pStats->matched == 0 || errorNs > pStats->maxErrorNs)
+      pStats->maxErrorNs = errorNs;
+    pStats->sumErrorNs += errorNs;
+    pStats->matched++;
+    metrics_record_loopback_edge(LOOPBACK_MATCHED, errorNs);
+
+    pending_remove(pExpected, e);
+    pending_remove(pObserved, o);
+  }
+
+  while (pExpected->count > 0 && pExpected->edges[0].timeNs < nowNs - MONITOR_EXPIRE_NS)
+  {
+    struct tm timeParts;
+    char dateString[] = "1970-01-01 00:00:00";
+    time_t t = pExpected->edges[0].timeNs / NSEC_PER_SEC;
+    localtime_r(&t, &timeParts);
+    strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
+    fprintf(stderr, "Loopback: Missing carrier %s edge at %s.%03d\n", pExpected->edges[0].on ? "on" : "off",
+            dateString, (int)((pExpected->edges[0].timeNs % NSEC_PER_SEC) / 1000000));
+
+    pStats->missing++;
+    metrics_record_loopback_edge(LOOPBACK_MISSING, 0);
+    pending_remove(pExpected, 0);
+  }
+
+  while (pObserved->count > 0 && pObserved->edges[0].timeNs < nowNs - MONITOR_EXPIRE_NS)
+  {
+    pStats->spurious++;
+    metrics_record_loopback_edge(LOOPBACK_SPURIOUS, 0);
+    pending_remove(pObserved, 0);
+  }
+}
+
+
+static void print_report(MONITOR_STATS *pStats)
+{
+  if (pStats->matched + pStats->missing + pStats->spurious == 0)
+    return;
+
+  printf("Loopback: Matched = %" PRIu64 ", Missing = %" PRIu64 ", Spurious = %" PRIu64,
+         pStats->matched, pStats->missing, pStats->spurious);
+  if (pStats->matched > 0)
+  {
+    printf(", Error = %+.1lf us mean, %+.1lf us min, %+.1lf us max",
+           (double)pStats->sumErrorNs / pStats->matched / 1e3, pStats->minErrorNs / 1e3, pStats->maxErrorNs / 1e3);
+  }
+
+  printf("\n");
+  fflush(stdout);
+
+  memset(pStats, 0, sizeof(MONITOR_STATS));
+}
+
+
+static void *thread_edge_monitor(void *arg)
+{
+  (void)arg;
+
+  static PENDING_EDGES expected, observed;
+  MONITOR_STATS stats = { 0 };
+  struct gpio_v2_line_event events[MONITOR_EVENTS];
+  bool envelopeOn = false;
+  int64_t lastFallNs = 0;  // Falling edge that may end the carrier burst
+  time_t reportTime = time(NULL);
+
+  while (_monitorRun)
+  {
+    struct pollfd pfd = { .fd = _lineFd, .events = POLLIN };
+    int ready = poll(&pfd, 1, MONITOR_POLL_MS);
+    if (ready < 0 && errno != EINTR)
+    {
+      perror("Failed to poll monitor input");
+      break;
+    }
+
+    ssize_t bytes = (ready > 0) ? read(_lineFd, events, sizeof(events)) : 0;
+    for (ssize_t i = 0; i < bytes / (ssize_t)sizeof(events[0]); i++)
+    {
+      int64_t eventNs = events[i].timestamp_ns;
+      if (events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE)
+      {
+        if (envelopeOn && lastFallNs != 0 && eventNs - lastFallNs >= MONITOR_GAP_NS)
+        {
+          pending_add(&observed, lastFallNs, false);
+          envelopeOn = false;
+        }
+
+        if (!envelopeOn)
+          pending_add(&observed, eventNs, true);
+
+        envelopeOn = true;
+        lastFallNs = 0;
+      }
+      else if (envelopeOn)
+      {
+        lastFallNs = eventNs;
+      }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t nowNs = TIMESPEC_TO_NS(now);
+
+    // Only once every queued event is read can a quiet line end a burst.
+    if (ready == 0 && envelopeOn && lastFallNs != 0 && nowNs - lastFallNs >= MONITOR_GAP_NS)
+    {
+      pending_add(&observed, lastFallNs, false);
+      envelopeOn = false;
+      lastFallNs = 0;
+    }
+
+    MONITOR_EDGE edge;
+    while (expect_pop(&edge))
+      pending_add(&expected, edge.timeNs, edge.on);
+
+    match_edges(&expected, &observed, &stats, nowNs);
+
+    if (time(NULL) - reportTime >= MONITOR_REPORT_SEC)
+    {
+      reportTime = time(NULL);
+      print_report(&stats);
+    }
+  }
+
+  print_report(&stats);
+  return NULL;
+}
+
+
+bool edge_monitor_start(const char *pChipPath, uint32_t line)
+{
+  int chipFd = open(pChipPath, O_RDWR | O_CLOEXEC);
+  if (chipFd < 0)
+  {
+    fprintf(stderr, "Failed to open GPIO chip %s (%s).\n", pChipPath, strerror(errno));
+    return false;
+  }
+
+  struct gpio_v2_line_request request;
+  memset(&request, 0, sizeof(request));
+  request.offsets[0] = line;
+  request.num_lines = 1;
+  request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING |
+                         GPIO_V2_LINE_FLAG_EDGE_FALLING | GPIO_V2_LINE_FLAG_EVENT_CLOCK_REALTIME;
+  snprintf(request.consumer, sizeof(request.consumer), "time-signal monitor");
+
+  int result = ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request);
+  close(chipFd);
+  if (result < 0)
+  {
+    fprintf(stderr, "Failed to request GPIO line %" PRIu32 " of %s (%s).\n", line, pChipPath, strerror(errno));
+    return false;
+  }
+
+  _lineFd = request.fd;
+
+  if (is_mock_registers())
+  {
+    char chipPath[PATH_MAX];
+    char pullPath[PATH_MAX + 64];
+    snprintf(chipPath, sizeof(chipPath), "%s", pChipPath);
+    snprintf(pullPath, sizeof(pullPath), "/sys/bus/gpio/devices/%s/sim_gpio%" PRIu32 "/pull", basename(chipPath), line);
+    _simPullFd = open(pullPath, O_WRONLY | O_CLOEXEC);
+    if (_simPullFd < 0)
+      printf("Monitor input is not a gpio-sim line, so no mock edges will be seen.\n");
+  }
+
+  _lastExpectedOn = false;
+  _monitorRun = 1;
+  if (!start_helper_thread(&_monitorThreadId, thread_edge_monitor))
+  {
+    fprintf(stderr, "Failed to create monitor thread.\n");
+    _monitorRun = 0;
+    edge_monitor_stop();
+    return false;
+  }
+
+  return true;
+}
+
+
+void edge_monitor_stop(void)
+{
+  if (_monitorRun)
+  {
+    _monitorRun = 0;
+    pthread_join(_monitorThreadId, NULL);
+  }
+
+  if (_simPullFd >= 0)
+  {
+    close(_simPullFd);
+    _simPullFd = -1;
+  }
+
+  if (_lineFd >= 0)
+  {
+    close(_lineFd);
+    _lineFd = -1;
+  }
+}
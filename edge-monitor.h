@@ -0,0 +1,55 @@
+/*
+edge-monitor.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __EDGE_MONITOR_H__
+#define __EDGE_MONITOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MONITOR_QUEUE_LENGTH 256       // Must be a power of two
+#define MONITOR_WINDOW_NS    20000000  // Largest on-pin error matched to an edge
+#define MONITOR_GAP_NS       1000000   // Line low this long ends a carrier burst
+
+enum LoopbackResult
+{
+  LOOPBACK_MATCHED,
+  LOOPBACK_MISSING,
+  LOOPBACK_SPURIOUS,
+  LOOPBACK_RESULT_COUNT
+};
+
+typedef struct
+{
+  uint64_t matched;   // Intended edges seen on the monitor input
+  uint64_t missing;   // Intended edges never seen
+  uint64_t spurious;  // Edges seen that were never intended
+  int64_t sumErrorNs;
+  int64_t minErrorNs;
+  int64_t maxErrorNs;
+} MONITOR_STATS;
+
+bool edge_monitor_start(const char *pChipPath, uint32_t line);
+void edge_monitor_stop(void);
+void edge_monitor_expect(int64_t timeNs, bool on);
+
+#endif  // __EDGE_MONITOR_H__
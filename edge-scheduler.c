@@ -0,0 +1,164 @@
+/*
+edge-scheduler.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "macros.h"
+#include "clock-control.h"
+#include "edge-scheduler.h"
+
+
+// Edges of every clock output are merged in time order through a min-heap
+// holding the next pending edge of each output. Edges of different outputs
+// that fall within EDGE_COALESCE_NS of each other are returned as one group
+// so they can be keyed with a single GPFSEL write.
+
+
+static void heap_sift_up(EDGE_SCHEDULER *pSched, size_t idx);
+static void heap_sift_down(EDGE_SCHEDULER *pSched, size_t idx);
+
+
+static void heap_sift_up(EDGE_SCHEDULER *pSched, size_t idx)
+{
+  while (idx > 0)
+  {
+    size_t parent = (idx - 1) / 2;
+    if (pSched->heap[parent].timeNs <= pSched->heap[idx].timeNs)
+      break;
+
+    EDGE_HEAP_NODE node = pSched->heap[parent];
+    pSched->heap[parent] = pSched->heap[idx];
+    pSched->heap[idx] = node;
+    idx = parent;
+  }
+}
+
+
+static void heap_sift_down(EDGE_SCHEDULER *pSched, size_t idx)
+{
+  while (true)
+  {
+    size_t smallest = idx;
+    size_t left = 2 * idx + 1;
+    size_t right = 2 * idx + 2;
+
+    if (left < pSched->heapSize && pSched->heap[left].timeNs < pSched->heap[smallest].timeNs)
+      smallest = left;
+
+    if (right < pSched->heapSize && pSched->heap[right].timeNs < pSched->heap[smallest].timeNs)
+      smallest = right;
+
+    if (smallest == idx)
+      break;
+
+    EDGE_HEAP_NODE node = pSched->heap[smallest];
+    pSched->heap[smallest] = pSched->heap[idx];
+    pSched->heap[idx] = node;
+    idx = smallest;
+  }
+}
+
+
+void edge_scheduler_init(EDGE_SCHEDULER *pSched, uint32_t outputMask)
+{
+  memset(pSched, 0, sizeof(EDGE_SCHEDULER));
+  pSched->outputMask = outputMask;
+}
+
+
+bool edge_scheduler_add(EDGE_SCHEDULER *pSched, enum ClockOutput output, int64_t timeNs, bool on)
+{
+  if (!(pSched->outputMask & (1 << output)))
+    return false;
+
+  size_t count = pSched->edgeCount[output];
+  if (count >= EDGE_MAX_PER_OUTPUT)
+  {
+    fprintf(stderr, "Error: Too many pending edges for GPCLK%d.\n", output);
+    return false;
+  }
+
+  // Edges of one output must be added in time order.
+  if (count > pSched->nextEdge[output] && pSched->edges[output][count - 1].timeNs > timeNs)
+  {
+    fprintf(stderr, "Error: GPCLK%d edge added out of order.\n", output);
+    return false;
+  }
+
+  pSched->edges[output][count] = (OUTPUT_EDGE){ timeNs, on };
+  pSched->edgeCount[output]++;
+
+  // An output with no other pending edges enters the heap.
+  if (count == pSched->nextEdge[output])
+  {
+    pSched->heap[pSched->heapSize] = (EDGE_HEAP_NODE){ timeNs, output };
+    heap_sift_up(pSched, pSched->heapSize++);
+  }
+
+  return true;
+}
+
+
+bool edge_scheduler_next(EDGE_SCHEDULER *pSched, EDGE_GROUP *pGroup)
+{
+  if (pSched->heapSize == 0)
+    return false;
+
+  pGroup->timeNs = pSched->heap[0].timeNs;
+  pGroup->changeMask = 0;
+
+  while (pSched->heapSize > 0 && pSched->heap[0].timeNs - pGroup->timeNs < EDGE_COALESCE_NS)
+  {
+    uint32_t output = pSched->heap[0].output;
+    OUTPUT_EDGE *pEdge = &pSched->edges[output][pSched->nextEdge[output]++];
+
+    if (pEdge->on)
+      pSched->onMask |= (1 << output);
+    else
+      pSched->onMask &= ~(1 << output);
+
+    pGroup->changeMask |= (1 << output);
+    pSched->edgesOut++;
+
+    // Replace the output's heap node with its following edge, or
+    // remove it from the heap when it has no more pending edges.
+    if (pSched->nextEdge[output] < pSched->edgeCount[output])
+    {
+      pSched->heap[0].timeNs = pSched->edges[output][pSched->nextEdge[output]].timeNs;
+    }
+    else
+    {
+      pSched->edgeCount[output] = 0;
+      pSched->nextEdge[output] = 0;
+      pSched->heap[0] = pSched->heap[--pSched->heapSize];
+    }
+
+    heap_sift_down(pSched, 0);
+  }
+
+  pGroup->onMask = pSched->onMask;
+  pSched->groupsOut++;
+  return true;
+}
@@ -0,0 +1,70 @@
+/*
+edge-scheduler.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __EDGE_SCHEDULER_H__
+#define __EDGE_SCHEDULER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "clock-control.h"
+
+#define EDGE_MAX_PER_OUTPUT 128  // Pending keying edges per clock output
+#define EDGE_COALESCE_NS    20000  // Edges closer than this are written together
+
+typedef struct
+{
+  int64_t timeNs;  // CLOCK_REALTIME time of edge
+  bool on;         // Output state after edge
+} OUTPUT_EDGE;
+
+typedef struct
+{
+  int64_t timeNs;       // Time of the earliest coalesced edge
+  uint32_t changeMask;  // Outputs with an edge in this group
+  uint32_t onMask;      // State of all outputs after this group
+} EDGE_GROUP;
+
+typedef struct
+{
+  int64_t timeNs;
+  uint32_t output;
+} EDGE_HEAP_NODE;
+
+typedef struct
+{
+  uint32_t outputMask;   // Outputs driven by this scheduler
+  uint32_t onMask;       // Output state after the last returned group
+  OUTPUT_EDGE edges[CLOCK_OUTPUT_COUNT][EDGE_MAX_PER_OUTPUT];
+  size_t edgeCount[CLOCK_OUTPUT_COUNT];
+  size_t nextEdge[CLOCK_OUTPUT_COUNT];
+  EDGE_HEAP_NODE heap[CLOCK_OUTPUT_COUNT];  // Next pending edge of each output, earliest first
+  size_t heapSize;
+  uint64_t edgesOut;     // Edges returned
+  uint64_t groupsOut;    // Groups returned (register writes)
+} EDGE_SCHEDULER;
+
+void edge_scheduler_init(EDGE_SCHEDULER *pSched, uint32_t outputMask);
+bool edge_scheduler_add(EDGE_SCHEDULER *pSched, enum ClockOutput output, int64_t timeNs, bool on);
+bool edge_scheduler_next(EDGE_SCHEDULER *pSched, EDGE_GROUP *pGroup);
+
+#endif  // __EDGE_SCHEDULER_H__
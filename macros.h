@@ -34,4 +34,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define ARRAY_LENGTH(x) (sizeof(x) / sizeof((x)[0]))
 
+#define NSEC_PER_SEC 1000000000LL
+
+#define TIMESPEC_TO_NS(ts) ((int64_t)(ts).tv_sec * NSEC_PER_SEC + (ts).tv_nsec)
+#define NS_TO_TIMESPEC(ns) ((struct timespec){ .tv_sec = (ns) / NSEC_PER_SEC, .tv_nsec = (ns) % NSEC_PER_SEC })
+
 #endif  // __MACROS_H__
@@ -0,0 +1,313 @@
+/*
+metrics.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "macros.h"
+#include "metrics.h"
+#include "control-socket.h"
+#include "edge-monitor.h"
+
+
+// Metrics are counters updated by the real-time thread without locks and
+// written out by the main thread in the Prometheus text format. The file
+// is replaced with rename() so a textfile collector never sees it half
+// written. The temporary file is unique to each write, so the processes
+// either side of a handoff never write into the same one. Each counter has a single writer, so updates are plain atomic
+// stores rather than read-modify-write operations.
+
+
+typedef struct
+{
+  const char *timeService;
+  const char *sourceName;
+  double requestedFrequency;
+  double achievedFrequency;
+  uint64_t minutesTransmitted;
+  uint64_t minutesOff;
+} OUTPUT_METRICS;
+
+
+// Upper bounds of the edge lateness buckets in ns. The last is +Inf.
+static const int64_t LatenessBucketNs[METRICS_LATENESS_BUCKETS - 1] =
+{
+  10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000
+};
+
+static uint64_t _latenessBuckets[METRICS_LATENESS_BUCKETS];
+static int64_t _latenessSumNs = 0;
+static uint64_t _lateEdges = 0;
+static uint64_t _deadlineActions[DEADLINE_POLICY_COUNT];
+static uint64_t _pageFaults[2];  // Minor and major, after warm-up
+static uint64_t _loopbackEdges[LOOPBACK_RESULT_COUNT];
+static int64_t _loopbackErrorSumNs = 0;
+static int64_t _ppsOffsetNs = 0;
+static int _ppsLocked = -1;  // Negative when PPS alignment is not used
+static int _scheduleState = 0;
+static OUTPUT_METRICS _outputs[CLOCK_OUTPUT_COUNT];
+
+
+static void counter_add(uint64_t *pCounter, uint64_t count);
+
+
+static void counter_add(uint64_t *pCounter, uint64_t count)
+{
+  __atomic_store_n(pCounter, *pCounter + count, __ATOMIC_RELAXED);
+}
+
+
+void metrics_record_edge(int64_t latenessNs, bool late)
+{
+  int bucket = 0;
+  while (bucket < METRICS_LATENESS_BUCKETS - 1 && latenessNs > LatenessBucketNs[bucket])
+    bucket++;
+
+  counter_add(&_latenessBuckets[bucket], 1);
+  __atomic_store_n(&_latenessSumNs, _latenessSumNs + latenessNs, __ATOMIC_RELAXED);
+
+  if (late)
+    counter_add(&_lateEdges, 1);
+}
+
+
+void metrics_record_minute(enum ClockOutput output, bool transmitted)
+{
+  counter_add(transmitted ? &_outputs[output].minutesTransmitted : &_outputs[output].minutesOff, 1);
+}
+
+
+void metrics_record_deadline_miss(int policy)
+{
+  if (policy >= 0 && policy < (int)ARRAY_LENGTH(_deadlineActions))
+    counter_add(&_deadlineActions[policy], 1);
+}
+
+
+void metrics_record_page_faults(uint64_t minorFaults, uint64_t majorFaults)
+{
+  counter_add(&_pageFaults[0], minorFaults);
+  counter_add(&_pageFaults[1], majorFaults);
+}
+
+
+void metrics_record_loopback_edge(int result, int64_t errorNs)
+{
+  if (result >= 0 && result < (int)ARRAY_LENGTH(_loopbackEdges))
+    counter_add(&_loopbackEdges[result], 1);
+
+  __atomic_store_n(&_loopbackErrorSumNs, _loopbackErrorSumNs + errorNs, __ATOMIC_RELAXED);
+}
+
+
+void metrics_set_pps(int64_t offsetNs, bool locked)
+{
+  __atomic_store_n(&_ppsOffsetNs, offsetNs, __ATOMIC_RELAXED);
+  __atomic_store_n(&_ppsLocked, locked, __ATOMIC_RELAXED);
+}
+
+
+void metrics_set_schedule_state(int scheduleState)
+{
+  __atomic_store_n(&_scheduleState, scheduleState, __ATOMIC_RELAXED);
+}
+
+
+void metrics_set_clock(enum ClockOutput output, const char *timeService, double requestedFrequency,
+                       double achievedFrequency, const char *sourceName)
+{
+  // Only set when a clock is started, before the name is published.
+  OUTPUT_METRICS *pOutput = &_outputs[output];
+  pOutput->requestedFrequency = requestedFrequency;
+  pOutput->achievedFrequency = achievedFrequency;
+  pOutput->sourceName = sourceName;
+  __atomic_store_n(&pOutput->timeService, timeService, __ATOMIC_RELEASE);
+}
+
+
+bool write_metrics_file(const char *path)
+{
+  char tempPath[4096];
+  if (snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", path) >= (int)sizeof(tempPath))
+    return false;
+
+  int fd = mkstemp(tempPath);
+  FILE *pFile = (fd >= 0 && fchmod(fd, 0644) == 0) ? fdopen(fd, "w") : NULL;
+  if (pFile == NULL)
+  {
+    fprintf(stderr, "Error: Failed to write metrics file %s (%s).\n", tempPath, strerror(errno));
+    if (fd >= 0)
+    {
+      close(fd);
+      unlink(tempPath);
+    }
+    return false;
+  }
+
+  // The count is taken from the buckets read, so the histogram is
+  // consistent even while edges are being recorded.
+  fprintf(pFile, "# HELP time_signal_edge_lateness_seconds Time from each scheduled carrier edge until it was keyed.\n");
+  fprintf(pFile, "# TYPE time_signal_edge_lateness_seconds histogram\n");
+
+  uint64_t cumulative = 0;
+  for (int i = 0; i < METRICS_LATENESS_BUCKETS; i++)
+  {
+    cumulative += __atomic_load_n(&_latenessBuckets[i], __ATOMIC_RELAXED);
+    if (i < METRICS_LATENESS_BUCKETS - 1)
+      fprintf(pFile, "time_signal_edge_lateness_seconds_bucket{le=\"%g\"} %" PRIu64 "\n", LatenessBucketNs[i] / 1e9, cumulative);
+    else
+      fprintf(pFile, "time_signal_edge_lateness_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", cumulative);
+  }
+
+  fprintf(pFile, "time_signal_edge_lateness_seconds_sum %.9lf\n", __atomic_load_n(&_latenessSumNs, __ATOMIC_RELAXED) / 1e9);
+  fprintf(pFile, "time_signal_edge_lateness_seconds_count %" PRIu64 "\n", cumulative);
+
+  fprintf(pFile, "# HELP time_signal_edge_late_total Carrier edges keyed more than 100 us late.\n");
+  fprintf(pFile, "# TYPE time_signal_edge_late_total counter\n");
+  fprintf(pFile, "time_signal_edge_late_total %" PRIu64 "\n", __atomic_load_n(&_lateEdges, __ATOMIC_RELAXED));
+
+  static const char * const DeadlineActionNames[] =
+  {
+    [DEADLINE_STRETCH]        = "stretch",
+    [DEADLINE_SKIP_SECOND]    = "skip",
+    [DEADLINE_ABANDON_MINUTE] = "abandon"
+  };
+  fprintf(pFile, "# HELP time_signal_deadline_miss_actions_total Wake-ups past the deadline miss threshold, by action taken.\n");
+  fprintf(pFile, "# TYPE time_signal_deadline_miss_actions_total counter\n");
+  for (size_t i = 0; i < ARRAY_LENGTH(_deadlineActions); i++)
+  {
+    fprintf(pFile, "time_signal_deadline_miss_actions_total{action=\"%s\"} %" PRIu64 "\n",
+            DeadlineActionNames[i], __atomic_load_n(&_deadlineActions[i], __ATOMIC_RELAXED));
+  }
+
+  fprintf(pFile, "# HELP time_signal_page_faults_total Page faults taken by the transmitter thread after warm-up.\n");
+  fprintf(pFile, "# TYPE time_signal_page_faults_total counter\n");
+  fprintf(pFile, "time_signal_page_faults_total{type=\"minor\"} %" PRIu64 "\n", __atomic_load_n(&_pageFaults[0], __ATOMIC_RELAXED));
+  fprintf(pFile, "time_signal_page_faults_total{type=\"major\"} %" PRIu64 "\n", __atomic_load_n(&_pageFaults[1], __ATOMIC_RELAXED));
+
+  static const char * const LoopbackResultNames[] =
+  {
+    [LOOPBACK_MATCHED]  = "matched",
+    [LOOPBACK_MISSING]  = "missing",
+    [LOOPBACK_SPURIOUS] = "spurious"
+  };
+  fprintf(pFile, "# HELP time_signal_loopback_edges_total Carrier edges checked on the monitor input, by result.\n");
+  fprintf(pFile, "# TYPE time_signal_loopback_edges_total counter\n");
+  for (size_t i = 0; i < ARRAY_LENGTH(_loopbackEdges); i++)
+  {
+    fprintf(pFile, "time_signal_loopback_edges_total{result=\"%s\"} %" PRIu64 "\n",
+            LoopbackResultNames[i], __atomic_load_n(&_loopbackEdges[i], __ATOMIC_RELAXED));
+  }
+
+  // A signed total that can fall, so a gauge rather than a counter.
+  fprintf(pFile, "# HELP time_signal_loopback_error_seconds_sum Total on-pin error of matched edges.\n");
+  fprintf(pFile, "# TYPE time_signal_loopback_error_seconds_sum gauge\n");
+  fprintf(pFile, "time_signal_loopback_error_seconds_sum %.9lf\n", __atomic_load_n(&_loopbackErrorSumNs, __ATOMIC_RELAXED) / 1e9);
+
+  if (__atomic_load_n(&_ppsLocked, __ATOMIC_RELAXED) >= 0)
+  {
+    fprintf(pFile, "# HELP time_signal_pps_offset_seconds Offset applied to edges to align them with PPS.\n");
+    fprintf(pFile, "# TYPE time_signal_pps_offset_seconds gauge\n");
+    fprintf(pFile, "time_signal_pps_offset_seconds %.9lf\n", __atomic_load_n(&_ppsOffsetNs, __ATOMIC_RELAXED) / 1e9);
+    fprintf(pFile, "# HELP time_signal_pps_locked Whether PPS pulses are being received (0 = holdover).\n");
+    fprintf(pFile, "# TYPE time_signal_pps_locked gauge\n");
+    fprintf(pFile, "time_signal_pps_locked %d\n", __atomic_load_n(&_ppsLocked, __ATOMIC_RELAXED));
+  }
+
+  fprintf(pFile, "# HELP time_signal_schedule_state Schedule state (0 = off, 1 = pre-roll, 2 = on).\n");
+  fprintf(pFile, "# TYPE time_signal_schedule_state gauge\n");
+  fprintf(pFile, "time_signal_schedule_state %d\n", __atomic_load_n(&_scheduleState, __ATOMIC_RELAXED));
+
+  static const char * const OutputMetricHeaders[] =
+  {
+    "# HELP time_signal_minutes_transmitted_total Minutes transmitted on each output.\n"
+    "# TYPE time_signal_minutes_transmitted_total counter\n",
+    "# HELP time_signal_minutes_off_total Minutes each output was off.\n"
+    "# TYPE time_signal_minutes_off_total counter\n",
+    "# HELP time_signal_clock_info Clock source chosen for each output.\n"
+    "# TYPE time_signal_clock_info gauge\n",
+    "# HELP time_signal_clock_frequency_hz Carrier frequency set up for each output.\n"
+    "# TYPE time_signal_clock_frequency_hz gauge\n",
+    "# HELP time_signal_clock_error_ppm Carrier frequency error from the requested frequency.\n"
+    "# TYPE time_signal_clock_error_ppm gauge\n"
+  };
+
+  for (size_t metric = 0; metric < ARRAY_LENGTH(OutputMetricHeaders); metric++)
+  {
+    fprintf(pFile, "%s", OutputMetricHeaders[metric]);
+
+    for (int i = 0; i < CLOCK_OUTPUT_COUNT; i++)
+    {
+      OUTPUT_METRICS *pOutput = &_outputs[i];
+      const char *timeService = __atomic_load_n(&pOutput->timeService, __ATOMIC_ACQUIRE);
+      if (timeService == NULL)
+        continue;
+
+      char labels[64];
+      snprintf(labels, sizeof(labels), "output=\"GPCLK%d\",service=\"%s\"", i, timeService);
+
+      switch (metric)
+      {
+        case 0:
+          fprintf(pFile, "time_signal_minutes_transmitted_total{%s} %" PRIu64 "\n", labels,
+                  __atomic_load_n(&pOutput->minutesTransmitted, __ATOMIC_RELAXED));
+          break;
+
+        case 1:
+          fprintf(pFile, "time_signal_minutes_off_total{%s} %" PRIu64 "\n", labels,
+                  __atomic_load_n(&pOutput->minutesOff, __ATOMIC_RELAXED));
+          break;
+
+        case 2:
+          fprintf(pFile, "time_signal_clock_info{%s,source=\"%s\"} 1\n", labels, pOutput->sourceName);
+          break;
+
+        case 3:
+          fprintf(pFile, "time_signal_clock_frequency_hz{%s} %.4lf\n", labels, pOutput->achievedFrequency);
+          break;
+
+        case 4:
+          fprintf(pFile, "time_signal_clock_error_ppm{%s} %.4lf\n", labels,
+                  (pOutput->achievedFrequency - pOutput->requestedFrequency) / pOutput->requestedFrequency * 1e6);
+          break;
+      }
+    }
+  }
+
+  bool result = (fclose(pFile) == 0);
+  if (result && rename(tempPath, path) < 0)
+  {
+    fprintf(stderr, "Error: Failed to replace metrics file %s (%s).\n", path, strerror(errno));
+    result = false;
+  }
+
+  if (!result)
+    unlink(tempPath);
+
+  return result;
+}
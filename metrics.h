@@ -0,0 +1,44 @@
+/*
+metrics.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "clock-control.h"
+
+#define METRICS_INTERVAL_SEC 15
+#define METRICS_LATENESS_BUCKETS 11
+
+void metrics_record_edge(int64_t latenessNs, bool late);
+void metrics_record_minute(enum ClockOutput output, bool transmitted);
+void metrics_set_schedule_state(int scheduleState);
+void metrics_record_deadline_miss(int policy);
+void metrics_record_page_faults(uint64_t minorFaults, uint64_t majorFaults);
+void metrics_record_loopback_edge(int result, int64_t errorNs);
+void metrics_set_pps(int64_t offsetNs, bool locked);
+void metrics_set_clock(enum ClockOutput output, const char *timeService, double requestedFrequency,
+                       double achievedFrequency, const char *sourceName);
+bool write_metrics_file(const char *path);
+
+#endif  // __METRICS_H__
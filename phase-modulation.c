@@ -0,0 +1,216 @@
+/*
+phase-modulation.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "macros.h"
+#include "clock-control.h"
+#include "time-services.h"
+#include "timestamp.h"
+#include "phase-modulation.h"
+
+
+// A full chip to chip phase step (twice the deviation) takes this long
+// at the fast or slow divisor. It must be well under one chip (1.55 ms).
+#define FULL_STEP_NS 400000
+
+// Sleep until this long before a step, then spin for the rest.
+#define SPIN_NS 50000
+
+
+static void wait_until_ns(int64_t targetNs);
+
+
+static void wait_until_ns(int64_t targetNs)
+{
+  struct timespec targetWait = NS_TO_TIMESPEC(targetNs - SPIN_NS);
+  clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+
+  while (timestamp_now_ns() < targetNs)
+    ;
+}
+
+
+bool phase_modulation_init(PHASE_MODULATOR *pPm, enum ClockOutput output, double deviationDegrees)
+{
+  memset(pPm, 0, sizeof(PHASE_MODULATOR));
+
+  pPm->output = output;
+  pPm->deviationDegrees = deviationDegrees;
+  pPm->sourceFrequency = get_clock_source_frequency(output);
+  pPm->baseDivisor = get_clock_divisor(output);
+  if (pPm->sourceFrequency <= 0 || pPm->baseDivisor < (2 << 10))
+    return false;
+
+  // Phase is shifted by briefly running the carrier slightly fast or slow.
+  // The offset is chosen so a full step takes FULL_STEP_NS.
+  pPm->carrierFrequency = pPm->sourceFrequency / (pPm->baseDivisor / 1024.0);
+  double offsetHz = (2.0 * deviationDegrees / 360.0) / (FULL_STEP_NS / 1e9);
+
+  pPm->fastDivisor = lround(pPm->sourceFrequency / (pPm->carrierFrequency + offsetHz) * 1024.0);
+  pPm->slowDivisor = lround(pPm->sourceFrequency / (pPm->carrierFrequency - offsetHz) * 1024.0);
+  if (pPm->fastDivisor == pPm->baseDivisor || pPm->slowDivisor == pPm->baseDivisor)
+    return false;
+
+  pPm->fastOffsetHz = pPm->sourceFrequency / (pPm->fastDivisor / 1024.0) - pPm->carrierFrequency;
+  pPm->slowOffsetHz = pPm->sourceFrequency / (pPm->slowDivisor / 1024.0) - pPm->carrierFrequency;
+
+  return true;
+}
+
+
+void modulate_phase_for_second(PHASE_MODULATOR *pPm, time_t secondStart, const uint64_t *chipBits)
+{
+  double deviation = pPm->deviationDegrees / 360.0;
+  double chipNs = PHASE_CODE_CHIP_CYCLES / pPm->carrierFrequency * 1e9;
+  int64_t codeStartNs = secondStart * NSEC_PER_SEC + PHASE_CODE_START_MS * 1000000LL;
+
+  // Seconds that are already underway (e.g. the first partial minute)
+  // are skipped rather than squeezing their chips into less time.
+  if (timestamp_now_ns() > codeStartNs + chipNs)
+    return;
+
+  PHASE_SECOND *pHistory = &pPm->history[pPm->historyCount++ % PHASE_HISTORY_SECONDS];
+  pHistory->secondStart = secondStart;
+  memcpy(pHistory->chipBits, chipBits, sizeof(pHistory->chipBits));
+
+  // Step the phase at each chip boundary. The measured time spent at the
+  // fast or slow divisor is folded into the phase estimate, so timing
+  // errors in one step are corrected by the next instead of accumulating.
+  // After the last chip the phase is returned to zero.
+  for (int i = 0; i <= PHASE_CODE_CHIPS; i++)
+  {
+    double target = 0;
+    if (i < PHASE_CODE_CHIPS)
+      target = ((chipBits[i / 64] >> (i % 64)) & 0x01) ? deviation : -deviation;
+
+    double step = target - pPm->phase;
+    if (fabs(step) < 1e-4)
+      continue;
+
+    uint32_t divisor = (step > 0) ? pPm->fastDivisor : pPm->slowDivisor;
+    double offsetHz = (step > 0) ? pPm->fastOffsetHz : pPm->slowOffsetHz;
+    int64_t durationNs = llround(step / offsetHz * 1e9);
+    int64_t boundaryNs = codeStartNs + llround(i * chipNs);
+
+    wait_until_ns(boundaryNs);
+    set_clock_divisor(pPm->output, divisor);
+    int64_t stepStartNs = timestamp_now_ns();
+
+    wait_until_ns(stepStartNs + durationNs);
+    set_clock_divisor(pPm->output, pPm->baseDivisor);
+    int64_t stepEndNs = timestamp_now_ns();
+
+    pPm->phase += offsetHz * (stepEndNs - stepStartNs) / 1e9;
+    pPm->steps++;
+    if (stepStartNs > boundaryNs + SPIN_NS)
+      pPm->lateSteps++;
+  }
+}
+
+
+bool verify_phase_trace(PHASE_MODULATOR *pPm, uint64_t *pTraceCursor, PHASE_VERIFY *pVerify)
+{
+  // Rebuild the carrier phase from GP0DIV writes in the register trace by
+  // integrating the frequency offset of each divisor, then sample it at
+  // every chip center of the recorded seconds.
+  // The trace buffer is static as this runs on the real-time thread's small stack.
+  static REGISTER_WRITE trace[256];
+  size_t count;
+  double phase = 0;
+  double divisor = pPm->baseDivisor / 1024.0;
+  int64_t lastNs = 0;
+  double sumAbs = 0;
+  double sumSquareError = 0;
+
+  memset(pVerify, 0, sizeof(PHASE_VERIFY));
+  if (pPm->historyCount == 0)
+    return false;
+
+  size_t first = (pPm->historyCount > PHASE_HISTORY_SECONDS) ? pPm->historyCount - PHASE_HISTORY_SECONDS : 0;
+  size_t second = first;
+  int chip = 0;
+  double chipNs = PHASE_CODE_CHIP_CYCLES / pPm->carrierFrequency * 1e9;
+  double deviation = pPm->deviationDegrees / 360.0;
+
+  while ((count = read_register_trace(trace, ARRAY_LENGTH(trace), pTraceCursor)) > 0)
+  {
+    for (size_t t = 0; t < count; t++)
+    {
+      double traceDivisor = trace_clock_divisor(&trace[t], pPm->output);
+      if (traceDivisor < 0)
+        continue;
+
+      int64_t traceNs = TIMESPEC_TO_NS(trace[t].time);
+      if (lastNs == 0)
+        lastNs = traceNs;
+
+      // Sample every chip center that falls before this write.
+      while (second < pPm->historyCount)
+      {
+        PHASE_SECOND *pSecond = &pPm->history[second % PHASE_HISTORY_SECONDS];
+        int64_t centerNs = pSecond->secondStart * NSEC_PER_SEC + PHASE_CODE_START_MS * 1000000LL +
+                           llround((chip + 0.5) * chipNs);
+
+        if (centerNs >= traceNs)
+          break;
+
+        if (centerNs >= lastNs)
+        {
+          double offsetHz = pPm->sourceFrequency / divisor - pPm->carrierFrequency;
+          double centerPhase = phase + offsetHz * (centerNs - lastNs) / 1e9;
+          double nominal = ((pSecond->chipBits[chip / 64] >> (chip % 64)) & 0x01) ? deviation : -deviation;
+
+          pVerify->chips++;
+          if ((centerPhase > 0) != (nominal > 0))
+            pVerify->chipErrors++;
+
+          sumAbs += fabs(centerPhase);
+          sumSquareError += (centerPhase - nominal) * (centerPhase - nominal);
+        }
+
+        if (++chip >= PHASE_CODE_CHIPS)
+        {
+          chip = 0;
+          second++;
+        }
+      }
+
+      double offsetHz = pPm->sourceFrequency / divisor - pPm->carrierFrequency;
+      phase += offsetHz * (traceNs - lastNs) / 1e9;
+      divisor = traceDivisor;
+      lastNs = traceNs;
+    }
+  }
+
+  if (pVerify->chips == 0)
+    return false;
+
+  pVerify->meanAbsDegrees = sumAbs / pVerify->chips * 360.0;
+  pVerify->rmsErrorDegrees = sqrt(sumSquareError / pVerify->chips) * 360.0;
+  return true;
+}
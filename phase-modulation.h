@@ -0,0 +1,70 @@
+/*
+phase-modulation.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __PHASE_MODULATION_H__
+#define __PHASE_MODULATION_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "clock-control.h"
+#include "time-services.h"
+
+#define PHASE_HISTORY_SECONDS 64  // Seconds kept for mock trace verification
+
+typedef struct
+{
+  time_t secondStart;
+  uint64_t chipBits[PHASE_CODE_WORDS];
+} PHASE_SECOND;
+
+typedef struct
+{
+  enum ClockOutput output;    // Clock output being modulated
+  double deviationDegrees;   // Phase deviation of each chip (+/-)
+  double sourceFrequency;    // Clock source feeding the divider
+  double carrierFrequency;   // Carrier frequency at the base divisor
+  uint32_t baseDivisor;      // Divisors in units of 1/1024
+  uint32_t fastDivisor;
+  uint32_t slowDivisor;
+  double fastOffsetHz;       // Carrier offset at the fast divisor (positive)
+  double slowOffsetHz;       // Carrier offset at the slow divisor (negative)
+  double phase;              // Estimated carrier phase in cycles relative to the base
+  uint64_t steps;            // Phase steps made
+  uint64_t lateSteps;        // Steps started after their chip boundary plus spin time
+  size_t historyCount;
+  PHASE_SECOND history[PHASE_HISTORY_SECONDS];
+} PHASE_MODULATOR;
+
+typedef struct
+{
+  uint32_t chips;            // Chips reconstructed from the register trace
+  uint32_t chipErrors;       // Chips with the wrong phase sign
+  double meanAbsDegrees;     // Mean absolute reconstructed phase at chip centers
+  double rmsErrorDegrees;    // RMS error from the nominal chip phase
+} PHASE_VERIFY;
+
+bool phase_modulation_init(PHASE_MODULATOR *pPm, enum ClockOutput output, double deviationDegrees);
+void modulate_phase_for_second(PHASE_MODULATOR *pPm, time_t secondStart, const uint64_t *chipBits);
+bool verify_phase_trace(PHASE_MODULATOR *pPm, uint64_t *pTraceCursor, PHASE_VERIFY *pVerify);
+
+#endif  // __PHASE_MODULATION_H__
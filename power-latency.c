@@ -0,0 +1,148 @@
+/*
+power-latency.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include "power-latency.h"
+
+
+// CPU idle states and frequency ramp-up add to the wake-up latency of the
+// real-time thread. While transmitting, a PM QoS request through
+// /dev/cpu_dma_latency keeps the CPUs out of deep idle states, and the
+// minimum frequency of the thread's core is raised to its maximum. Both
+// are released in off windows so the board is not held awake all day.
+// Reference: https://docs.kernel.org/power/pm_qos_interface.html
+
+#define CPU_DMA_LATENCY_PATH "/dev/cpu_dma_latency"
+
+
+static int32_t _cpuLatencyUs = -1;  // Negative when not requested
+static bool _pinFrequency = false;
+static int _latencyFd = -1;         // The request is held while this is open
+static char _minFreqPath[128];
+static char _savedMinFreq[32];      // Empty when the frequency is not pinned
+
+
+static bool read_sysfs(const char *path, char *buffer, size_t bufferSize);
+static bool write_sysfs(const char *path, const char *value);
+
+
+static bool read_sysfs(const char *path, char *buffer, size_t bufferSize)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return false;
+
+  bool read = (fgets(buffer, bufferSize, fp) != NULL);
+  fclose(fp);
+
+  if (read)
+    buffer[strcspn(buffer, "\n")] = '\0';
+
+  return read;
+}
+
+
+static bool write_sysfs(const char *path, const char *value)
+{
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    return false;
+
+  bool written = (fputs(value, fp) >= 0);
+  return (fclose(fp) == 0 && written);
+}
+
+
+void power_latency_init(int32_t cpuLatencyUs, bool pinFrequency)
+{
+  _cpuLatencyUs = cpuLatencyUs;
+  _pinFrequency = pinFrequency;
+}
+
+
+bool power_latency_hold(void)
+{
+  // Does nothing if already held. Returns false if either setting failed.
+  bool success = true;
+
+  if (_cpuLatencyUs >= 0 && _latencyFd < 0)
+  {
+    _latencyFd = open(CPU_DMA_LATENCY_PATH, O_WRONLY | O_CLOEXEC);
+    if (_latencyFd < 0 || write(_latencyFd, &_cpuLatencyUs, sizeof(_cpuLatencyUs)) != sizeof(_cpuLatencyUs))
+    {
+      fprintf(stderr, "Failed to set CPU latency through %s (%s).\n", CPU_DMA_LATENCY_PATH, strerror(errno));
+      if (_latencyFd >= 0)
+        close(_latencyFd);
+
+      _latencyFd = -1;
+      success = false;
+    }
+  }
+
+  if (_pinFrequency && _savedMinFreq[0] == '\0')
+  {
+    // Cores sharing a cpufreq policy (all of them on a Pi) are pinned together.
+    char maxFreqPath[128];
+    char maxFreq[32];
+    int cpu = sched_getcpu();
+    snprintf(_minFreqPath, sizeof(_minFreqPath), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_min_freq", cpu);
+    snprintf(maxFreqPath, sizeof(maxFreqPath), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_max_freq", cpu);
+
+    if (cpu < 0 || !read_sysfs(_minFreqPath, _savedMinFreq, sizeof(_savedMinFreq)) ||
+        !read_sysfs(maxFreqPath, maxFreq, sizeof(maxFreq)) || !write_sysfs(_minFreqPath, maxFreq))
+    {
+      fprintf(stderr, "Failed to pin the frequency of CPU %d.\n", cpu);
+      _savedMinFreq[0] = '\0';
+      success = false;
+    }
+  }
+
+  return success;
+}
+
+
+void power_latency_release(void)
+{
+  if (_latencyFd >= 0)
+  {
+    close(_latencyFd);
+    _latencyFd = -1;
+  }
+
+  if (_savedMinFreq[0] != '\0')
+  {
+    if (!write_sysfs(_minFreqPath, _savedMinFreq))
+      fprintf(stderr, "Failed to restore %s.\n", _minFreqPath);
+
+    _savedMinFreq[0] = '\0';
+  }
+}
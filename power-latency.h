@@ -0,0 +1,33 @@
+/*
+power-latency.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __POWER_LATENCY_H__
+#define __POWER_LATENCY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void power_latency_init(int32_t cpuLatencyUs, bool pinFrequency);
+bool power_latency_hold(void);
+void power_latency_release(void);
+
+#endif  // __POWER_LATENCY_H__
@@ -0,0 +1,268 @@
+/*
+pps-align.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/pps.h>
+#include "macros.h"
+#include "common.h"
+#include "clock-control.h"
+#include "pps-align.h"
+
+
+// A GPS receiver's PPS output marks the start of each second far more
+// precisely than NTP keeps CLOCK_REALTIME. The kernel timestamps each
+// pulse with CLOCK_REALTIME (RFC 2783), so how far that timestamp is from
+// a whole second is the system clock's error. Edges are keyed that much
+// later or earlier so they line up with PPS rather than the system clock.
+//
+// Pulses are read in their own thread, which is not real-time. The offset
+// is the median of the last few pulses, so a single bad pulse is ignored.
+// If the pulses stop, the last offset is held.
+//
+// For testing, "mock[:US]" simulates a PPS source US microseconds after
+// each CLOCK_REALTIME second. The pps-ktimer kernel module is a simulated
+// source that exercises the real interface.
+
+#define PPS_FETCH_TIMEOUT_SEC 2
+#define PPS_RETRY_SEC         1  // Pause after a fetch error other than a timeout
+
+
+static volatile sig_atomic_t _ppsRun = 0;
+static pthread_t _ppsThreadId;
+static int _ppsFd = -1;
+static bool _mockPps = false;
+static int64_t _mockOffsetNs = 0;
+
+// Written by the PPS thread only.
+static int64_t _offsetNs = 0;
+static int64_t _jitterNs = 0;
+static uint64_t _pulses = 0;
+static uint64_t _rejected = 0;
+static time_t _lastPulse = 0;
+
+
+static bool fetch_pulse(int64_t *pPulseNs);
+static void *thread_pps(void *arg);
+
+
+static bool fetch_pulse(int64_t *pPulseNs)
+{
+  // Waits for the next pulse and returns its CLOCK_REALTIME timestamp,
+  // or false with errno set.
+  // Mock pulses are stamped with their nominal time, as the kernel would
+  // stamp them from the interrupt rather than when this thread wakes.
+  if (_mockPps)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct timespec pulse = { .tv_sec = now.tv_sec + 1, .tv_nsec = 0 };
+    int64_t pulseNs = TIMESPEC_TO_NS(pulse) + _mockOffsetNs;
+    pulse = NS_TO_TIMESPEC(pulseNs);
+    clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &pulse, NULL);
+
+    *pPulseNs = pulseNs;
+    return true;
+  }
+
+  struct pps_fdata fetchData;
+  memset(&fetchData, 0, sizeof(fetchData));
+  fetchData.timeout.sec = PPS_FETCH_TIMEOUT_SEC;
+
+  if (ioctl(_ppsFd, PPS_FETCH, &fetchData) < 0)
+    return false;
+
+  *pPulseNs = fetchData.info.assert_tu.sec * NSEC_PER_SEC + fetchData.info.assert_tu.nsec;
+  return true;
+}
+
+
+static void *thread_pps(void *arg)
+{
+  (void)arg;
+
+  int64_t history[PPS_FILTER_LENGTH];
+  uint32_t historyCount = 0;
+  int64_t lastPulseNs = 0;
+  bool failing = false;
+
+  while (_ppsRun)
+  {
+    // A timeout just means no pulse yet. Other errors, such as a USB
+    // receiver being unplugged, fail straight away, so they are reported
+    // once and retried after a pause. The last offset is held meanwhile.
+    int64_t pulseNs;
+    if (!fetch_pulse(&pulseNs))
+    {
+      if (errno != ETIMEDOUT && errno != EINTR)
+      {
+        if (!failing)
+          fprintf(stderr, "PPS fetch failed (%s). Holding the last offset.\n", strerror(errno));
+
+        failing = true;
+        sleep(PPS_RETRY_SEC);
+      }
+
+      continue;
+    }
+
+    if (failing)
+      fprintf(stderr, "PPS fetch recovered.\n");
+
+    failing = false;
+    if (pulseNs == lastPulseNs)
+      continue;
+
+    lastPulseNs = pulseNs;
+
+    // The nearest whole second is the one the pulse marks.
+    int64_t offsetNs = pulseNs % NSEC_PER_SEC;
+    if (offsetNs >= NSEC_PER_SEC / 2)
+      offsetNs -= NSEC_PER_SEC;
+
+    if (llabs(offsetNs) > PPS_MAX_OFFSET_NS)
+    {
+      __atomic_store_n(&_rejected, _rejected + 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    history[historyCount++ % PPS_FILTER_LENGTH] = offsetNs;
+
+    uint32_t count = (historyCount < PPS_FILTER_LENGTH) ? historyCount : PPS_FILTER_LENGTH;
+    int64_t sorted[PPS_FILTER_LENGTH];
+    memcpy(sorted, history, count * sizeof(int64_t));
+    qsort(sorted, count, sizeof(int64_t), compare_int64);
+
+    __atomic_store_n(&_offsetNs, sorted[count / 2], __ATOMIC_RELAXED);
+    __atomic_store_n(&_jitterNs, sorted[count - 1] - sorted[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&_lastPulse, (time_t)((pulseNs + NSEC_PER_SEC / 2) / NSEC_PER_SEC), __ATOMIC_RELAXED);
+    __atomic_store_n(&_pulses, _pulses + 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+
+bool pps_align_start(const char *pPath)
+{
+  if (!strncmp(pPath, "mock", 4))
+  {
+    double offsetUs = 0;
+    if (!is_mock_registers() || (pPath[4] != '\0' && (pPath[4] != ':' || sscanf(pPath + 5, "%lf", &offsetUs) < 1)))
+    {
+      fprintf(stderr, "Error: A mock PPS source is given as mock[:US] and requires mock registers.\n");
+      return false;
+    }
+
+    _mockPps = true;
+    _mockOffsetNs = llround(offsetUs * 1000.0);
+  }
+  else
+  {
+    _ppsFd = open(pPath, O_RDWR | O_CLOEXEC);
+    if (_ppsFd < 0)
+    {
+      fprintf(stderr, "Failed to open PPS source %s (%s).\n", pPath, strerror(errno));
+      return false;
+    }
+
+    int capabilities = 0;
+    if (ioctl(_ppsFd, PPS_GETCAP, &capabilities) < 0 || !(capabilities & PPS_CAPTUREASSERT))
+    {
+      fprintf(stderr, "Error: PPS source %s cannot capture assert edges.\n", pPath);
+      pps_align_stop();
+      return false;
+    }
+
+    // Most drivers already capture assert edges, so this may fail without
+    // CAP_SYS_TIME and still leave a working source.
+    struct pps_kparams params;
+    memset(&params, 0, sizeof(params));
+    params.api_version = PPS_API_VERS;
+    params.mode = PPS_CAPTUREASSERT | PPS_TSFMT_TSPEC;
+    if (ioctl(_ppsFd, PPS_SETPARAMS, &params) < 0)
+      fprintf(stderr, "Failed to set PPS parameters of %s (%s). Using the current mode.\n", pPath, strerror(errno));
+  }
+
+  _ppsRun = 1;
+  if (!start_helper_thread(&_ppsThreadId, thread_pps))
+  {
+    fprintf(stderr, "Failed to create PPS thread.\n");
+    _ppsRun = 0;
+    pps_align_stop();
+    return false;
+  }
+
+  return true;
+}
+
+
+void pps_align_stop(void)
+{
+  // The thread notices within a fetch timeout or a mock second.
+  if (_ppsRun)
+  {
+    _ppsRun = 0;
+    pthread_join(_ppsThreadId, NULL);
+  }
+
+  if (_ppsFd >= 0)
+  {
+    close(_ppsFd);
+    _ppsFd = -1;
+  }
+}
+
+
+bool get_pps_offset(int64_t *pOffsetNs)
+{
+  // Returns the offset to add to edge times. It is false before the first
+  // pulse, and once pulses stop, though the last offset is still given.
+  if (__atomic_load_n(&_pulses, __ATOMIC_ACQUIRE) == 0)
+    return false;
+
+  *pOffsetNs = __atomic_load_n(&_offsetNs, __ATOMIC_RELAXED);
+  return (time(NULL) - __atomic_load_n(&_lastPulse, __ATOMIC_RELAXED) <= PPS_HOLDOVER_SEC);
+}
+
+
+void get_pps_status(PPS_STATUS *pStatus)
+{
+  pStatus->pulses = __atomic_load_n(&_pulses, __ATOMIC_ACQUIRE);
+  pStatus->offsetNs = __atomic_load_n(&_offsetNs, __ATOMIC_RELAXED);
+  pStatus->jitterNs = __atomic_load_n(&_jitterNs, __ATOMIC_RELAXED);
+  pStatus->rejected = __atomic_load_n(&_rejected, __ATOMIC_RELAXED);
+  pStatus->lastPulse = __atomic_load_n(&_lastPulse, __ATOMIC_RELAXED);
+}
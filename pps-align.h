@@ -0,0 +1,48 @@
+/*
+pps-align.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __PPS_ALIGN_H__
+#define __PPS_ALIGN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define PPS_FILTER_LENGTH   5           // Pulses in the median filter
+#define PPS_MAX_OFFSET_NS   100000000   // Larger offsets are rejected
+#define PPS_HOLDOVER_SEC    10          // Pulses older than this are stale
+
+typedef struct
+{
+  int64_t offsetNs;   // Filtered CLOCK_REALTIME reading at the PPS edge, from the second
+  int64_t jitterNs;   // Spread of the pulses in the filter
+  uint64_t pulses;    // Pulses accepted
+  uint64_t rejected;  // Pulses too far from a second
+  time_t lastPulse;   // CLOCK_REALTIME second of the last accepted pulse
+} PPS_STATUS;
+
+bool pps_align_start(const char *pPath);
+void pps_align_stop(void);
+bool get_pps_offset(int64_t *pOffsetNs);
+void get_pps_status(PPS_STATUS *pStatus);
+
+#endif  // __PPS_ALIGN_H__
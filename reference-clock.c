@@ -0,0 +1,306 @@
+/*
+reference-clock.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/timex.h>
+#include <linux/ptp_clock.h>
+#include "macros.h"
+#include "clock-control.h"
+#include "timestamp.h"
+#include "reference-clock.h"
+
+
+// A PTP hardware clock, or any other dynamic POSIX clock, can be used as
+// the time reference instead of CLOCK_REALTIME. The minute encoded and the
+// times of all edges are then taken from the reference clock.
+//
+// Dynamic clocks can be read but not slept on, so the reference clock is
+// correlated with CLOCK_REALTIME every second, measuring both the offset
+// and its rate of change. Edge times are converted to CLOCK_REALTIME for
+// the sleeps and timestamps, so the system clock need not be disciplined
+// at all. Reference: https://docs.kernel.org/driver-api/ptp.html
+//
+// A PTP clock disciplined by ptp4l runs on TAI, so by default the kernel's
+// TAI offset is subtracted from every reading. It is re-read with each
+// correlation to follow leap seconds, and must have been set, e.g. by
+// phc2sys or from chrony's leap second table. A clock kept on UTC is
+// given as "PATH,utc".
+//
+// For testing, "mock[:MS]" is a reference clock MS milliseconds ahead of
+// CLOCK_TAI, or of CLOCK_REALTIME with ",utc".
+
+#ifndef CLOCKFD
+#define CLOCKFD 3
+#endif
+#ifndef FD_TO_CLOCKID
+#define FD_TO_CLOCKID(fd) ((~(clockid_t)(fd) << 3) | CLOCKFD)
+#endif
+
+#define CORRELATION_SAMPLES    5           // Narrowest read window is kept
+#define RATE_MIN_INTERVAL_NS   500000000   // Shorter intervals keep the last rate
+#define RATE_FILTER_WEIGHT     0.25        // Weight of each new rate measurement
+
+
+// Correlated from the main thread before the real-time thread starts,
+// and only by the real-time thread after that.
+static int _clockFd = -1;
+static clockid_t _clockId = CLOCK_REALTIME;
+static bool _mockClock = false;
+static int64_t _mockOffsetNs = 0;
+static bool _taiClock = true;
+static int64_t _taiOffsetNs = 0;  // TAI minus UTC, from the kernel
+static bool _correlated = false;
+static int64_t _baseRealtimeNs = 0;
+static int64_t _baseOffsetNs = 0;
+static double _rate = 0;  // Offset change per CLOCK_REALTIME ns
+
+
+static bool read_tai_offset(int64_t *pTaiOffsetNs);
+static bool measure_offset(int64_t *pRealtimeNs, int64_t *pOffsetNs, int64_t *pWindowNs);
+
+
+static bool read_tai_offset(int64_t *pTaiOffsetNs)
+{
+  // Returns false if the kernel's TAI offset can't be read.
+  struct timex tx;
+  memset(&tx, 0, sizeof(tx));
+  if (adjtimex(&tx) < 0)
+    return false;
+
+  *pTaiOffsetNs = tx.tai * NSEC_PER_SEC;
+  return true;
+}
+
+
+static bool measure_offset(int64_t *pRealtimeNs, int64_t *pOffsetNs, int64_t *pWindowNs)
+{
+  // Takes the reference clock reading with the narrowest CLOCK_REALTIME
+  // bracket. The kernel brackets the hardware read itself where it can.
+  CLOCK_BRACKET samples[CORRELATION_SAMPLES];
+
+#ifdef PTP_SYS_OFFSET_EXTENDED
+  struct ptp_sys_offset_extended extended;
+  memset(&extended, 0, sizeof(extended));
+  extended.n_samples = CORRELATION_SAMPLES;
+
+  if (!_mockClock && ioctl(_clockFd, PTP_SYS_OFFSET_EXTENDED, &extended) == 0)
+  {
+    for (int i = 0; i < CORRELATION_SAMPLES; i++)
+    {
+      samples[i].before = extended.ts[i][0].sec * NSEC_PER_SEC + extended.ts[i][0].nsec;
+      samples[i].reading = extended.ts[i][1].sec * NSEC_PER_SEC + extended.ts[i][1].nsec;
+      samples[i].after = extended.ts[i][2].sec * NSEC_PER_SEC + extended.ts[i][2].nsec;
+    }
+  }
+  else
+#endif
+  {
+    for (int i = 0; i < CORRELATION_SAMPLES; i++)
+    {
+      struct timespec before, reference, after;
+      clock_gettime(CLOCK_REALTIME, &before);
+      clockid_t clockId = !_mockClock ? _clockId : _taiClock ? CLOCK_TAI : CLOCK_REALTIME;
+      if (clock_gettime(clockId, &reference))
+        return false;
+      clock_gettime(CLOCK_REALTIME, &after);
+
+      samples[i].before = TIMESPEC_TO_NS(before);
+      samples[i].reading = TIMESPEC_TO_NS(reference) + _mockOffsetNs;
+      samples[i].after = TIMESPEC_TO_NS(after);
+    }
+  }
+
+  const CLOCK_BRACKET *pBest = narrowest_bracket(samples, CORRELATION_SAMPLES);
+  *pRealtimeNs = pBest->before + (pBest->after - pBest->before) / 2;
+  *pOffsetNs = pBest->reading - (_taiClock ? _taiOffsetNs : 0) - *pRealtimeNs;
+  *pWindowNs = pBest->after - pBest->before;
+  return true;
+}
+
+
+bool reference_clock_open(const char *pSource)
+{
+  // The source is given as PATH[,utc|tai].
+  char path[PATH_MAX];
+  const char *pScale = strrchr(pSource, ',');
+  size_t pathLength = (pScale != NULL) ? (size_t)(pScale - pSource) : strlen(pSource);
+  if (pathLength == 0 || pathLength >= sizeof(path) ||
+      (pScale != NULL && strcasecmp(pScale + 1, "utc") && strcasecmp(pScale + 1, "tai")))
+  {
+    fprintf(stderr, "Error: A clock source is given as PATH[,utc|tai].\n");
+    return false;
+  }
+
+  memcpy(path, pSource, pathLength);
+  path[pathLength] = '\0';
+  _taiClock = (pScale == NULL || !strcasecmp(pScale + 1, "tai"));
+
+  // A mock TAI clock is derived from CLOCK_TAI, so is consistent with
+  // whatever offset the kernel has.
+  if (_taiClock && (!read_tai_offset(&_taiOffsetNs) || (_taiOffsetNs == 0 && strncmp(path, "mock", 4))))
+  {
+    fprintf(stderr, "Error: The kernel TAI offset is not set, so %s can't be converted to UTC. "
+                    "Set it, or give the clock source as %s,utc if the clock runs on UTC.\n", path, path);
+    return false;
+  }
+
+  const char *pPath = path;
+  if (!strncmp(pPath, "mock", 4))
+  {
+    double offsetMs = 0;
+    if (!is_mock_registers() || (pPath[4] != '\0' && (pPath[4] != ':' || sscanf(pPath + 5, "%lf", &offsetMs) < 1)))
+    {
+      fprintf(stderr, "Error: A mock clock source is given as mock[:MS] and requires mock registers.\n");
+      return false;
+    }
+
+    _mockClock = true;
+    _mockOffsetNs = llround(offsetMs * 1e6);
+  }
+  else
+  {
+    _clockFd = open(pPath, O_RDONLY | O_CLOEXEC);
+    if (_clockFd < 0)
+    {
+      fprintf(stderr, "Failed to open clock source %s (%s).\n", pPath, strerror(errno));
+      return false;
+    }
+
+    _clockId = FD_TO_CLOCKID(_clockFd);
+
+    struct timespec now;
+    if (clock_gettime(_clockId, &now))
+    {
+      fprintf(stderr, "Error: %s is not a POSIX clock (%s).\n", pPath, strerror(errno));
+      reference_clock_close();
+      return false;
+    }
+  }
+
+  REFERENCE_CORRELATION correlation;
+  if (!reference_clock_correlate(&correlation))
+  {
+    fprintf(stderr, "Failed to read clock source %s.\n", pPath);
+    reference_clock_close();
+    return false;
+  }
+
+  return true;
+}
+
+
+void reference_clock_close(void)
+{
+  if (_clockFd >= 0)
+  {
+    close(_clockFd);
+    _clockFd = -1;
+  }
+
+  _clockId = CLOCK_REALTIME;
+  _mockClock = false;
+  _correlated = false;
+}
+
+
+bool is_reference_clock(void)
+{
+  return _correlated;
+}
+
+
+bool reference_clock_correlate(REFERENCE_CORRELATION *pCorrelation)
+{
+  // Re-anchors the offset to CLOCK_REALTIME. The rate is smoothed, as the
+  // interval between correlations is short.
+  if (_clockFd < 0 && !_mockClock)
+    return false;
+
+  // A change of TAI offset is a leap second, which steps the offset
+  // without being a change of rate.
+  int64_t lastTaiOffsetNs = _taiOffsetNs;
+  if (_taiClock && !read_tai_offset(&_taiOffsetNs))
+    return false;
+
+  int64_t realtimeNs, offsetNs, windowNs;
+  if (!measure_offset(&realtimeNs, &offsetNs, &windowNs))
+    return false;
+
+  int64_t intervalNs = realtimeNs - _baseRealtimeNs;
+  if (_correlated && intervalNs >= RATE_MIN_INTERVAL_NS && _taiOffsetNs == lastTaiOffsetNs)
+  {
+    double rate = (double)(offsetNs - _baseOffsetNs) / intervalNs;
+    _rate += (rate - _rate) * RATE_FILTER_WEIGHT;
+  }
+
+  _baseRealtimeNs = realtimeNs;
+  _baseOffsetNs = offsetNs;
+  _correlated = true;
+
+  pCorrelation->offsetNs = offsetNs;
+  pCorrelation->ratePpm = _rate * 1e6;
+  pCorrelation->windowNs = windowNs;
+  return true;
+}
+
+
+int64_t reference_now_ns(void)
+{
+  // Returns the reference time extrapolated from CLOCK_REALTIME, which is
+  // CLOCK_REALTIME itself without a reference clock.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t realtimeNs = TIMESPEC_TO_NS(now);
+
+  if (!_correlated)
+    return realtimeNs;
+
+  return realtimeNs + _baseOffsetNs + llround((realtimeNs - _baseRealtimeNs) * _rate);
+}
+
+
+time_t reference_time(void)
+{
+  return reference_now_ns() / NSEC_PER_SEC;
+}
+
+
+int64_t reference_to_realtime_ns(int64_t referenceNs)
+{
+  // Inverse of the extrapolation in reference_now_ns().
+  if (!_correlated)
+    return referenceNs;
+
+  int64_t sinceBaseNs = referenceNs - (_baseRealtimeNs + _baseOffsetNs);
+  return _baseRealtimeNs + llround(sinceBaseNs / (1.0 + _rate));
+}
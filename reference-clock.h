@@ -0,0 +1,45 @@
+/*
+reference-clock.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __REFERENCE_CLOCK_H__
+#define __REFERENCE_CLOCK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+typedef struct
+{
+  int64_t offsetNs;  // Reference clock minus CLOCK_REALTIME
+  double ratePpm;    // Rate of change of the offset
+  int64_t windowNs;  // CLOCK_REALTIME window around the reference clock read
+} REFERENCE_CORRELATION;
+
+bool reference_clock_open(const char *pPath);
+void reference_clock_close(void);
+bool is_reference_clock(void);
+bool reference_clock_correlate(REFERENCE_CORRELATION *pCorrelation);
+int64_t reference_now_ns(void);
+time_t reference_time(void);
+int64_t reference_to_realtime_ns(int64_t referenceNs);
+
+#endif  // __REFERENCE_CLOCK_H__
@@ -0,0 +1,81 @@
+/*
+rt-prepare.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "rt-prepare.h"
+
+
+// Memory below the caller that is left untouched, so the writes never
+// reach the caller's own frame or a red zone below it.
+#define STACK_PREFAULT_MARGIN 1024
+
+
+size_t prefault_thread_stack(void)
+{
+  // Writes to every page of the calling thread's stack below the current
+  // frame, so later calls never take a fault growing into it. Returns the
+  // number of bytes touched, or zero on failure.
+  pthread_attr_t attr;
+  void *stackAddr;
+  size_t stackSize;
+
+  if (pthread_getattr_np(pthread_self(), &attr))
+    return 0;
+
+  int result = pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+  pthread_attr_destroy(&attr);
+  if (result)
+    return 0;
+
+  volatile uint8_t marker = 0;
+  uintptr_t bottom = (uintptr_t)stackAddr;
+  uintptr_t top = (uintptr_t)&marker - STACK_PREFAULT_MARGIN;
+  if (top <= bottom)
+    return 0;
+
+  volatile uint8_t *pBottom = stackAddr;
+  size_t length = top - bottom;
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < length; offset += pageSize)
+    pBottom[offset] = 0;
+
+  return length;
+}
+
+
+bool get_thread_page_faults(PAGE_FAULTS *pFaults)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage))
+    return false;
+
+  pFaults->minor = usage.ru_minflt;
+  pFaults->major = usage.ru_majflt;
+  return true;
+}
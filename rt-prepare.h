@@ -0,0 +1,39 @@
+/*
+rt-prepare.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __RT_PREPARE_H__
+#define __RT_PREPARE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+  uint64_t minor;  // Faults served without I/O, e.g. a first touch of a page
+  uint64_t major;  // Faults that read from disk
+} PAGE_FAULTS;
+
+size_t prefault_thread_stack(void);
+bool get_thread_page_faults(PAGE_FAULTS *pFaults);
+
+#endif  // __RT_PREPARE_H__
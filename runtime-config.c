@@ -0,0 +1,302 @@
+/*
+runtime-config.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "macros.h"
+#include "runtime-config.h"
+
+
+// Settings that can change while running are held in a RUNTIME_CONFIG
+// which is never modified once published. A reload builds a new one and
+// swaps the published pointer, so the real-time thread only ever does
+// two atomic loads and a store to pick up a change at a minute boundary.
+//
+// Replaced configurations are retired rather than freed. The real-time
+// thread announces the configuration it is using before checking it is
+// still current, so a retired configuration can be freed as soon as it
+// is no longer the one announced.
+
+
+static RUNTIME_CONFIG *_pCurrentConfig = NULL;
+static RUNTIME_CONFIG *_pConfigInUse = NULL;
+static RUNTIME_CONFIG *_pRetiredConfigs[RUNTIME_CONFIG_MAX_RETIRED];
+static size_t _retiredCount = 0;
+static int _reloadEventFd = -1;
+static int _wakeTimerFd = -1;
+
+
+static char *trim(char *s);
+static bool set_config_value(RUNTIME_CONFIG *pConfig, const char *key, char *value);
+
+
+static char *trim(char *s)
+{
+  while (isspace((unsigned char)*s))
+    s++;
+
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    end--;
+
+  *end = '\0';
+  return s;
+}
+
+
+static bool set_config_value(RUNTIME_CONFIG *pConfig, const char *key, char *value)
+{
+  // Keys are the long option names of the matching command line options.
+  if (!strcmp(key, "schedule"))
+  {
+    uint16_t preRollMinutes = pConfig->schedule.preRollMinutes;
+    if (!get_periodic_schedule(&pConfig->schedule, value))
+      return false;
+
+    pConfig->schedule.preRollMinutes = preRollMinutes;
+    return true;
+  }
+
+  if (!strcmp(key, "pre-roll"))
+  {
+    uint16_t preRollMinutes = 0;
+    if (sscanf(value, "%" SCNu16, &preRollMinutes) < 1 || preRollMinutes > SCHEDULE_MAX_PRE_ROLL)
+      return false;
+
+    pConfig->schedule.preRollMinutes = preRollMinutes;
+    return true;
+  }
+
+  if (!strcmp(key, "time-offset"))
+    return sscanf(value, "%lf", &pConfig->hourOffset) == 1;
+
+  if (!strcmp(key, "verbose"))
+    return sscanf(value, "%" SCNu8, &pConfig->verbosityLevel) == 1;
+
+  return false;
+}
+
+
+bool load_runtime_config(RUNTIME_CONFIG *pConfig, const char *path)
+{
+  // The file contains one "key = value" setting per line. Blank lines and
+  // lines starting with '#' are ignored. Settings not in the file keep
+  // the values already in pConfig, which are those from the command line.
+  FILE *pFile = fopen(path, "r");
+  if (pFile == NULL)
+  {
+    fprintf(stderr, "Error: Failed to open configuration file %s (%s).\n", path, strerror(errno));
+    return false;
+  }
+
+  bool result = true;
+  char line[1024];
+  for (int lineNumber = 1; fgets(line, sizeof(line), pFile) != NULL; lineNumber++)
+  {
+    char *key = trim(line);
+    if (*key == '\0' || *key == '#')
+      continue;
+
+    char *equals = strchr(key, '=');
+    if (equals == NULL)
+    {
+      fprintf(stderr, "Error: %s:%d: Expected key = value.\n", path, lineNumber);
+      result = false;
+      continue;
+    }
+
+    *equals = '\0';
+    key = trim(key);
+    char *value = trim(equals + 1);
+
+    if (!set_config_value(pConfig, key, value))
+    {
+      fprintf(stderr, "Error: %s:%d: Invalid setting %s = %s.\n", path, lineNumber, key, value);
+      result = false;
+    }
+  }
+
+  fclose(pFile);
+  return result;
+}
+
+
+bool runtime_config_init(RUNTIME_CONFIG *pConfig)
+{
+  _reloadEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_reloadEventFd < 0)
+  {
+    perror("Failed to create configuration reload event");
+    return false;
+  }
+
+  _wakeTimerFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (_wakeTimerFd < 0)
+  {
+    perror("Failed to create off window timer");
+    return false;
+  }
+
+  __atomic_store_n(&_pCurrentConfig, pConfig, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+
+bool runtime_config_publish(RUNTIME_CONFIG *pConfig)
+{
+  runtime_config_reclaim();
+  if (_retiredCount >= RUNTIME_CONFIG_MAX_RETIRED)
+  {
+    fprintf(stderr, "Error: Too many configuration reloads pending.\n");
+    return false;
+  }
+
+  pConfig->generation = _pCurrentConfig->generation + 1;
+  _pRetiredConfigs[_retiredCount++] = __atomic_exchange_n(&_pCurrentConfig, pConfig, __ATOMIC_SEQ_CST);
+
+  runtime_config_wake();
+  return true;
+}
+
+
+const RUNTIME_CONFIG *runtime_config_acquire(void)
+{
+  RUNTIME_CONFIG *pConfig;
+
+  do
+  {
+    pConfig = __atomic_load_n(&_pCurrentConfig, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&_pConfigInUse, pConfig, __ATOMIC_SEQ_CST);
+  } while (pConfig != __atomic_load_n(&_pCurrentConfig, __ATOMIC_SEQ_CST));
+
+  return pConfig;
+}
+
+
+bool runtime_config_changed(const RUNTIME_CONFIG *pConfig)
+{
+  return pConfig != __atomic_load_n(&_pCurrentConfig, __ATOMIC_SEQ_CST);
+}
+
+
+void runtime_config_wake(void)
+{
+  // Cuts short a sleep of the real-time thread through an off window.
+  uint64_t one = 1;
+  (void)!write(_reloadEventFd, &one, sizeof(one));
+}
+
+
+bool runtime_config_sleep_until(time_t wakeTime)
+{
+  // Returns true once wakeTime is reached, or false if the sleep was cut
+  // short by runtime_config_wake() or a signal. The timer is absolute on
+  // CLOCK_REALTIME, so a clock step during the sleep (e.g. the first NTP
+  // sync after booting on saved time) moves the wake-up with it. A step
+  // cancels the timer, which is then re-armed.
+  struct pollfd pollFds[2] =
+  {
+    { .fd = _reloadEventFd, .events = POLLIN },
+    { .fd = _wakeTimerFd, .events = POLLIN }
+  };
+
+  for (;;)
+  {
+    struct itimerspec timerSpec = { .it_value = { .tv_sec = wakeTime, .tv_nsec = 0 } };
+    if (timerfd_settime(_wakeTimerFd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &timerSpec, NULL) < 0)
+      return false;
+
+    int result = ppoll(pollFds, 2, NULL, NULL);
+
+    if (result > 0 && (pollFds[0].revents & POLLIN))
+    {
+      uint64_t count;
+      (void)!read(_reloadEventFd, &count, sizeof(count));
+      return false;
+    }
+
+    if (result > 0 && (pollFds[1].revents & POLLIN))
+    {
+      uint64_t expirations;
+      if (read(_wakeTimerFd, &expirations, sizeof(expirations)) > 0)
+        return true;
+
+      if (errno != ECANCELED && errno != EAGAIN)
+        return false;
+
+      continue;
+    }
+
+    if (result < 0 && errno == EINTR)
+      return false;
+  }
+}
+
+
+void runtime_config_reclaim(void)
+{
+  RUNTIME_CONFIG *pInUse = __atomic_load_n(&_pConfigInUse, __ATOMIC_SEQ_CST);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < _retiredCount; i++)
+  {
+    if (_pRetiredConfigs[i] == pInUse)
+      _pRetiredConfigs[kept++] = _pRetiredConfigs[i];
+    else
+      free(_pRetiredConfigs[i]);
+  }
+
+  _retiredCount = kept;
+}
+
+
+void runtime_config_cleanup(void)
+{
+  // Only called once the real-time thread has stopped.
+  for (size_t i = 0; i < _retiredCount; i++)
+    free(_pRetiredConfigs[i]);
+
+  _retiredCount = 0;
+  free(_pCurrentConfig);
+  _pCurrentConfig = NULL;
+  _pConfigInUse = NULL;
+
+  if (_reloadEventFd >= 0)
+    close(_reloadEventFd);
+  _reloadEventFd = -1;
+
+  if (_wakeTimerFd >= 0)
+    close(_wakeTimerFd);
+  _wakeTimerFd = -1;
+}
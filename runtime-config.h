@@ -0,0 +1,51 @@
+/*
+runtime-config.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __RUNTIME_CONFIG_H__
+#define __RUNTIME_CONFIG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "schedule.h"
+
+#define RUNTIME_CONFIG_MAX_RETIRED 8
+
+typedef struct
+{
+  uint32_t generation;     // Incremented on each reload
+  RUN_SCHEDULE schedule;
+  double hourOffset;
+  uint8_t verbosityLevel;
+} RUNTIME_CONFIG;
+
+bool load_runtime_config(RUNTIME_CONFIG *pConfig, const char *path);
+bool runtime_config_init(RUNTIME_CONFIG *pConfig);
+bool runtime_config_publish(RUNTIME_CONFIG *pConfig);
+const RUNTIME_CONFIG *runtime_config_acquire(void);
+bool runtime_config_changed(const RUNTIME_CONFIG *pConfig);
+bool runtime_config_sleep_until(time_t wakeTime);
+void runtime_config_wake(void);
+void runtime_config_reclaim(void);
+void runtime_config_cleanup(void);
+
+#endif  // __RUNTIME_CONFIG_H__
@@ -0,0 +1,584 @@
+/*
+schedule.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include "macros.h"
+#include "schedule.h"
+
+
+// Maximum candidate transitions examined when searching for the next
+// change of state. Only reached with many windows masked by exceptions.
+#define SCHEDULE_MAX_SEARCH_STEPS 20000
+
+
+static bool get_day_mask(char *daysString, uint8_t *pMask);
+static bool get_schedule_date(const char *dateString, struct tm *pDate);
+static bool get_schedule_window(char *windowString, uint16_t *pStartMinute, uint16_t *pRunMinutes);
+static bool add_exception(RUN_SCHEDULE *pSchedule, const struct tm *pDate, uint16_t startMinute, uint16_t runMinutes, bool on);
+static void set_week_bit(uint64_t *weekBits, int minuteOfWeek);
+static bool is_week_bit_set(const uint64_t *weekBits, int minuteOfWeek);
+static int find_week_bit(const uint64_t *weekBits, int fromMinute, bool value);
+static int get_minute_of_week(time_t t, long *pGmtOffset);
+static int get_exception_state(const RUN_SCHEDULE *pSchedule, time_t t);
+static time_t get_next_week_transition(const RUN_SCHEDULE *pSchedule, time_t t);
+
+
+static const char * const DayNames[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+
+static bool get_day_mask(char *daysString, uint8_t *pMask)
+{
+  // Days are a ',' separated list of day names or ranges of day names.
+  // e.g. "Mon-Fri", "Sat,Sun", "Fri-Mon"
+  *pMask = 0;
+
+  char *sp = NULL;
+  for (char *dayEntry = strtok_r(daysString, ",", &sp);
+       dayEntry != NULL;
+       dayEntry = strtok_r(NULL, ",", &sp))
+  {
+    int first = -1;
+    int last = -1;
+    char *rangeEnd = strchr(dayEntry, '-');
+    if (rangeEnd != NULL)
+      *rangeEnd++ = '\0';
+
+    for (int d = 0; d < 7; d++)
+    {
+      if (!strncasecmp(dayEntry, DayNames[d], 3))
+        first = d;
+
+      if (rangeEnd != NULL && !strncasecmp(rangeEnd, DayNames[d], 3))
+        last = d;
+    }
+
+    if (rangeEnd == NULL)
+      last = first;
+
+    if (first < 0 || last < 0)
+      return false;
+
+    for (int d = first; ; d = (d + 1) % 7)
+    {
+      *pMask |= (1 << d);
+      if (d == last)
+        break;
+    }
+  }
+
+  return *pMask != 0;
+}
+
+
+static bool get_schedule_date(const char *dateString, struct tm *pDate)
+{
+  int year, month, day, length = 0;
+  if (sscanf(dateString, "%4d-%2d-%2d%n", &year, &month, &day, &length) < 3 || dateString[length] != '\0')
+    return false;
+
+  if (month < 1 || month > 12 || day < 1 || day > 31)
+    return false;
+
+  memset(pDate, 0, sizeof(struct tm));
+  pDate->tm_year = year - 1900;
+  pDate->tm_mon = month - 1;
+  pDate->tm_mday = day;
+  pDate->tm_isdst = -1;
+
+  // Days past the end of the month, e.g. 2024-02-30, are not dates.
+  struct tm check = *pDate;
+  check.tm_hour = 12;
+  return mktime(&check) != (time_t)-1 && check.tm_mday == day;
+}
+
+
+static bool get_schedule_window(char *windowString, uint16_t *pStartMinute, uint16_t *pRunMinutes)
+{
+  char delimInner[] = ":";
+  char *spInner = NULL;
+
+  char *startHourString = strtok_r(windowString, delimInner, &spInner);
+  if (startHourString == NULL)
+  {
+    fprintf(stderr, "Error: Missing schedule start hour.\n");
+    return false;
+  }
+
+  double startHour = 0;
+  if ((sscanf(startHourString, "%lf", &startHour) < 1) || (!(startHour >= 0 && startHour < 24)))
+  {
+    fprintf(stderr, "Error: Invalid schedule start hour (%s).\n", startHourString);
+    return false;
+  }
+
+  char *runMinutesString = strtok_r(NULL, delimInner, &spInner);
+  if (runMinutesString == NULL)
+  {
+    fprintf(stderr, "Error: Missing schedule run time minutes (%s).\n", startHourString);
+    return false;
+  }
+
+  uint16_t runMinutes = 0;
+  if ((sscanf(runMinutesString, "%" SCNu16, &runMinutes) < 1) || (runMinutes > MINUTES_IN_DAY))
+  {
+    fprintf(stderr, "Error: Invalid schedule run time minutes (%s).\n", runMinutesString);
+    return false;
+  }
+
+  uint16_t startMinute = lround(startHour * 60);
+  if (startMinute >= MINUTES_IN_DAY)
+  {
+    fprintf(stderr, "Error: Invalid schedule start minute encountered (%" PRIu16 ").\n", startMinute);
+    return false;
+  }
+
+  *pStartMinute = startMinute;
+  *pRunMinutes = runMinutes;
+  return true;
+}
+
+
+static bool add_exception(RUN_SCHEDULE *pSchedule, const struct tm *pDate, uint16_t startMinute, uint16_t runMinutes, bool on)
+{
+  if (pSchedule->exceptionCount >= SCHEDULE_MAX_EXCEPTIONS)
+  {
+    fprintf(stderr, "Error: Too many schedule date entries (maximum %d).\n", SCHEDULE_MAX_EXCEPTIONS);
+    return false;
+  }
+
+  // mktime() normalizes minutes past the end of the day and
+  // applies any daylight saving change on the date.
+  struct tm startParts = *pDate;
+  startParts.tm_min = startMinute;
+
+  struct tm endParts = *pDate;
+  endParts.tm_min = startMinute + runMinutes;
+
+  SCHEDULE_EXCEPTION *pException = &pSchedule->exceptions[pSchedule->exceptionCount];
+  pException->startTime = mktime(&startParts);
+  pException->endTime = mktime(&endParts);
+  pException->on = on;
+
+  if (pException->startTime == (time_t)-1 || pException->endTime <= pException->startTime)
+  {
+    fprintf(stderr, "Error: Invalid schedule date entry.\n");
+    return false;
+  }
+
+  pSchedule->exceptionCount++;
+  return true;
+}
+
+
+static void set_week_bit(uint64_t *weekBits, int minuteOfWeek)
+{
+  weekBits[minuteOfWeek / 64] |= (1ULL << (minuteOfWeek % 64));
+}
+
+
+static bool is_week_bit_set(const uint64_t *weekBits, int minuteOfWeek)
+{
+  return (weekBits[minuteOfWeek / 64] >> (minuteOfWeek % 64)) & 0x01;
+}
+
+
+static int find_week_bit(const uint64_t *weekBits, int fromMinute, bool value)
+{
+  // Returns the first minute of the week at or after fromMinute with
+  // the given bit value, or -1 if there is none before the end of the week.
+  for (int word = fromMinute / 64; word < SCHEDULE_WEEK_WORDS; word++)
+  {
+    uint64_t bits = value ? weekBits[word] : ~weekBits[word];
+
+    if (word == fromMinute / 64)
+      bits &= ~0ULL << (fromMinute % 64);
+
+    if (word == SCHEDULE_WEEK_WORDS - 1 && (MINUTES_IN_WEEK % 64) != 0)
+      bits &= (1ULL << (MINUTES_IN_WEEK % 64)) - 1;
+
+    if (bits != 0)
+      return word * 64 + __builtin_ctzll(bits);
+  }
+
+  return -1;
+}
+
+
+static int get_minute_of_week(time_t t, long *pGmtOffset)
+{
+  struct tm timeParts;
+  localtime_r(&t, &timeParts);
+
+  if (pGmtOffset != NULL)
+    *pGmtOffset = timeParts.tm_gmtoff;
+
+  return timeParts.tm_wday * MINUTES_IN_DAY + timeParts.tm_hour * 60 + timeParts.tm_min;
+}
+
+
+static int get_exception_state(const RUN_SCHEDULE *pSchedule, time_t t)
+{
+  // Returns 1 if an exception turns the schedule on at the given time,
+  // 0 if one turns it off or -1 if no exception applies.
+  // Off exceptions take priority over on exceptions.
+  int state = -1;
+
+  for (size_t i = 0; i < pSchedule->exceptionCount; i++)
+  {
+    const SCHEDULE_EXCEPTION *pException = &pSchedule->exceptions[i];
+    if (t < pException->startTime || t >= pException->endTime)
+      continue;
+
+    if (!pException->on)
+      return 0;
+
+    state = 1;
+  }
+
+  return state;
+}
+
+
+static time_t get_next_week_transition(const RUN_SCHEDULE *pSchedule, time_t t)
+{
+  // Returns the start of the next minute where the weekly bits change,
+  // or -1 if they never change.
+  long gmtOffset = 0;
+  int minuteOfWeek = get_minute_of_week(t, &gmtOffset);
+  bool state = is_week_bit_set(pSchedule->weekBits, minuteOfWeek);
+
+  int minutes = -1;
+  int next = find_week_bit(pSchedule->weekBits, minuteOfWeek + 1, !state);
+  if (next >= 0)
+  {
+    minutes = next - minuteOfWeek;
+  }
+  else if ((next = find_week_bit(pSchedule->weekBits, 0, !state)) >= 0)
+  {
+    minutes = MINUTES_IN_WEEK - minuteOfWeek + next;
+  }
+
+  if (minutes < 0)
+    return -1;
+
+  // The weekly bits are in local time. When a daylight saving change
+  // falls before the transition, the change itself is returned instead,
+  // as local time jumps there and the search restarts from it.
+  time_t transition = t + minutes * 60;
+  long transitionGmtOffset = 0;
+  get_minute_of_week(transition, &transitionGmtOffset);
+  if (transitionGmtOffset == gmtOffset)
+    return transition;
+
+  int low = 1;
+  int high = minutes;
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    long midGmtOffset = 0;
+    get_minute_of_week(t + mid * 60, &midGmtOffset);
+
+    if (midGmtOffset != gmtOffset)
+      high = mid;
+    else
+      low = mid + 1;
+  }
+
+  return t + low * 60;
+}
+
+
+void set_schedule_always(RUN_SCHEDULE *pSchedule)
+{
+  memset(pSchedule, 0, sizeof(RUN_SCHEDULE));
+
+  for (int i = 0; i < MINUTES_IN_WEEK; i++)
+    set_week_bit(pSchedule->weekBits, i);
+}
+
+
+bool get_periodic_schedule(RUN_SCHEDULE *pSchedule, const char *paramString)
+{
+  if (pSchedule == NULL || paramString == NULL)
+    return false;
+
+  char *paramCopy = strdup(paramString);
+  if (paramCopy == NULL)
+    return false;
+
+  // The parameter string contains schedule entries separated by a ';'.
+  // Each schedule entry contains a start hour and run time in minutes
+  // separated by a ':'.
+  // For example, if the parameter string is "1:3;15.5:15", then the
+  // schedule entries are 1am for 3 minutes and 3:30pm for 15 minutes.
+  //
+  // An entry may be limited to days of the week or to a single date with
+  // a DAYS@ or DATE@ prefix. A date on its own covers the whole day.
+  // Entries starting with '!' remove time from the schedule instead.
+  // For example, "Mon-Fri@2:15;Sat,Sun@8:60;!2024-12-25" runs at 2am on
+  // weekdays and 8am at weekends, except on Christmas day.
+  //
+  // Weekly entries are compiled into one bit per minute of the week.
+  // Date entries are kept in a small table of exceptions.
+  //
+  // Returns false if any entry is invalid or there are too many date
+  // entries, so a schedule with a typo is never used in part.
+
+  static uint64_t excludeBits[SCHEDULE_WEEK_WORDS];
+  memset(pSchedule, 0, sizeof(RUN_SCHEDULE));
+  memset(excludeBits, 0, sizeof(excludeBits));
+
+  bool valid = true;
+  char delimOuter[] = ";";
+  char *spOuter = NULL;
+  for(char *schedEntry = strtok_r(paramCopy, delimOuter, &spOuter);
+      schedEntry != NULL;
+      schedEntry = strtok_r(NULL, delimOuter, &spOuter))
+  {
+    while (isspace((unsigned char)*schedEntry))
+      schedEntry++;
+
+    bool exclude = (*schedEntry == '!');
+    if (exclude)
+      schedEntry++;
+
+    char *prefix = NULL;
+    char *window = schedEntry;
+    char *at = strchr(schedEntry, '@');
+    if (at != NULL)
+    {
+      *at = '\0';
+      prefix = schedEntry;
+      window = at + 1;
+    }
+    else if (strchr(schedEntry, ':') == NULL)
+    {
+      prefix = schedEntry;
+      window = NULL;
+    }
+
+    uint16_t startMinute = 0;
+    uint16_t runMinutes = MINUTES_IN_DAY;
+    if (window != NULL && !get_schedule_window(window, &startMinute, &runMinutes))
+    {
+      valid = false;
+      continue;
+    }
+
+    struct tm date;
+    uint8_t dayMask = 0x7f;
+    if (prefix != NULL && get_schedule_date(prefix, &date))
+    {
+      if (!add_exception(pSchedule, &date, startMinute, runMinutes, !exclude))
+        valid = false;
+
+      continue;
+    }
+
+    // The day list is split in place, so a copy is kept for the error.
+    char prefixCopy[64];
+    snprintf(prefixCopy, sizeof(prefixCopy), "%s", (prefix != NULL) ? prefix : "");
+    if (prefix != NULL && !get_day_mask(prefix, &dayMask))
+    {
+      fprintf(stderr, "Error: Invalid schedule days or date (%s).\n", prefixCopy);
+      valid = false;
+      continue;
+    }
+
+    // Windows running past midnight continue into the following day.
+    for (int d = 0; d < 7; d++)
+    {
+      if (!(dayMask & (1 << d)))
+        continue;
+
+      for (int i = 0; i < runMinutes; i++)
+        set_week_bit(exclude ? excludeBits : pSchedule->weekBits, (d * MINUTES_IN_DAY + startMinute + i) % MINUTES_IN_WEEK);
+    }
+  }
+
+  for (int i = 0; i < SCHEDULE_WEEK_WORDS; i++)
+    pSchedule->weekBits[i] &= ~excludeBits[i];
+
+  free(paramCopy);
+  return valid;
+}
+
+
+bool is_schedule_on(const RUN_SCHEDULE *pSchedule, time_t minuteStart)
+{
+  int exceptionState = get_exception_state(pSchedule, minuteStart);
+  if (exceptionState >= 0)
+    return exceptionState;
+
+  return is_week_bit_set(pSchedule->weekBits, get_minute_of_week(minuteStart, NULL));
+}
+
+
+time_t get_next_schedule_transition(const RUN_SCHEDULE *pSchedule, time_t minuteStart)
+{
+  // Returns the start of the first minute with the opposite schedule state,
+  // or -1 if the schedule never changes.
+  // The state can only change where the weekly bits change or where an
+  // exception starts or ends, so only those times are checked.
+  bool state = is_schedule_on(pSchedule, minuteStart);
+  time_t t = minuteStart;
+
+  for (int step = 0; step < SCHEDULE_MAX_SEARCH_STEPS; step++)
+  {
+    time_t next = get_next_week_transition(pSchedule, t);
+
+    for (size_t i = 0; i < pSchedule->exceptionCount; i++)
+    {
+      const SCHEDULE_EXCEPTION *pException = &pSchedule->exceptions[i];
+      if (pException->startTime > t && (next < 0 || pException->startTime < next))
+        next = pException->startTime;
+
+      if (pException->endTime > t && (next < 0 || pException->endTime < next))
+        next = pException->endTime;
+    }
+
+    if (next < 0)
+      return -1;
+
+    if (is_schedule_on(pSchedule, next) != state)
+      return next;
+
+    t = next;
+  }
+
+  // Give up and let the caller check again from here.
+  return t;
+}
+
+
+enum ScheduleState get_schedule_state(const RUN_SCHEDULE *pSchedule, time_t minuteStart)
+{
+  // A minute is pre-roll when it is off but a window starts within the
+  // pre-roll time after it. Removed dates are never used for pre-roll.
+  if (is_schedule_on(pSchedule, minuteStart))
+    return SCHEDULE_ON;
+
+  if (pSchedule->preRollMinutes == 0 || get_exception_state(pSchedule, minuteStart) == 0)
+    return SCHEDULE_OFF;
+
+  time_t next = get_next_schedule_transition(pSchedule, minuteStart);
+  if (next > minuteStart && next - minuteStart <= pSchedule->preRollMinutes * 60 && is_schedule_on(pSchedule, next))
+    return SCHEDULE_PRE_ROLL;
+
+  return SCHEDULE_OFF;
+}
+
+
+time_t get_next_schedule_run(const RUN_SCHEDULE *pSchedule, time_t minuteStart)
+{
+  // Returns the start of the first minute after an off minute that is
+  // pre-roll or on, or -1 if the schedule never turns on.
+  time_t next = get_next_schedule_transition(pSchedule, minuteStart);
+  if (next < 0 || !is_schedule_on(pSchedule, next))
+    return next;
+
+  time_t t = next - pSchedule->preRollMinutes * 60;
+  if (t <= minuteStart)
+    t = minuteStart + 60;
+
+  while (t < next && get_schedule_state(pSchedule, t) == SCHEDULE_OFF)
+    t += 60;
+
+  return t;
+}
+
+
+void print_schedule_chart(const RUN_SCHEDULE *pSchedule)
+{
+  // One character per 10 minutes.
+  // '#' = on, '+' = partly on, '-' = pre-roll, '.' = off
+  printf("     ");
+  for (int hour = 0; hour < 24; hour += 2)
+    printf("%-12d", hour);
+  printf("\n");
+
+  for (int d = 0; d < 7; d++)
+  {
+    printf("%s: ", DayNames[d]);
+
+    for (int block = 0; block < MINUTES_IN_DAY / 10; block++)
+    {
+      int onCount = 0;
+      int preRollCount = 0;
+      for (int i = 0; i < 10; i++)
+      {
+        int minuteOfWeek = d * MINUTES_IN_DAY + block * 10 + i;
+        if (is_week_bit_set(pSchedule->weekBits, minuteOfWeek))
+        {
+          onCount++;
+          continue;
+        }
+
+        for (int j = 1; j <= pSchedule->preRollMinutes; j++)
+        {
+          if (is_week_bit_set(pSchedule->weekBits, (minuteOfWeek + j) % MINUTES_IN_WEEK))
+          {
+            preRollCount++;
+            break;
+          }
+        }
+      }
+
+      printf("%c", (onCount == 10) ? '#' : (onCount > 0) ? '+' : (preRollCount > 0) ? '-' : '.');
+    }
+
+    printf("\n");
+  }
+
+  for (size_t i = 0; i < pSchedule->exceptionCount; i++)
+  {
+    char startString[] = "1970-01-01 00:00";
+    char endString[] = "1970-01-01 00:00";
+    struct tm timeParts;
+
+    localtime_r(&pSchedule->exceptions[i].startTime, &timeParts);
+    strftime(startString, sizeof(startString), "%Y-%m-%d %H:%M", &timeParts);
+    localtime_r(&pSchedule->exceptions[i].endTime, &timeParts);
+    strftime(endString, sizeof(endString), "%Y-%m-%d %H:%M", &timeParts);
+
+    printf("%s - %s: %s", startString, endString, pSchedule->exceptions[i].on ? "On" : "Off");
+
+    if (pSchedule->exceptions[i].on && pSchedule->preRollMinutes > 0)
+    {
+      time_t preRollStart = pSchedule->exceptions[i].startTime - pSchedule->preRollMinutes * 60;
+      localtime_r(&preRollStart, &timeParts);
+      strftime(startString, sizeof(startString), "%Y-%m-%d %H:%M", &timeParts);
+      printf(" (Pre-Roll From %s)", startString);
+    }
+
+    printf("\n");
+  }
+}
@@ -0,0 +1,69 @@
+/*
+schedule.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __SCHEDULE_H__
+#define __SCHEDULE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define MINUTES_IN_DAY  1440
+#define MINUTES_IN_WEEK 10080
+#define SECONDS_IN_DAY  86400
+
+#define SCHEDULE_WEEK_WORDS     ((MINUTES_IN_WEEK + 63) / 64)
+#define SCHEDULE_MAX_EXCEPTIONS 64
+#define SCHEDULE_MAX_PRE_ROLL   120
+
+enum ScheduleState
+{
+  SCHEDULE_OFF = 0,
+  SCHEDULE_PRE_ROLL,  // Running ahead of a window so receivers are locked when it starts
+  SCHEDULE_ON,
+};
+
+typedef struct
+{
+  time_t startTime;  // First second of exception
+  time_t endTime;    // Second after exception
+  bool on;           // Run during exception (true) or stay off (false)
+} SCHEDULE_EXCEPTION;
+
+typedef struct
+{
+  uint64_t weekBits[SCHEDULE_WEEK_WORDS];  // One bit per local minute of the week from Sunday 00:00
+  size_t exceptionCount;
+  SCHEDULE_EXCEPTION exceptions[SCHEDULE_MAX_EXCEPTIONS];  // Date specific windows
+  uint16_t preRollMinutes;  // Minutes to run before the start of each window
+} RUN_SCHEDULE;
+
+void set_schedule_always(RUN_SCHEDULE *pSchedule);
+bool get_periodic_schedule(RUN_SCHEDULE *pSchedule, const char *paramString);
+bool is_schedule_on(const RUN_SCHEDULE *pSchedule, time_t minuteStart);
+time_t get_next_schedule_transition(const RUN_SCHEDULE *pSchedule, time_t minuteStart);
+enum ScheduleState get_schedule_state(const RUN_SCHEDULE *pSchedule, time_t minuteStart);
+time_t get_next_schedule_run(const RUN_SCHEDULE *pSchedule, time_t minuteStart);
+void print_schedule_chart(const RUN_SCHEDULE *pSchedule);
+
+#endif  // __SCHEDULE_H__
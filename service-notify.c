@@ -0,0 +1,85 @@
+/*
+service-notify.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "service-notify.h"
+
+
+// Minimal implementation of the systemd notification protocol, so the
+// program does not depend on libsystemd. When not started by systemd
+// with Type=notify, NOTIFY_SOCKET is unset and nothing is sent.
+// Reference: https://www.freedesktop.org/software/systemd/man/sd_notify.html
+
+
+bool service_notify(const char *state)
+{
+  const char *socketPath = getenv("NOTIFY_SOCKET");
+  if (socketPath == NULL || (socketPath[0] != '/' && socketPath[0] != '@'))
+    return false;
+
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  size_t pathLength = strlen(socketPath);
+  if (pathLength >= sizeof(address.sun_path))
+    return false;
+
+  // A leading '@' is an abstract socket address.
+  memcpy(address.sun_path, socketPath, pathLength);
+  if (address.sun_path[0] == '@')
+    address.sun_path[0] = '\0';
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+
+  ssize_t sent = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&address,
+                        offsetof(struct sockaddr_un, sun_path) + pathLength);
+  close(fd);
+
+  return sent == (ssize_t)strlen(state);
+}
+
+
+uint64_t get_watchdog_interval_us(void)
+{
+  // Returns the watchdog timeout set by systemd, or zero if the watchdog
+  // is not enabled for this process.
+  const char *watchdogUsec = getenv("WATCHDOG_USEC");
+  const char *watchdogPid = getenv("WATCHDOG_PID");
+  uint64_t intervalUs = 0;
+
+  if (watchdogUsec == NULL || sscanf(watchdogUsec, "%" SCNu64, &intervalUs) < 1)
+    return 0;
+
+  if (watchdogPid != NULL && strtol(watchdogPid, NULL, 10) != getpid())
+    return 0;
+
+  return intervalUs;
+}
@@ -0,0 +1,32 @@
+/*
+service-notify.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __SERVICE_NOTIFY_H__
+#define __SERVICE_NOTIFY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool service_notify(const char *state);
+uint64_t get_watchdog_interval_us(void);
+
+#endif  // __SERVICE_NOTIFY_H__
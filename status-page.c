@@ -0,0 +1,125 @@
+/*
+status-page.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "macros.h"
+#include "status-page.h"
+
+
+// The status page is a shared memory object which other programs can map
+// and read at any rate without involving this program. The real-time
+// thread is the only writer and updates it under a seqlock: the sequence
+// count is made odd before the status is written and even afterwards.
+// Readers copy the status and retry if the count was odd or changed:
+//
+//   do {
+//     seq = atomic_load_acquire(&page->sequence);
+//     copy = page->status;
+//     atomic_thread_fence_acquire();
+//   } while ((seq & 1) || seq != atomic_load_relaxed(&page->sequence));
+
+
+static STATUS_PAGE *_pStatusPage = NULL;
+static char _statusPageName[256];
+
+
+bool status_page_open(const char *name)
+{
+  if (snprintf(_statusPageName, sizeof(_statusPageName), "/%s", name[0] == '/' ? name + 1 : name) >= (int)sizeof(_statusPageName))
+  {
+    fprintf(stderr, "Error: Status page name is too long.\n");
+    return false;
+  }
+
+  int fd = shm_open(_statusPageName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    perror("Failed to create status page");
+    return false;
+  }
+
+  if (ftruncate(fd, sizeof(STATUS_PAGE)) < 0)
+  {
+    perror("Failed to size status page");
+    close(fd);
+    return false;
+  }
+
+  void *pMem = mmap(NULL, sizeof(STATUS_PAGE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (pMem == MAP_FAILED)
+  {
+    perror("Failed to map status page");
+    return false;
+  }
+
+  _pStatusPage = pMem;
+  memset(_pStatusPage, 0, sizeof(STATUS_PAGE));
+  _pStatusPage->version = STATUS_PAGE_VERSION;
+  _pStatusPage->statusOffset = offsetof(STATUS_PAGE, status);
+  _pStatusPage->statusSize = sizeof(TRANSMIT_STATUS);
+
+  // Readers check the magic number last, once the header is complete.
+  __atomic_store_n(&_pStatusPage->magic, STATUS_PAGE_MAGIC, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+void status_page_close(bool unlinkPage)
+{
+  // The page is left in place when another process has taken it over.
+  if (_pStatusPage == NULL)
+    return;
+
+  munmap(_pStatusPage, sizeof(STATUS_PAGE));
+  if (unlinkPage)
+    shm_unlink(_statusPageName);
+  _pStatusPage = NULL;
+}
+
+
+TRANSMIT_STATUS *status_page_begin(void)
+{
+  // Returns the status to fill in, or NULL without a status page.
+  // Every call must be followed by status_page_end().
+  if (_pStatusPage == NULL)
+    return NULL;
+
+  __atomic_store_n(&_pStatusPage->sequence, _pStatusPage->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return &_pStatusPage->status;
+}
+
+
+void status_page_end(void)
+{
+  __atomic_store_n(&_pStatusPage->sequence, _pStatusPage->sequence + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,89 @@
+/*
+status-page.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __STATUS_PAGE_H__
+#define __STATUS_PAGE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "clock-control.h"
+
+#define STATUS_PAGE_MAGIC   0x47495354  // "TSIG"
+#define STATUS_PAGE_VERSION 1
+
+#define STATUS_FLAG_PAUSED        0x01
+#define STATUS_FLAG_CARRIER_ONLY  0x02
+#define STATUS_FLAG_POWERED_DOWN  0x04
+#define STATUS_FLAG_DMA_KEYING    0x08
+
+// The layout only uses fixed width types so it can be read by other
+// programs. Fields are only ever added to the end.
+
+typedef struct
+{
+  uint32_t timeService;        // enum TimeService
+  uint32_t reserved;
+  double requestedFrequency;   // Hz
+  double achievedFrequency;    // Hz, as set up by start_clock()
+  uint64_t minuteBits;         // Time bits of the minute being transmitted
+} STATUS_OUTPUT;
+
+typedef struct
+{
+  int64_t updateTimeNs;        // CLOCK_REALTIME of the last update
+  int64_t minuteStart;         // Minute being transmitted (time_t)
+  int32_t minuteOffset;        // Offset of the transmitted time in minutes
+  uint32_t scheduleState;      // enum ScheduleState
+  uint32_t flags;              // STATUS_FLAG_*
+  uint32_t outputCount;
+  STATUS_OUTPUT outputs[CLOCK_OUTPUT_COUNT];
+  uint64_t minutesOn;
+  uint64_t minutesOff;
+  uint64_t edgeGroups;
+  uint64_t lateGroups;
+  int64_t lastLatenessNs;
+  int64_t maxLatenessNs;
+  int64_t advanceOnNs;         // Edge advance of carrier on transitions
+  int64_t advanceOffNs;        // Edge advance of carrier off transitions
+  int64_t meanErrorOnNs;       // Mean lateness of on transitions with the advance applied
+  int64_t meanErrorOffNs;      // Mean lateness of off transitions with the advance applied
+  uint64_t stretchedEdges;     // Deadline misses keyed anyway
+  uint64_t skippedSeconds;     // Deadline misses that skipped the rest of the second
+  uint64_t abandonedMinutes;   // Deadline misses that abandoned the rest of the minute
+} TRANSMIT_STATUS;
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t statusOffset;       // Byte offset of the status from the start of the page
+  uint32_t statusSize;
+  uint32_t sequence;           // Seqlock count, odd while the status is being written
+  TRANSMIT_STATUS status;
+} STATUS_PAGE;
+
+bool status_page_open(const char *name);
+void status_page_close(bool unlinkPage);
+TRANSMIT_STATUS *status_page_begin(void);
+void status_page_end(void);
+
+#endif  // __STATUS_PAGE_H__
@@ -42,6 +42,7 @@ static uint64_t to_padded_bcd(int n);
 static uint64_t even_parity(uint64_t data, uint8_t startBit, uint8_t endBit);
 static uint64_t odd_parity(uint64_t data, uint8_t startBit, uint8_t endBit);
 static uint64_t is_leap_year(int year);
+static void get_dcf77_pn_sequence(uint64_t *chipBits);
 
 
 static uint64_t to_bcd(int n)
@@ -84,6 +85,36 @@ static uint64_t is_leap_year(int year)
 }
 
 
+// DCF77 pseudo-random phase code chips are generated by a 9 bit linear
+// feedback shift register with feedback from stages 5 and 9 (x^9 + x^5 + 1).
+// The 511 chip maximal length sequence is followed by one extra chip
+// from the register to make up the 512 chips sent each second.
+static void get_dcf77_pn_sequence(uint64_t *chipBits)
+{
+  static uint64_t sequence[PHASE_CODE_WORDS];
+  static bool generated = false;
+
+  if (!generated)
+  {
+    uint16_t lfsr = 0x1ff;
+
+    for (int i = 0; i < PHASE_CODE_CHIPS; i++)
+    {
+      uint16_t chip = (lfsr >> 8) & 0x01;
+      uint16_t feedback = ((lfsr >> 8) ^ (lfsr >> 4)) & 0x01;
+
+      sequence[i / 64] |= (uint64_t)chip << (i % 64);
+      lfsr = ((lfsr << 1) | feedback) & 0x1ff;
+    }
+
+    generated = true;
+  }
+
+  for (int i = 0; i < PHASE_CODE_WORDS; i++)
+    chipBits[i] = sequence[i];
+}
+
+
 uint64_t prepare_minute(enum TimeService service, time_t currentTime)
 {
   struct tm timeParts, tomorrowParts;
@@ -245,3 +276,28 @@ int get_modulation_for_second(enum TimeService service, uint64_t timeBits, int s
       return -1;
   }
 }
+
+
+bool get_phase_code_for_second(enum TimeService service, uint64_t timeBits, int sec, uint64_t *chipBits)
+{
+  switch (service)
+  {
+    case DCF77:
+      // Each second carries the same bit as the amplitude modulation. The
+      // chip sequence is sent as-is for a zero and inverted for a one.
+      // Second 59 has no time bit and is sent as a zero.
+      get_dcf77_pn_sequence(chipBits);
+
+      if (sec < 59 && (timeBits & (1LL << sec)))
+      {
+        for (int i = 0; i < PHASE_CODE_WORDS; i++)
+          chipBits[i] = ~chipBits[i];
+      }
+
+      return true;
+
+
+    default:
+      return false;
+  }
+}
@@ -33,8 +33,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define __TIME_SERVICES_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 
+#define PHASE_CODE_CHIPS      512  // DCF77 pseudo-random phase code length
+#define PHASE_CODE_WORDS      (PHASE_CODE_CHIPS / 64)
+#define PHASE_CODE_START_MS   200  // Phase code start within each second
+#define PHASE_CODE_CHIP_CYCLES 120 // Carrier cycles per chip (645.83 Hz at 77.5 kHz)
+
 enum TimeService
 {
   DCF77,
@@ -45,5 +51,6 @@ enum TimeService
 
 uint64_t prepare_minute(enum TimeService service, time_t currentTime);
 int get_modulation_for_second(enum TimeService service, uint64_t timeBits, int sec);
+bool get_phase_code_for_second(enum TimeService service, uint64_t timeBits, int sec, uint64_t *chipBits);
 
 #endif  // __TIME_SERVICES_H__
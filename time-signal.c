@@ -37,6 +37,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <signal.h>
 #include <sched.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <pthread.h>
 #include <math.h>
 #include <string.h>
@@ -45,19 +46,161 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "macros.h"
 #include "clock-control.h"
 #include "time-services.h"
+#include "dma-keying.h"
+#include "carrier-dither.h"
+#include "phase-modulation.h"
+#include "edge-scheduler.h"
+#include "schedule.h"
+#include "runtime-config.h"
+#include "control-socket.h"
+#include "status-page.h"
+#include "metrics.h"
+#include "service-notify.h"
+#include "edge-calibration.h"
+#include "edge-compensation.h"
+#include "power-latency.h"
+#include "rt-prepare.h"
+#include "timestamp.h"
+#include "edge-monitor.h"
+#include "pps-align.h"
+#include "reference-clock.h"
 
 
-#define MINUTES_IN_DAY 1440
-#define SECONDS_IN_DAY 86400
+#define PHASE_CODE_DEVIATION 15.6  // Degrees
+
+#define CLOCK_STABLE_TIMEOUT_US 100000
+
+#define RELOAD_POLL_MS 200
+
+#define EDGE_LATE_NS 100000  // Edge groups keyed later than this are counted as late
+
+#define WATCHDOG_LATE_NS 20000000  // Watchdog is not fed while edges are keyed later than this
+#define WATCHDOG_SLEEP_GRACE_SEC 5
+
+#define DEADLINE_MISS_DEFAULT_MS 10
+#define CPU_LATENCY_MAX_US 10000
+#define POWER_LATENCY_SAMPLES 200
+
+// SCHED_DEADLINE reservation of the real-time thread. Edges of every time
+// service fall on a 100 ms grid, so each period holds at most one edge
+// group and the per-second command and status work.
+#define SCHED_DEADLINE_PERIOD_NS   100000000
+#define SCHED_DEADLINE_DEADLINE_NS 10000000
+#define SCHED_DEADLINE_RUNTIME_NS  5000000
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+#define HANDOFF_MARGIN_SEC 10  // Least time given to a new process to start before its first minute
+
+
+typedef struct
+{
+  enum TimeService timeService;
+  uint32_t carrierFrequency;
+} SIGNAL_OUTPUT;
+
+typedef struct
+{
+  SIGNAL_OUTPUT outputs[CLOCK_OUTPUT_COUNT];  // Time service of each clock output
+  size_t outputCount;
+  bool disableChecks;
+  bool dmaKeying;
+  double reducedCarrier;
+  uint32_t ditherRate;
+  bool phaseCode;
+  uint32_t powerDownMinutes;
+  uint32_t warmUpSeconds;
+  time_t handoffMinute;  // First minute after taking over from another process, or zero
+  uint32_t calibrationSamples;
+  const char *pCalibrationFile;
+  bool adaptiveTiming;
+  enum DeadlinePolicy deadlinePolicy;
+  int64_t deadlineNs;  // Wake-up lateness treated as a missed deadline
+  bool schedDeadline;
+  int32_t cpuLatencyUs;  // PM QoS CPU latency held during windows, or negative
+  bool cpufreqPin;
+  enum TimestampSource timestampSource;
+  bool ppsAlign;
+  const char *pClockSource;  // Reference clock replacing CLOCK_REALTIME, or NULL
+} THREAD_DATA;
+
+enum MinuteKeying
+{
+  MINUTE_OFF,
+  MINUTE_PAUSED,
+  MINUTE_CARRIER,
+  MINUTE_TIME_SIGNAL
+};
+
+typedef struct
+{
+  time_t minuteStart;
+  int32_t minuteOffset;
+  enum ScheduleState scheduleState;
+  uint64_t minuteBits[CLOCK_OUTPUT_COUNT];
+  bool paused;       // Outputs held off by a control command
+  bool carrierOnly;  // Unmodulated carrier forced by a control command
+  bool poweredDown;
+  time_t handoffMinute;  // Minute a new process takes over from, or zero
+  bool handoffCommitted; // The new process is ready to key the handoff minute
+  double achievedFrequency[CLOCK_OUTPUT_COUNT];
+  TRANSMIT_STATS stats;
+} TRANSMIT_STATE;
+
+// Kernel struct sched_attr (SCHED_ATTR_SIZE_VER0), which glibc does not
+// declare for the sched_setattr() system call.
+typedef struct
+{
+  uint32_t size;
+  uint32_t schedPolicy;
+  uint64_t schedFlags;
+  int32_t schedNice;
+  uint32_t schedPriority;
+  uint64_t schedRuntime;
+  uint64_t schedDeadline;
+  uint64_t schedPeriod;
+} SCHED_ATTR;
+
+typedef struct
+{
+  uint64_t heartbeat;    // Advanced by the thread about once a second while keying
+  int64_t latenessNs;    // Worst edge lateness in the second before the last heartbeat
+  time_t sleepingUntil;  // End of an off window sleep, or zero when not sleeping
+  bool ready;            // Clock started and the first edge keyed on time
+} THREAD_HEALTH;
 
 
 static void print_usage(const char *programName);
 static void sig_handler(int sigNum);
-static bool get_periodic_schedule(bool *buffSched, size_t buffLen, const char *paramString);
-static void print_schedule_chart(const bool *buffSched, size_t buffLen);
-static bool rt_thread_attr_init(pthread_attr_t *attr);
+static void reload_config(const RUNTIME_CONFIG *pBaseConfig, const char *path);
+static bool get_time_services(THREAD_DATA *pThreadData, const char *paramString);
+static bool rt_thread_attr_init(pthread_attr_t *attr, bool schedDeadline);
+static bool set_sched_deadline(void);
 static void *thread_carrier_only(void *arg);
 static void *thread_time_signal(void *arg);
+static bool start_output_clocks(const THREAD_DATA *pThreadData, double *pFrequencies, double *pStableUs);
+static bool adopt_output_clocks(const THREAD_DATA *pThreadData, double *pFrequencies);
+static void stop_output_clocks(const THREAD_DATA *pThreadData);
+static bool handle_control_commands(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState);
+static bool apply_control_command(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState,
+                                  const CONTROL_COMMAND *pCommand, CONTROL_REPLY *pReply);
+static void publish_status(const THREAD_DATA *pThreadData, const TRANSMIT_STATE *pState);
+static bool sleep_off_window(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState,
+                             const RUNTIME_CONFIG *pConfig, time_t wakeTime);
+static bool add_minute_edges(EDGE_SCHEDULER *pSched, const THREAD_DATA *pThreadData, time_t minuteStart,
+                             const uint64_t *minuteBits, enum MinuteKeying keying);
+static bool load_dma_minute(EDGE_SCHEDULER *pSched, time_t minuteStart);
+static void print_minute_header(FILE *pStream, time_t minuteStart, int32_t minuteOffset, enum ScheduleState scheduleState);
+static void print_edge_timing(FILE *pStream, const EDGE_CONTROLLER *pControllers, uint64_t frozenEdges);
+static void prepare_rt_path(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState, uint32_t outputMask,
+                            const EDGE_CONTROLLER *pControllers, time_t minuteStart);
+static void thread_heartbeat(int64_t latenessNs);
+static void thread_ready(void);
+static bool is_thread_healthy(uint64_t *pLastHeartbeat);
+static bool wait_for_handoff_commit(void);
+static void cancel_handoff(TRANSMIT_STATE *pState);
 
 
 static const char * const TimeServiceNames[] =
@@ -68,18 +211,14 @@ static const char * const TimeServiceNames[] =
   [WWVB]  = "WWVB"
 };
 
-typedef struct
-{
-  enum TimeService timeService;
-  uint32_t carrierFrequency;
-  bool runSchedule[MINUTES_IN_DAY];
-  double hourOffset;
-  bool disableChecks;
-} THREAD_DATA;
-
 
 static volatile uint8_t _verbosityLevel = 0;
 static volatile sig_atomic_t _threadRun = 0;
+static THREAD_HEALTH _threadHealth = { 0 };
+static bool _handedOff = false;  // Written by the thread before it exits
+static bool _handoffPending = false;   // Cleared by the main thread once the handoff is committed
+static bool _handoffPrepared = false;  // Set by the thread once it can key the handoff minute
+static bool _handoffAgreed = false;    // Set by the thread while a new process is to take over
 
 
 int main(int argc, char *argv[])
@@ -96,8 +235,32 @@ int main(int argc, char *argv[])
     {"carrier-only",       no_argument,       NULL, 'c'},
     {"frequency-override", required_argument, NULL, 'f'},
     {"schedule",           required_argument, NULL, 'p'},
+    {"pre-roll",           required_argument, NULL, 'e'},
+    {"config",             required_argument, NULL, 'g'},
+    {"control-socket",     required_argument, NULL, 't'},
+    {"handoff",            no_argument,       NULL, 'b'},
+    {"status-page",        required_argument, NULL, 'i'},
+    {"metrics-file",       required_argument, NULL, 'x'},
     {"time-offset",        required_argument, NULL, 'o'},
     {"disable-checks",     no_argument,       NULL, 'd'},
+    {"dma-keying",         no_argument,       NULL, 'k'},
+    {"mock-registers",     optional_argument, NULL, 'm'},
+    {"reduced-carrier",    required_argument, NULL, 'a'},
+    {"dither-rate",        required_argument, NULL, 'r'},
+    {"phase-code",         no_argument,       NULL, 'n'},
+    {"power-down",         required_argument, NULL, 'w'},
+    {"warm-up",            required_argument, NULL, 'u'},
+    {"calibrate",          required_argument, NULL, 'l'},
+    {"calibration-file",   required_argument, NULL, 'j'},
+    {"adaptive-timing",    no_argument,       NULL, 'q'},
+    {"deadline-miss",      required_argument, NULL, 'y'},
+    {"sched-deadline",     no_argument,       NULL, 'D'},
+    {"cpu-latency",        required_argument, NULL, 'L'},
+    {"cpufreq-pin",        no_argument,       NULL, 'F'},
+    {"timestamp",          required_argument, NULL, 'T'},
+    {"monitor",            required_argument, NULL, 'M'},
+    {"pps",                required_argument, NULL, 'P'},
+    {"clock-source",       required_argument, NULL, 'C'},
     {"verbose",            no_argument,       NULL, 'v'},
     {"help",               no_argument,       NULL, 'h'},
     {0, 0, 0, 0}
@@ -109,8 +272,35 @@ int main(int argc, char *argv[])
   uint32_t optFreqOverride = 0;
   double optHourOffset = 0.0;
   char *optSchedule = NULL;
+  uint16_t optPreRoll = 0;
+  char *optConfigFile = NULL;
+  char *optControlSocket = NULL;
+  bool optHandoff = false;
+  char *optStatusPage = NULL;
+  char *optMetricsFile = NULL;
   bool optDisableChecks = false;
-  while ((c = getopt_long(argc, argv, "s:cf:p:o:dvh", long_options, NULL)) != -1)
+  bool optDmaKeying = false;
+  bool optMockRegisters = false;
+  int optMockModel = PI_MODEL_3;
+  double optReducedCarrier = 0.0;
+  uint32_t optDitherRate = 5000;
+  bool optPhaseCode = false;
+  uint32_t optPowerDown = 0;
+  uint32_t optWarmUp = 5;
+  uint32_t optCalibrate = 0;
+  char *optCalibrationFile = NULL;
+  bool optAdaptiveTiming = false;
+  enum DeadlinePolicy optDeadlinePolicy = DEADLINE_STRETCH;
+  uint32_t optDeadlineMs = DEADLINE_MISS_DEFAULT_MS;
+  bool optSchedDeadline = false;
+  int32_t optCpuLatency = -1;
+  bool optCpufreqPin = false;
+  enum TimestampSource optTimestampSource = TIMESTAMP_REALTIME;
+  char *optMonitorChip = NULL;
+  uint32_t optMonitorLine = 0;
+  char *optPpsSource = NULL;
+  char *optClockSource = NULL;
+  while ((c = getopt_long(argc, argv, "s:cf:p:e:g:t:bi:x:o:dkm::a:r:nw:u:l:j:qy:DL:FT:M:P:C:vh", long_options, NULL)) != -1)
   {
     switch (c)
     {
@@ -135,6 +325,35 @@ int main(int argc, char *argv[])
         optSchedule = optarg;
         break;
 
+      case 'e':
+        if (sscanf(optarg, "%" SCNu16, &optPreRoll) < 1 || optPreRoll > SCHEDULE_MAX_PRE_ROLL)
+        {
+          fprintf(stderr, "Error: Pre-roll must be between 0 and %d minutes.\n", SCHEDULE_MAX_PRE_ROLL);
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'g':
+        optConfigFile = optarg;
+        break;
+
+      case 't':
+        optControlSocket = optarg;
+        break;
+
+      case 'b':
+        optHandoff = true;
+        break;
+
+      case 'i':
+        optStatusPage = optarg;
+        break;
+
+      case 'x':
+        optMetricsFile = optarg;
+        break;
+
       case 'o':
         if (sscanf(optarg, "%lf", &optHourOffset) < 1)
         {
@@ -148,6 +367,174 @@ int main(int argc, char *argv[])
         optDisableChecks = true;
         break;
 
+      case 'k':
+        optDmaKeying = true;
+        break;
+
+      case 'm':
+        optMockRegisters = true;
+        if (optarg != NULL && (sscanf(optarg, "%d", &optMockModel) < 1 || optMockModel < PI_MODEL_1 || optMockModel > PI_MODEL_5))
+        {
+          fprintf(stderr, "Error: Mock Raspberry Pi model must be between 1 and 5.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'a':
+      {
+        // Level is either a percentage of full carrier or an attenuation in dB.
+        char *endPtr = NULL;
+        double level = strtod(optarg, &endPtr);
+        if (endPtr != optarg && !strcasecmp(endPtr, "dB"))
+          level = pow(10.0, -fabs(level) / 20.0) * 100.0;
+        else if (endPtr == optarg || (*endPtr != '\0' && strcmp(endPtr, "%")))
+          level = -1;
+
+        if (!(level > 0 && level < 100))
+        {
+          fprintf(stderr, "Error: Reduced carrier level must be between 0 and 100 percent.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+
+        optReducedCarrier = level / 100.0;
+        break;
+      }
+
+      case 'r':
+        if (sscanf(optarg, "%" SCNu32, &optDitherRate) < 1 || optDitherRate < 100 || optDitherRate > 100000)
+        {
+          fprintf(stderr, "Error: Dither rate must be between 100 and 100000 Hz.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'n':
+        optPhaseCode = true;
+        break;
+
+      case 'w':
+        if (sscanf(optarg, "%" SCNu32, &optPowerDown) < 1 || optPowerDown < 1)
+        {
+          fprintf(stderr, "Error: Power down threshold must be at least 1 minute.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'u':
+        if (sscanf(optarg, "%" SCNu32, &optWarmUp) < 1 || optWarmUp < 1 || optWarmUp > 600)
+        {
+          fprintf(stderr, "Error: Warm-up time must be between 1 and 600 seconds.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'l':
+        if (sscanf(optarg, "%" SCNu32, &optCalibrate) < 1 || optCalibrate < 10 || optCalibrate > CALIBRATION_MAX_SAMPLES)
+        {
+          fprintf(stderr, "Error: Calibration samples must be between 10 and %d.\n", CALIBRATION_MAX_SAMPLES);
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'j':
+        optCalibrationFile = optarg;
+        break;
+
+      case 'q':
+        optAdaptiveTiming = true;
+        break;
+
+      case 'y':
+      {
+        // POLICY[:MS]
+        char *pSeparator = strchr(optarg, ':');
+        size_t length = pSeparator != NULL ? (size_t)(pSeparator - optarg) : strlen(optarg);
+        bool valid = true;
+
+        if (length == strlen("stretch") && !strncasecmp(optarg, "stretch", length))
+          optDeadlinePolicy = DEADLINE_STRETCH;
+        else if (length == strlen("skip") && !strncasecmp(optarg, "skip", length))
+          optDeadlinePolicy = DEADLINE_SKIP_SECOND;
+        else if (length == strlen("abandon") && !strncasecmp(optarg, "abandon", length))
+          optDeadlinePolicy = DEADLINE_ABANDON_MINUTE;
+        else
+          valid = false;
+
+        if (pSeparator != NULL && (sscanf(pSeparator + 1, "%" SCNu32, &optDeadlineMs) < 1 || optDeadlineMs < 1 || optDeadlineMs > 100))
+          valid = false;
+
+        if (!valid)
+        {
+          fprintf(stderr, "Error: Deadline miss policy must be stretch, skip or abandon, with a threshold of 1 to 100 ms.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+
+      case 'D':
+        optSchedDeadline = true;
+        break;
+
+      case 'L':
+        if (sscanf(optarg, "%" SCNd32, &optCpuLatency) < 1 || optCpuLatency < 0 || optCpuLatency > CPU_LATENCY_MAX_US)
+        {
+          fprintf(stderr, "Error: CPU latency must be between 0 and %d us.\n", CPU_LATENCY_MAX_US);
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'F':
+        optCpufreqPin = true;
+        break;
+
+      case 'T':
+        optTimestampSource = TIMESTAMP_SOURCE_COUNT;
+        for (int i = 0; i < TIMESTAMP_SOURCE_COUNT; i++)
+        {
+          if (!strcasecmp(optarg, TimestampSourceNames[i]))
+            optTimestampSource = i;
+        }
+
+        if (optTimestampSource == TIMESTAMP_SOURCE_COUNT)
+        {
+          fprintf(stderr, "Error: Timestamp source must be realtime, systimer or cntvct.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'M':
+      {
+        // CHIP:LINE
+        char *pSeparator = strrchr(optarg, ':');
+        if (pSeparator == NULL || pSeparator == optarg || sscanf(pSeparator + 1, "%" SCNu32, &optMonitorLine) < 1)
+        {
+          fprintf(stderr, "Error: Monitor input must be given as CHIP:LINE, e.g. /dev/gpiochip0:17.\n");
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+
+        *pSeparator = '\0';
+        optMonitorChip = optarg;
+        break;
+      }
+
+      case 'P':
+        optPpsSource = optarg;
+        break;
+
+      case 'C':
+        optClockSource = optarg;
+        break;
+
       case 'v':
         _verbosityLevel++;
         break;
@@ -162,12 +549,7 @@ int main(int argc, char *argv[])
 
 
   THREAD_DATA threadData = { 0 };
-  if      (!strcasecmp(optTimeService, "DCF77")) { threadData.timeService = DCF77; threadData.carrierFrequency = 77500; }
-  else if (!strcasecmp(optTimeService, "JJY40")) { threadData.timeService = JJY;   threadData.carrierFrequency = 40000; }
-  else if (!strcasecmp(optTimeService, "JJY60")) { threadData.timeService = JJY;   threadData.carrierFrequency = 60000; }
-  else if (!strcasecmp(optTimeService, "MSF"))   { threadData.timeService = MSF;   threadData.carrierFrequency = 60000; }
-  else if (!strcasecmp(optTimeService, "WWVB"))  { threadData.timeService = WWVB;  threadData.carrierFrequency = 60000; }
-  else
+  if (!get_time_services(&threadData, optTimeService))
   {
     fprintf(stderr, "Invalid time service selected.\n\n");
     print_usage(argv[0]);
@@ -175,14 +557,153 @@ int main(int argc, char *argv[])
   }
 
   if (optFreqOverride > 0)
-    threadData.carrierFrequency = optFreqOverride;
+  {
+    if (threadData.outputCount > 1)
+    {
+      fprintf(stderr, "Error: Frequency override cannot be used with multiple time services.\n");
+      return EXIT_FAILURE;
+    }
 
-  memset(threadData.runSchedule, 1, ARRAY_LENGTH(threadData.runSchedule));
-  if (optSchedule != NULL)
-    get_periodic_schedule(threadData.runSchedule, ARRAY_LENGTH(threadData.runSchedule), optSchedule);
+    threadData.outputs[0].carrierFrequency = optFreqOverride;
+  }
+
+  // Settings that can be reloaded are shared with the thread through a
+  // published configuration rather than copied onto its small stack.
+  // The command line settings are kept as the base for each reload.
+  static RUNTIME_CONFIG baseConfig;
+  set_schedule_always(&baseConfig.schedule);
+  if (optSchedule != NULL && !get_periodic_schedule(&baseConfig.schedule, optSchedule))
+    return EXIT_FAILURE;
+
+  baseConfig.schedule.preRollMinutes = optPreRoll;
+  baseConfig.hourOffset = optHourOffset;
+  baseConfig.verbosityLevel = _verbosityLevel;
+
+  RUNTIME_CONFIG *pConfig = malloc(sizeof(RUNTIME_CONFIG));
+  if (pConfig == NULL)
+    return EXIT_FAILURE;
+
+  *pConfig = baseConfig;
+  if (optConfigFile != NULL && !load_runtime_config(pConfig, optConfigFile))
+    return EXIT_FAILURE;
+
+  _verbosityLevel = pConfig->verbosityLevel;
+  if (!runtime_config_init(pConfig))
+    return EXIT_FAILURE;
 
-  threadData.hourOffset = optHourOffset;
   threadData.disableChecks = optDisableChecks;
+  threadData.dmaKeying = optDmaKeying;
+  threadData.reducedCarrier = optReducedCarrier;
+  threadData.ditherRate = optDitherRate;
+
+  threadData.phaseCode = optPhaseCode;
+  threadData.powerDownMinutes = optPowerDown;
+  threadData.warmUpSeconds = optWarmUp;
+  threadData.calibrationSamples = optCalibrate;
+  threadData.pCalibrationFile = optCalibrationFile;
+  threadData.adaptiveTiming = optAdaptiveTiming;
+  threadData.deadlinePolicy = optDeadlinePolicy;
+  threadData.deadlineNs = optDeadlineMs * 1000000LL;
+  threadData.schedDeadline = optSchedDeadline;
+  threadData.cpuLatencyUs = optCpuLatency;
+  threadData.cpufreqPin = optCpufreqPin;
+  threadData.timestampSource = optTimestampSource;
+  threadData.ppsAlign = (optPpsSource != NULL);
+  threadData.pClockSource = optClockSource;
+
+  if (optDmaKeying && optReducedCarrier > 0)
+  {
+    fprintf(stderr, "Error: Reduced carrier cannot be used with DMA keying.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (optPhaseCode && (optDmaKeying || threadData.outputs[0].timeService != DCF77))
+  {
+    fprintf(stderr, "Error: Phase code requires DCF77 without DMA keying.\n");
+    return EXIT_FAILURE;
+  }
+
+  // Reduced carrier and phase code hold the real-time thread for most of
+  // each second, so they cannot be shared between multiple outputs.
+  if ((optReducedCarrier > 0 || optPhaseCode) && threadData.outputCount > 1)
+  {
+    fprintf(stderr, "Error: Reduced carrier and phase code require a single time service.\n");
+    return EXIT_FAILURE;
+  }
+
+  // DMA keying loads every minute, including off minutes, so the clock never idles.
+  if (optPowerDown > 0 && optDmaKeying)
+  {
+    fprintf(stderr, "Error: Power down cannot be used with DMA keying.\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((optCalibrate > 0 || optCalibrationFile != NULL || optAdaptiveTiming) && (optDmaKeying || optCarrierOnly))
+  {
+    fprintf(stderr, "Error: Edge calibration and adaptive timing cannot be used with DMA keying or in carrier only mode.\n");
+    return EXIT_FAILURE;
+  }
+
+  // Dithering, phase code and the carrier only loop keep the thread busy
+  // for far longer than its reservation.
+  if (optSchedDeadline && (optReducedCarrier > 0 || optPhaseCode || optCarrierOnly))
+  {
+    fprintf(stderr, "Error: SCHED_DEADLINE cannot be used with reduced carrier, phase code or carrier only mode.\n");
+    return EXIT_FAILURE;
+  }
+
+  // Edges are only known to the CPU keying loop, and dithering would
+  // look like carrier on the monitor input.
+  if (optMonitorChip != NULL && (optDmaKeying || optCarrierOnly || optReducedCarrier > 0))
+  {
+    fprintf(stderr, "Error: Monitor input cannot be used with DMA keying, reduced carrier or carrier only mode.\n");
+    return EXIT_FAILURE;
+  }
+
+  // DMA keying times its edges from the PWM clock, not from PPS.
+  if (optPpsSource != NULL && (optDmaKeying || optCarrierOnly))
+  {
+    fprintf(stderr, "Error: PPS alignment cannot be used with DMA keying or in carrier only mode.\n");
+    return EXIT_FAILURE;
+  }
+
+  // DMA keying and the phase code modulator time themselves from
+  // CLOCK_REALTIME, and PPS measures the error of that clock.
+  if (optClockSource != NULL && (optDmaKeying || optPhaseCode || optCarrierOnly || optPpsSource != NULL))
+  {
+    fprintf(stderr, "Error: Clock source cannot be used with DMA keying, phase code, PPS alignment or carrier only mode.\n");
+    return EXIT_FAILURE;
+  }
+
+  // The carrier only loop has no schedule to hold the settings for.
+  if ((optCpuLatency >= 0 || optCpufreqPin) && optCarrierOnly)
+  {
+    fprintf(stderr, "Error: CPU latency and frequency pinning cannot be used in carrier only mode.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (optPowerDown > 0 && optPowerDown * 60 <= optWarmUp)
+  {
+    fprintf(stderr, "Error: Power down threshold must be longer than the warm-up time.\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((optControlSocket != NULL || optStatusPage != NULL) && optCarrierOnly)
+  {
+    fprintf(stderr, "Error: Control socket and status page cannot be used in carrier only mode.\n");
+    return EXIT_FAILURE;
+  }
+
+  // The handoff keeps the CPU keying of both processes apart at a minute
+  // boundary. A DMA chain cannot be passed between processes.
+  if (optHandoff && (optControlSocket == NULL || optDmaKeying))
+  {
+    fprintf(stderr, "Error: Handoff requires a control socket and cannot be used with DMA keying.\n");
+    return EXIT_FAILURE;
+  }
+
+  use_mock_registers(optMockRegisters, optMockModel);
+  power_latency_init(optCpuLatency, optCpufreqPin);
 
 
   printf("time-signal - DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi\n");
@@ -202,12 +723,63 @@ int main(int argc, char *argv[])
      return EXIT_FAILURE;
   }
 
-  if (!rt_thread_attr_init(&threadAttr))
+  if (!rt_thread_attr_init(&threadAttr, optSchedDeadline))
   {
     fprintf(stderr, "Failed to initialize real-time thread attributes.\n");
     return EXIT_FAILURE;
   }
 
+  // SIGHUP is blocked in both threads and waited for by the main thread,
+  // so a reload never interrupts the real-time thread's timers.
+  sigset_t reloadSignalSet;
+  sigemptyset(&reloadSignalSet);
+  sigaddset(&reloadSignalSet, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &reloadSignalSet, NULL))
+  {
+    fprintf(stderr, "Failed to update thread signal mask.\n");
+    return EXIT_FAILURE;
+  }
+
+  // A running process is asked to hand over before its control socket
+  // is replaced by ours.
+  if (optHandoff)
+  {
+    time_t handoffMinute = control_socket_request_handoff(optControlSocket);
+    if (handoffMinute < 0)
+      return EXIT_FAILURE;
+
+    if (handoffMinute == 0)
+    {
+      printf("No running transmitter to take over from.\n\n");
+    }
+    else
+    {
+      struct tm timeParts;
+      char dateString[] = "1970-01-01 00:00:00";
+      localtime_r(&handoffMinute, &timeParts);
+      strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
+      printf("Taking over transmission at %s\n\n", dateString);
+    }
+
+    threadData.handoffMinute = handoffMinute;
+    _handoffPending = (handoffMinute > 0);
+  }
+
+  if (optControlSocket != NULL && !control_socket_open(optControlSocket, threadData.handoffMinute > 0))
+    return EXIT_FAILURE;
+
+  if (optStatusPage != NULL && !status_page_open(optStatusPage))
+    return EXIT_FAILURE;
+
+  if (optMonitorChip != NULL && !edge_monitor_start(optMonitorChip, optMonitorLine))
+    return EXIT_FAILURE;
+
+  if (optPpsSource != NULL && !pps_align_start(optPpsSource))
+    return EXIT_FAILURE;
+
+  if (optClockSource != NULL && !reference_clock_open(optClockSource))
+    return EXIT_FAILURE;
+
   _threadRun = 1;
   int pthreadResult =
     pthread_create(&threadId,
@@ -238,6 +810,68 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Failed to update thread signal mask.\n");
     return EXIT_FAILURE;
   }
+  // When started by systemd, readiness is reported once the thread has
+  // keyed its first edge on time. The watchdog is only fed while the
+  // thread keeps making progress.
+  uint64_t watchdogUs = get_watchdog_interval_us();
+  uint64_t lastHeartbeat = 0;
+  struct timespec watchdogTime;
+  clock_gettime(CLOCK_MONOTONIC, &watchdogTime);
+  bool readySent = false;
+
+  // The main thread is otherwise idle, so it serves the control socket,
+  // reloads the configuration file on SIGHUP and frees configurations the
+  // thread has moved on from.
+  struct timespec reloadPoll = { 0 };
+  time_t metricsTime = time(NULL);
+  while (_threadRun)
+  {
+    control_socket_serve(RELOAD_POLL_MS);
+
+    // The running process is told to let go once the thread has adopted
+    // the clocks and is ready to key. If it no longer agrees, the thread
+    // stops and leaves the clocks to it.
+    if (__atomic_load_n(&_handoffPending, __ATOMIC_ACQUIRE) && __atomic_load_n(&_handoffPrepared, __ATOMIC_ACQUIRE))
+    {
+      if (control_socket_commit_handoff())
+        __atomic_store_n(&_handoffPending, false, __ATOMIC_RELEASE);
+      else
+        _threadRun = 0;
+    }
+
+    if (!readySent && __atomic_load_n(&_threadHealth.ready, __ATOMIC_ACQUIRE))
+      readySent = service_notify("READY=1\nSTATUS=Transmitting");
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (watchdogUs > 0 && (TIMESPEC_TO_NS(now) - TIMESPEC_TO_NS(watchdogTime)) / 1000 >= watchdogUs / 2)
+    {
+      watchdogTime = now;
+      if (is_thread_healthy(&lastHeartbeat))
+        service_notify("WATCHDOG=1");
+    }
+
+    // The metrics file is left to the new process once a handoff is
+    // agreed, and to the running process until ours is committed.
+    if (optMetricsFile != NULL && time(NULL) - metricsTime >= METRICS_INTERVAL_SEC &&
+        !__atomic_load_n(&_handoffAgreed, __ATOMIC_ACQUIRE) && !__atomic_load_n(&_handoffPending, __ATOMIC_ACQUIRE))
+    {
+      write_metrics_file(optMetricsFile);
+      metricsTime = time(NULL);
+    }
+
+    if (sigtimedwait(&reloadSignalSet, NULL, &reloadPoll) == SIGHUP)
+    {
+      if (optConfigFile != NULL && !optCarrierOnly)
+        reload_config(&baseConfig, optConfigFile);
+      else
+        fprintf(stderr, "Received SIGHUP signal without a configuration file to reload.\n");
+    }
+
+    runtime_config_reclaim();
+  }
+
+  service_notify("STOPPING=1");
 
   if (pthread_join(threadId, NULL))
   {
@@ -245,6 +879,20 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
+  edge_monitor_stop();
+  pps_align_stop();
+  reference_clock_close();
+
+  // After a handoff the new process owns the metrics file and status page.
+  // They stay with the running process if our handoff was never committed.
+  bool ownsOutputs = (!_handedOff && !__atomic_load_n(&_handoffPending, __ATOMIC_ACQUIRE));
+  if (optMetricsFile != NULL && ownsOutputs)
+    write_metrics_file(optMetricsFile);
+
+  control_socket_close();
+  status_page_close(ownsOutputs);
+  runtime_config_cleanup();
+
   if (munlockall() == -1)
   {
      perror("Failed to unlock memory");
@@ -260,16 +908,66 @@ static void print_usage(const char *programName)
 {
   printf("Usage: %s [OPTION]...\n\n"
          "Mandatory arguments to long options are mandatory for short options too.\n"
-         "  -s, --time-service={DCF77|JJY40|JJY60|MSF|WWVB}\n"
+         "  -s, --time-service={DCF77|JJY40|JJY60|MSF|WWVB}[,...]\n"
          "                                 Time service to transmit.\n"
+         "                                 Up to 3 comma separated services are output\n"
+         "                                 on GPIO4, GPIO5 and GPIO6 in order.\n"
          "  -c, --carrier-only             Output carrier wave only.\n"
          "  -f, --frequency-override=NUM   Set carrier frequency to NUM Hz.\n"
          "  -p, --schedule=SCHEDULE        Use SCHEDULE as a run time schedule.\n"
-         "                                 SCHEDULE is START:LEN[;START:LEN]...\n"
+         "                                 SCHEDULE is [!][DAYS@|DATE@]START:LEN[;...]\n"
          "                                 e.g. -p \"2:15;13.5:30\"\n"
          "                                      for 2am for 15min and 1:30pm for 30min\n"
+         "                                 e.g. -p \"Mon-Fri@2:15;Sat,Sun@8:60;!2024-12-25\"\n"
+         "                                      for weekdays and weekends except Dec 25\n"
+         "  -e, --pre-roll=NUM             Start NUM minutes before each scheduled window.\n"
+         "  -g, --config=FILE              Read schedule, pre-roll, time offset and verbosity\n"
+         "                                 from FILE. The file is reloaded on SIGHUP.\n"
+         "  -t, --control-socket=PATH      Accept runtime commands on a Unix socket at PATH.\n"
+         "  -b, --handoff                  Take over the clock from a process serving the\n"
+         "                                 control socket without a break in the carrier.\n"
+         "  -i, --status-page=NAME         Publish status in shared memory at /dev/shm/NAME.\n"
+         "  -x, --metrics-file=PATH        Write Prometheus metrics to PATH every 15 seconds.\n"
          "  -o, --time-offset=NUM          Offset transmitted time by NUM hours.\n"
          "  -d, --disable-checks           Disable sanity checks.\n"
+         "  -k, --dma-keying               Key the carrier with DMA instead of the CPU.\n"
+         "                                 Rewrites GPFSEL0, undoing GPIO 0-9 function\n"
+         "                                 changes made after a minute is loaded.\n"
+         "  -m, --mock-registers[=MODEL]   Use simulated registers instead of hardware.\n"
+         "                                 MODEL is the Pi model to simulate. (Default 3)\n"
+         "  -a, --reduced-carrier=LEVEL    Reduce carrier to LEVEL instead of off in low periods.\n"
+         "                                 LEVEL is a percentage or attenuation in dB.\n"
+         "                                 e.g. -a 15 or -a -17dB\n"
+         "  -r, --dither-rate=NUM          Reduced carrier dither rate in Hz. (Default 5000)\n"
+         "  -n, --phase-code               Transmit DCF77 pseudo-random phase code.\n"
+         "  -w, --power-down=NUM           Stop the clock in off windows of NUM minutes or more.\n"
+         "  -u, --warm-up=NUM              Restart a stopped clock NUM seconds before the\n"
+         "                                 next window. (Default 5)\n"
+         "  -l, --calibrate=NUM            Measure keying latency over NUM wake-ups at startup\n"
+         "                                 and key edges early by the median.\n"
+         "  -j, --calibration-file=FILE    Save calibration to FILE, or use the result saved\n"
+         "                                 for this host when not calibrating.\n"
+         "  -q, --adaptive-timing          Adjust the edge advance from measured lateness.\n"
+         "  -y, --deadline-miss=POLICY[:MS]\n"
+         "                                 Action when waking more than MS late for an edge.\n"
+         "                                 POLICY is stretch, skip or abandon.\n"
+         "                                 (Default stretch:10)\n"
+         "  -D, --sched-deadline           Schedule the transmitter with SCHED_DEADLINE\n"
+         "                                 instead of SCHED_FIFO.\n"
+         "  -L, --cpu-latency=US           Hold the CPU wake-up latency at US microseconds\n"
+         "                                 during scheduled windows.\n"
+         "  -F, --cpufreq-pin              Pin the transmitter core at its maximum frequency\n"
+         "                                 during scheduled windows.\n"
+         "  -T, --timestamp=SOURCE         Time edges with SOURCE, one of realtime,\n"
+         "                                 systimer or cntvct. (Default realtime)\n"
+         "  -M, --monitor=CHIP:LINE        Check GPCLK0 edges against a loopback input\n"
+         "                                 read from a GPIO character device.\n"
+         "  -P, --pps=PATH                 Align edges to the PPS source at PATH,\n"
+         "                                 e.g. /dev/pps0.\n"
+         "  -C, --clock-source=PATH[,SCALE]\n"
+         "                                 Take time from the POSIX clock at PATH instead\n"
+         "                                 of the system clock, e.g. /dev/ptp0. SCALE is\n"
+         "                                 tai (default) or utc.\n"
          "  -v, --verbose                  Enable verbose output.\n"
          "                                 Add multiple times for more output. e.g. -vv\n"
          "  -h, --help                     Print this message and exit.\n",
@@ -307,100 +1005,74 @@ static void sig_handler(int sigNum)
 }
 
 
-static bool get_periodic_schedule(bool *buffSched, size_t buffLen, const char *paramString)
+static void reload_config(const RUNTIME_CONFIG *pBaseConfig, const char *path)
 {
-  if (buffSched == NULL || buffLen < MINUTES_IN_DAY || paramString == NULL)
-    return false;
+  // Settings missing from the file go back to their command line values.
+  RUNTIME_CONFIG *pConfig = malloc(sizeof(RUNTIME_CONFIG));
+  if (pConfig == NULL)
+    return;
+
+  *pConfig = *pBaseConfig;
+  if (!load_runtime_config(pConfig, path) || !runtime_config_publish(pConfig))
+  {
+    fprintf(stderr, "Configuration reload failed. Keeping current configuration.\n");
+    free(pConfig);
+    return;
+  }
+
+  printf("Configuration reloaded from %s\n", path);
+  fflush(stdout);
+}
 
+
+static bool get_time_services(THREAD_DATA *pThreadData, const char *paramString)
+{
   char *paramCopy = strdup(paramString);
   if (paramCopy == NULL)
     return false;
 
-  // The parameter string contains schedule entries separated by a ';'.
-  // Each schedule entry contains a start hour and run time in minutes
-  // separated by a ':'.
-  // For example, if the parameter string is "1:3;15.5:15", then the
-  // schedule entries are 1am for 3 minutes and 3:30pm for 15 minutes.
+  // The parameter string contains up to one time service for each
+  // clock output separated by a ','. e.g. "DCF77,MSF,JJY40"
 
-  char delimOuter[] = ";";
-  char delimInner[] = ":";
+  pThreadData->outputCount = 0;
 
-  memset(buffSched, 0, buffLen);
-
-  char *spOuter = NULL;
-  char *spInner = NULL;
-  for(char *schedEntry = strtok_r(paramCopy, delimOuter, &spOuter);
-      schedEntry != NULL;
-      schedEntry = strtok_r(NULL, delimOuter, &spOuter))
+  bool result = true;
+  char *sp = NULL;
+  for (char *service = strtok_r(paramCopy, ",", &sp);
+       service != NULL;
+       service = strtok_r(NULL, ",", &sp))
   {
-
-    char *startHourString = strtok_r(schedEntry, delimInner, &spInner);
-    if (startHourString == NULL)
-      continue;
-
-    double startHour = 0;
-    if ((sscanf(startHourString, "%lf", &startHour) < 1) || (!(startHour >= 0 && startHour < 24)))
-    {
-      fprintf(stderr, "Error: Invalid schedule start hour (%s).\n", startHourString);
-      continue;
-    }
-
-    char *runMinutesString = strtok_r(NULL, delimInner, &spInner);
-    if (runMinutesString == NULL)
-      continue;
-
-    uint16_t runMinutes = 0;
-    if ((sscanf(runMinutesString, "%" SCNu16, &runMinutes) < 1) || (runMinutes > MINUTES_IN_DAY))
-    {
-      fprintf(stderr, "Error: Invalid schedule run time minutes (%s).\n", runMinutesString);
-      continue;
-    }
-
-    uint16_t startMinute = lround(startHour * 60);
-    if (startMinute >= MINUTES_IN_DAY)
+    if (pThreadData->outputCount >= CLOCK_OUTPUT_COUNT)
     {
-      fprintf(stderr, "Error: Invalid schedule start minute encountered (%" PRIu16 ").\n", startMinute);
-      continue;
+      fprintf(stderr, "Error: At most %d time services can be transmitted.\n", CLOCK_OUTPUT_COUNT);
+      result = false;
+      break;
     }
 
-    for (int i = 0; i < runMinutes; i++)
+    SIGNAL_OUTPUT *pOutput = &pThreadData->outputs[pThreadData->outputCount++];
+    if      (!strcasecmp(service, "DCF77")) { pOutput->timeService = DCF77; pOutput->carrierFrequency = 77500; }
+    else if (!strcasecmp(service, "JJY40")) { pOutput->timeService = JJY;   pOutput->carrierFrequency = 40000; }
+    else if (!strcasecmp(service, "JJY60")) { pOutput->timeService = JJY;   pOutput->carrierFrequency = 60000; }
+    else if (!strcasecmp(service, "MSF"))   { pOutput->timeService = MSF;   pOutput->carrierFrequency = 60000; }
+    else if (!strcasecmp(service, "WWVB"))  { pOutput->timeService = WWVB;  pOutput->carrierFrequency = 60000; }
+    else
     {
-      int idx = (startMinute + i) % MINUTES_IN_DAY;
-      buffSched[idx] = true;
+      result = false;
+      break;
     }
   }
 
   free(paramCopy);
-  return true;
-}
-
-
-static void print_schedule_chart(const bool *buffSched, size_t buffLen)
-{
-  if (buffSched == NULL || buffLen < MINUTES_IN_DAY)
-    return;
-
-  for (int i = 0; i < MINUTES_IN_DAY; i++)
-  {
-    if ((i > 0) && (i % 60 == 0))
-      printf("\n");
-
-    if (i % 60 == 0)
-      printf("%2d:", i / 60);
-
-    if (i % 10 == 0)
-      printf(" ");
-
-    printf("%d", buffSched[i]);
-  }
-
-  printf("\n");
+  return result && pThreadData->outputCount > 0;
 }
 
 
-static bool rt_thread_attr_init(pthread_attr_t *attr)
+static bool rt_thread_attr_init(pthread_attr_t *attr, bool schedDeadline)
 {
+  // With SCHED_DEADLINE the thread is created with the normal policy and
+  // sets its own reservation, which pthread attributes cannot express.
   struct sched_param schedParam = { 0 };
+  int policy = schedDeadline ? SCHED_OTHER : SCHED_FIFO;
 
   if (pthread_attr_init(attr))
   {
@@ -414,13 +1086,13 @@ static bool rt_thread_attr_init(pthread_attr_t *attr)
     return false;
   }
 
-  if (pthread_attr_setschedpolicy(attr, SCHED_FIFO))
+  if (pthread_attr_setschedpolicy(attr, policy))
   {
     fprintf(stderr, "Failed to set thread scheduling policy.\n");
     return false;
   }
 
-  if ((schedParam.sched_priority = sched_get_priority_max(SCHED_FIFO)) == -1)
+  if ((schedParam.sched_priority = sched_get_priority_max(policy)) == -1)
   {
      perror("Failed to get maximum scheduling priority value");
      return false;
@@ -442,13 +1114,41 @@ static bool rt_thread_attr_init(pthread_attr_t *attr)
 }
 
 
+static bool set_sched_deadline(void)
+{
+  // The thread gets its runtime within the deadline of each wake-up, and
+  // runs ahead of every SCHED_FIFO task while it has runtime left. The
+  // kernel refuses the reservation if the CPUs are already committed.
+  SCHED_ATTR attr =
+  {
+    .size = sizeof(SCHED_ATTR),
+    .schedPolicy = SCHED_DEADLINE,
+    .schedRuntime = SCHED_DEADLINE_RUNTIME_NS,
+    .schedDeadline = SCHED_DEADLINE_DEADLINE_NS,
+    .schedPeriod = SCHED_DEADLINE_PERIOD_NS
+  };
+
+  if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0)
+  {
+    perror("Failed to set SCHED_DEADLINE scheduling");
+    return false;
+  }
+
+  return true;
+}
+
+
 static void *thread_carrier_only(void *arg)
 {
   THREAD_DATA threadData = *(THREAD_DATA*)arg;
+  uint32_t outputMask = (1 << threadData.outputCount) - 1;
 
   printf("Starting carrier only thread...\n");
-  printf("Time Service = %s\n", TimeServiceNames[threadData.timeService]);
-  printf("Carrier Frequency = %.4lf kHz\n", threadData.carrierFrequency / 1000.0);
+  for (size_t i = 0; i < threadData.outputCount; i++)
+  {
+    printf("GPCLK%zu: Time Service = %s, Carrier Frequency = %.4lf kHz\n", i,
+           TimeServiceNames[threadData.outputs[i].timeService], threadData.outputs[i].carrierFrequency / 1000.0);
+  }
   printf("\n");
   fflush(stdout);
 
@@ -459,23 +1159,24 @@ static void *thread_carrier_only(void *arg)
     pthread_exit(NULL);
   }
 
-  if (start_clock(threadData.carrierFrequency) <= 0)
+  if (!start_output_clocks(&threadData, NULL, NULL))
   {
     fprintf(stderr, "Failed to start clock.\n");
     _threadRun = 0;
     pthread_exit(NULL);
   }
 
-  enable_clock_output(true);
+  set_clock_outputs(outputMask, outputMask);
+  thread_ready();
 
   while (_threadRun)
   {
     usleep(100);
+    thread_heartbeat(0);
   }
 
   printf("Stopping thread...\n");
-  enable_clock_output(false);
-  stop_clock();
+  stop_output_clocks(&threadData);
 
   pthread_exit(NULL);
 }
@@ -488,24 +1189,55 @@ static void *thread_time_signal(void *arg)
   char dateString[] = "1970-01-01 00:00:00";
   struct timespec targetWait;
 
-  int32_t minuteOffset = lround(threadData.hourOffset * 60);
+  const RUNTIME_CONFIG *pConfig = runtime_config_acquire();
+  uint32_t configGeneration = pConfig->generation;
+  TRANSMIT_STATE tx = { .minuteOffset = lround(pConfig->hourOffset * 60) };
+  uint32_t outputMask = (1 << threadData.outputCount) - 1;
 
   printf("Starting time signal thread...\n");
-  printf("Time Service = %s\n", TimeServiceNames[threadData.timeService]);
-  printf("Carrier Frequency = %.4lf Hz\n", threadData.carrierFrequency / 1000.0);
-  printf("Hour Offset = %.4lf (%d min)\n", threadData.hourOffset, minuteOffset);
+  for (size_t i = 0; i < threadData.outputCount; i++)
+  {
+    printf("GPCLK%zu: Time Service = %s, Carrier Frequency = %.4lf kHz\n", i,
+           TimeServiceNames[threadData.outputs[i].timeService], threadData.outputs[i].carrierFrequency / 1000.0);
+  }
+  printf("Hour Offset = %.4lf (%" PRId32 " min)\n", pConfig->hourOffset, tx.minuteOffset);
   printf("Disable Sanity Checks = %s\n", threadData.disableChecks ? "Yes" : "No");
+  printf("DMA Keying = %s\n", threadData.dmaKeying ? "Yes" : "No");
+  if (threadData.reducedCarrier > 0)
+    printf("Reduced Carrier = %.1lf%% (%.1lf dB) at %" PRIu32 " Hz\n", threadData.reducedCarrier * 100.0,
+           20.0 * log10(threadData.reducedCarrier), threadData.ditherRate);
+  printf("Phase Code = %s\n", threadData.phaseCode ? "Yes" : "No");
+  if (threadData.schedDeadline)
+    printf("Scheduling = SCHED_DEADLINE, Runtime = %.1lf ms, Deadline = %.1lf ms, Period = %.1lf ms\n",
+           SCHED_DEADLINE_RUNTIME_NS / 1e6, SCHED_DEADLINE_DEADLINE_NS / 1e6, SCHED_DEADLINE_PERIOD_NS / 1e6);
+  if (threadData.pClockSource != NULL)
+    printf("Clock Source = %s\n", threadData.pClockSource);
+  if (threadData.cpuLatencyUs >= 0)
+    printf("CPU Latency = %" PRId32 " us\n", threadData.cpuLatencyUs);
+  if (threadData.cpufreqPin)
+    printf("CPU Frequency Pinned = Yes\n");
+  if (pConfig->schedule.preRollMinutes > 0)
+    printf("Pre-Roll = %" PRIu16 " min\n", pConfig->schedule.preRollMinutes);
+  if (threadData.powerDownMinutes > 0)
+    printf("Power Down = %" PRIu32 " min or more, Warm-Up = %" PRIu32 " s\n",
+           threadData.powerDownMinutes, threadData.warmUpSeconds);
   printf("\n");
   fflush(stdout);
 
   if (_verbosityLevel >= 2)
   {
     printf("Run Schedule:\n");
-    print_schedule_chart(threadData.runSchedule, ARRAY_LENGTH(threadData.runSchedule));
+    print_schedule_chart(&pConfig->schedule);
     printf("\n");
     fflush(stdout);
   }
 
+  if (threadData.schedDeadline && !set_sched_deadline())
+  {
+    _threadRun = 0;
+    pthread_exit(NULL);
+  }
+
   if (!gpio_init())
   {
     fprintf(stderr, "Failed to initialize GPIO.\n");
@@ -513,17 +1245,116 @@ static void *thread_time_signal(void *arg)
     pthread_exit(NULL);
   }
 
-  if (start_clock(threadData.carrierFrequency) <= 0)
+  if (!timestamp_init(threadData.timestampSource))
+  {
+    _threadRun = 0;
+    pthread_exit(NULL);
+  }
+
+  if (threadData.timestampSource != TIMESTAMP_REALTIME)
+  {
+    printf("Timestamps: Source = %s, Frequency = %.4lf MHz\n\n",
+           TimestampSourceNames[threadData.timestampSource], get_timestamp_frequency() / 1e6);
+    fflush(stdout);
+  }
+
+  // After a handoff the clocks are left running and keyed as they are,
+  // and keying carries on from the handoff minute.
+  bool adopted = (threadData.handoffMinute != 0 && adopt_output_clocks(&threadData, tx.achievedFrequency));
+  if (threadData.handoffMinute != 0 && !adopted)
+    printf("No running clock to adopt. Starting clock.\n\n");
+
+  if (!adopted && !start_output_clocks(&threadData, tx.achievedFrequency, NULL))
   {
     fprintf(stderr, "Failed to start clock.\n");
     _threadRun = 0;
     pthread_exit(NULL);
   }
 
-  enable_clock_output(false);
+  if (!adopted)
+    set_clock_outputs(outputMask, 0);
+
+  // Edges of all outputs are merged by one scheduler, which is
+  // too large for this thread's small stack.
+  static EDGE_SCHEDULER scheduler;
+  edge_scheduler_init(&scheduler, outputMask);
+
+  // The phase code modulator keeps a history of transmitted chips,
+  // so it is also kept off the stack.
+  static PHASE_MODULATOR phaseModulator;
+  uint64_t phaseTraceCursor = 0;
+  if (threadData.phaseCode && !phase_modulation_init(&phaseModulator, CLOCK_OUTPUT_GP0, PHASE_CODE_DEVIATION))
+  {
+    fprintf(stderr, "Failed to initialize phase modulation.\n");
+    _threadRun = 0;
+  }
+
+  // Edges are keyed early by the typical latency to the register write
+  // landing, so they are on time on average. Adopted clocks are already
+  // keyed by the previous process, so only a saved result is used.
+  EDGE_CALIBRATION calibration = { 0 };
+  bool calibrated = false;
+  if (_threadRun && threadData.calibrationSamples > 0 && !adopted)
+  {
+    int64_t spacingNs = threadData.schedDeadline ? SCHED_DEADLINE_PERIOD_NS : CALIBRATION_SPACING_NS;
+    calibrated = calibrate_edge_latency(outputMask, threadData.calibrationSamples, spacingNs, &calibration);
+    if (calibrated && threadData.pCalibrationFile != NULL &&
+        !save_edge_calibration(threadData.pCalibrationFile, &calibration))
+    {
+      fprintf(stderr, "Failed to save edge calibration to %s.\n", threadData.pCalibrationFile);
+    }
+  }
+  else if (threadData.pCalibrationFile != NULL)
+  {
+    calibrated = load_edge_calibration(threadData.pCalibrationFile, &calibration);
+    if (!calibrated)
+      printf("No saved edge calibration for this host.\n\n");
+  }
+
+  int64_t edgeAdvanceNs = get_edge_advance(&calibration);
+  if (calibrated)
+  {
+    printf("Edge Calibration: Samples = %" PRIu32 ", Min = %.1lf us, Median = %.1lf us, P90 = %.1lf us, "
+           "Max = %.1lf us, Advance = %.1lf us\n\n",
+           calibration.samples, calibration.minNs / 1e3, calibration.medianNs / 1e3,
+           calibration.p90Ns / 1e3, calibration.maxNs / 1e3, edgeAdvanceNs / 1e3);
+    fflush(stdout);
+  }
+
+  // Wake-up latency is measured without and then with the power
+  // management settings, so their benefit on this board can be seen.
+  // They are held from here on only during scheduled windows.
+  if (_threadRun && (threadData.cpuLatencyUs >= 0 || threadData.cpufreqPin) && !adopted)
+  {
+    int64_t spacingNs = threadData.schedDeadline ? SCHED_DEADLINE_PERIOD_NS : CALIBRATION_SPACING_NS;
+    EDGE_CALIBRATION before, after;
+    bool measured = calibrate_edge_latency(outputMask, POWER_LATENCY_SAMPLES, spacingNs, &before);
+    power_latency_hold();
+    if (measured && calibrate_edge_latency(outputMask, POWER_LATENCY_SAMPLES, spacingNs, &after))
+    {
+      printf("Power Latency: Before = %.1lf us median, %.1lf us P90, %.1lf us max; "
+             "After = %.1lf us median, %.1lf us P90, %.1lf us max\n\n",
+             before.medianNs / 1e3, before.p90Ns / 1e3, before.maxNs / 1e3,
+             after.medianNs / 1e3, after.p90Ns / 1e3, after.maxNs / 1e3);
+      fflush(stdout);
+    }
+
+    power_latency_release();
+  }
 
-  time_t currentTime = time(NULL);
+  // With adaptive timing, carrier on and off transitions each have their
+  // own advance, starting from the calibrated one.
+  EDGE_CONTROLLER controllers[EDGE_TRANSITION_COUNT];
+  for (int i = 0; i < EDGE_TRANSITION_COUNT; i++)
+  {
+    edge_controller_init(&controllers[i], edgeAdvanceNs);
+    tx.stats.advanceNs[i] = edgeAdvanceNs;
+  }
+
+  time_t currentTime = reference_time();
   time_t minuteStart = currentTime - (currentTime % 60);  // Round down to start of minute
+  if (threadData.handoffMinute != 0)
+    minuteStart = threadData.handoffMinute;
 
   gmtime_r(&currentTime, &timeParts);
   if (!threadData.disableChecks && (timeParts.tm_year + 1900) < 2020)
@@ -534,81 +1365,893 @@ static void *thread_time_signal(void *arg)
     _threadRun = 0;
   }
 
-  while (_threadRun)
+  // Reduced carrier low periods are dithered at a high rate by this thread.
+  CARRIER_DITHER dither = { .output = CLOCK_OUTPUT_GP0, .level = threadData.reducedCarrier, .rateHz = threadData.ditherRate };
+  bool carrierKeyed = false;
+  bool powerHeld = false;
+  int64_t ppsOffsetNs = 0;
+  bool ppsLocked = false;
+  uint32_t onMask = 0;
+  struct timespec cpuStart, wallStart;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+  clock_gettime(CLOCK_MONOTONIC, &wallStart);
+
+  // Edges of the minute already under way at startup are keyed straight
+  // away, so they are left out of the lateness statistics.
+  int64_t statsStartNs = reference_now_ns();
+
+  // With DMA keying, each minute is loaded into a control block chain half
+  // a minute before it starts, while the previous minute is still running.
+  bool dmaStarted = false;
+  if (_threadRun && threadData.dmaKeying)
+  {
+    if (!dma_keying_init())
+    {
+      fprintf(stderr, "Failed to initialize DMA keying.\n");
+      _threadRun = 0;
+    }
+
+    minuteStart += 60;
+    if (minuteStart - reference_time() < 2)
+      minuteStart += 60;
+  }
+
+  // From here on the thread should never take a page fault. Any counted
+  // in a minute is reported, as something on the keying path has
+  // started touching new memory.
+  prepare_rt_path(&threadData, &tx, outputMask, controllers, minuteStart);
+  __atomic_store_n(&_handoffPrepared, true, __ATOMIC_RELEASE);
+  PAGE_FAULTS lastFaults;
+  bool faultTracking = get_thread_page_faults(&lastFaults);
+
+  while (_threadRun && wait_for_handoff_commit())
   {
-    localtime_r(&minuteStart, &timeParts);
-    long tzOffsetSeconds = timeParts.tm_gmtoff;
-    time_t offsetMinuteStart = minuteStart + tzOffsetSeconds;
-    int minuteOfDay = (offsetMinuteStart % SECONDS_IN_DAY) / 60;
+    if (threadData.dmaKeying)
+    {
+      // Wake between edges, which all fall on a 100 ms grid, so the timing
+      // measurement is not taken while the DMA engine is writing GPFSEL.
+      // Control commands are checked each second until then and take
+      // effect from the next minute loaded.
+      for (time_t t = time(NULL) + 1; _threadRun && t <= minuteStart - 30; t++)
+      {
+        targetWait.tv_sec = t;
+        targetWait.tv_nsec = 50000000;
+        clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+
+        if (t < minuteStart - 30)
+        {
+          handle_control_commands(&threadData, &tx);
+          publish_status(&threadData, &tx);
+        }
+
+        thread_heartbeat(0);
+      }
+
+      if (!_threadRun)
+        break;
+
+      DMA_TIMING dmaTiming;
+      if (dmaStarted && dma_keying_measure(&dmaTiming) && _verbosityLevel >= 1)
+      {
+        printf("DMA Timing: Error = %+.1lf us, Correction = %+" PRId32 " ticks, Tick = %.4lf us, "
+               "Edges = %" PRIu32 ", Blocks = %" PRIu32 "\n",
+               dmaTiming.errorNs / 1e3, dmaTiming.correctionTicks, dmaTiming.tickNs / 1e3,
+               dmaTiming.edgeCount, dmaTiming.blockCount);
+
+        if (is_mock_registers())
+        {
+          printf("DMA Mock Trace: Verified = %" PRIu32 ", Missed = %" PRIu32 ", Unmatched Writes = %" PRIu32 ", "
+                 "Max Error = %+.1lf us\n",
+                 dmaTiming.verifiedEdges, dmaTiming.missedEdges, dmaTiming.unmatchedWrites,
+                 dmaTiming.maxTraceErrorNs / 1e3);
+        }
+
+        fflush(stdout);
+      }
+    }
+
+    // Timestamps are re-anchored once a minute, before any edge is keyed.
+    TIMESTAMP_CORRELATION correlation;
+    if (timestamp_correlate(&correlation) && _verbosityLevel >= 2)
+    {
+      printf("Timestamp Correlation: Step = %+" PRId64 " ns, Rate Error = %+.3lf ppm, Window = %" PRId64 " ns\n",
+             correlation.stepNs, correlation.rateErrorPpm, correlation.windowNs);
+    }
+
+    REFERENCE_CORRELATION reference;
+    if (reference_clock_correlate(&reference) && _verbosityLevel >= 1)
+    {
+      printf("Clock Source: Offset = %+.3lf ms, Rate = %+.3lf ppm, Window = %" PRId64 " ns\n",
+             reference.offsetNs / 1e6, reference.ratePpm, reference.windowNs);
+    }
+
+    PAGE_FAULTS faults;
+    if (faultTracking && get_thread_page_faults(&faults))
+    {
+      uint64_t minorFaults = faults.minor - lastFaults.minor;
+      uint64_t majorFaults = faults.major - lastFaults.major;
+      if (minorFaults > 0 || majorFaults > 0)
+      {
+        fprintf(stderr, "Page fault regression: Minor = %" PRIu64 ", Major = %" PRIu64 " since the last minute.\n",
+                minorFaults, majorFaults);
+        metrics_record_page_faults(minorFaults, majorFaults);
+      }
+
+      lastFaults = faults;
+    }
+
+    // Once handed off, the new process keys from the handoff minute on.
+    // A handoff it never committed to is dropped.
+    if (tx.handoffMinute != 0 && minuteStart >= tx.handoffMinute)
+    {
+      if (tx.handoffCommitted)
+      {
+        _handedOff = true;
+        break;
+      }
+
+      cancel_handoff(&tx);
+    }
+
+    // A reloaded configuration takes effect from the minute being prepared.
+    pConfig = runtime_config_acquire();
+    if (pConfig->generation != configGeneration)
+    {
+      configGeneration = pConfig->generation;
+      tx.minuteOffset = lround(pConfig->hourOffset * 60);
+      _verbosityLevel = pConfig->verbosityLevel;
+
+      if (_verbosityLevel >= 1)
+      {
+        printf("Configuration: Generation = %" PRIu32 ", Hour Offset = %.4lf (%" PRId32 " min), Pre-Roll = %" PRIu16 " min\n",
+               configGeneration, pConfig->hourOffset, tx.minuteOffset, pConfig->schedule.preRollMinutes);
+        fflush(stdout);
+      }
+
+      if (_verbosityLevel >= 2)
+      {
+        printf("Run Schedule:\n");
+        print_schedule_chart(&pConfig->schedule);
+        printf("\n");
+        fflush(stdout);
+      }
+    }
+
+    uint64_t minuteBits[CLOCK_OUTPUT_COUNT] = { 0 };
+    enum ScheduleState scheduleState = get_schedule_state(&pConfig->schedule, minuteStart);
+    bool runMinute = (scheduleState != SCHEDULE_OFF);
 
     if (_verbosityLevel >= 2)
+      printf("Schedule Enabled = %d\n", runMinute);
+
+    // A setting that fails is reported once per window, not every minute.
+    if (runMinute && (threadData.cpuLatencyUs >= 0 || threadData.cpufreqPin) && !powerHeld)
     {
-      printf("Minute Of Day = %d; Schedule Enabled = %d\n",
-             minuteOfDay, threadData.runSchedule[minuteOfDay]);
+      power_latency_hold();
+      powerHeld = true;
+      if (_verbosityLevel >= 1)
+        printf("CPU power management held\n");
     }
 
-    // When we aren't scheduled to run, turn off the
-    // clock output and wait until the next minute.
-    if (!threadData.runSchedule[minuteOfDay])
+    if (runMinute && _verbosityLevel >= 1)
+      print_minute_header(stdout, minuteStart, tx.minuteOffset, scheduleState);
+
+    for (size_t i = 0; runMinute && i < threadData.outputCount; i++)
     {
-      enable_clock_output(false);
-      minuteStart += 60;
+      minuteBits[i] = prepare_minute(threadData.outputs[i].timeService, minuteStart + (tx.minuteOffset * 60));
+      if (minuteBits[i] == (uint64_t)-1)
+      {
+        fprintf(stderr, "Error preparing minute bits.\n");
+        _threadRun = 0;
+        break;
+      }
+    }
+
+    tx.minuteStart = minuteStart;
+    tx.scheduleState = scheduleState;
+    memcpy(tx.minuteBits, minuteBits, sizeof(tx.minuteBits));
+
+    // When we aren't scheduled to run or are paused, the clock outputs
+    // are turned off for the whole minute.
+    enum MinuteKeying minuteKeying = !runMinute ? MINUTE_OFF : tx.paused ? MINUTE_PAUSED :
+                                     tx.carrierOnly ? MINUTE_CARRIER : MINUTE_TIME_SIGNAL;
+    if (!_threadRun || !add_minute_edges(&scheduler, &threadData, minuteStart, minuteBits, minuteKeying))
+    {
+      _threadRun = 0;
+      break;
+    }
+
+    if (minuteKeying == MINUTE_OFF || minuteKeying == MINUTE_PAUSED)
+      tx.stats.minutesOff++;
+    else
+      tx.stats.minutesOn++;
 
-      targetWait.tv_sec = minuteStart;
-      targetWait.tv_nsec = 0;
-      clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+    metrics_set_schedule_state(scheduleState);
+    for (size_t i = 0; i < threadData.outputCount; i++)
+      metrics_record_minute(i, minuteKeying != MINUTE_OFF && minuteKeying != MINUTE_PAUSED);
 
+    if (minuteKeying != MINUTE_TIME_SIGNAL)
+      carrierKeyed = false;
+
+    publish_status(&threadData, &tx);
+
+    if (threadData.dmaKeying)
+    {
+      if (!load_dma_minute(&scheduler, minuteStart))
+      {
+        _threadRun = 0;
+        break;
+      }
+
+      if (!dmaStarted)
+      {
+        if (!(dmaStarted = dma_keying_start(minuteStart)))
+        {
+          _threadRun = 0;
+          break;
+        }
+
+        thread_ready();
+      }
+
+      minuteStart += 60;
       continue;
     }
 
-    if (_verbosityLevel >= 1)
+    // Keying is held by control commands taking effect within the minute,
+    // and after a missed deadline until missHoldNs.
+    bool keyingHeld = false;
+    int64_t missHoldNs = 0;
+    int commandSecond = -1;
+    int phaseSecond = -1;
+    int64_t secondLatenessNs = 0;
+    int64_t ppsErrorSumNs = 0;
+    uint32_t ppsEdges = 0;
+
+    EDGE_GROUP group;
+    while (_threadRun && edge_scheduler_next(&scheduler, &group))
     {
-      localtime_r(&minuteStart, &timeParts);
-      strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
-      printf("%s", dateString);
+      // With PPS alignment, edges are moved to where PPS says the second
+      // is. The last offset is held if the pulses stop. Edges scheduled on
+      // a clock source are slept for on CLOCK_REALTIME.
+      if (threadData.ppsAlign)
+        ppsLocked = get_pps_offset(&ppsOffsetNs);
+      int64_t edgeNs = reference_to_realtime_ns(group.timeNs) + ppsOffsetNs;
+
+      // Low periods of a keyed carrier are dithered when reduced carrier is
+      // enabled. Only a single output is allowed with reduced carrier.
+      enum EdgeTransition transition = (group.changeMask & group.onMask) ? EDGE_TRANSITION_ON : EDGE_TRANSITION_OFF;
+      bool dithered = (dither.level > 0 && carrierKeyed && !(onMask & 0x01));
+      targetWait = NS_TO_TIMESPEC(edgeNs - controllers[transition].advanceNs);
+      if (dithered)
+        dither_carrier_until(&dither, &targetWait);
+      else
+        clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+
+      if (!_threadRun)
+        break;
+
+      // An edge keyed too late would distort its pulse, which receivers
+      // may decode wrongly. Depending on the policy, it is keyed anyway or
+      // the carrier is left on without modulation for the rest of the
+      // second or minute. Keying rejoins with the full output state.
+      int64_t wakeNs = timestamp_now_ns();
+      bool missResume = (missHoldNs != 0 && group.timeNs >= missHoldNs);
+      bool missHeld = (group.timeNs < missHoldNs);
+      if (missResume)
+        missHoldNs = 0;
+
+      if (!keyingHeld && !missHeld && minuteKeying == MINUTE_TIME_SIGNAL && group.timeNs >= statsStartNs &&
+          wakeNs - edgeNs > threadData.deadlineNs)
+      {
+        tx.stats.deadlineMisses[threadData.deadlinePolicy]++;
+        metrics_record_deadline_miss(threadData.deadlinePolicy);
+
+        if (threadData.deadlinePolicy == DEADLINE_SKIP_SECOND)
+          missHoldNs = (group.timeNs / NSEC_PER_SEC + 1) * NSEC_PER_SEC;
+        else if (threadData.deadlinePolicy == DEADLINE_ABANDON_MINUTE)
+          missHoldNs = (minuteStart + 60) * NSEC_PER_SEC;
+
+        missHeld = (missHoldNs != 0);
+        if (missHeld)
+          set_clock_outputs(outputMask, outputMask);
+      }
+
+      // Lateness is taken once the write has landed, as calibrated.
+      if (!keyingHeld && !missHeld)
+        set_clock_outputs(missResume ? outputMask : group.changeMask, group.onMask);
+      int64_t keyedNs = timestamp_now_ns();
+
+      // Edges keyed straight away at startup are checked from when they were keyed.
+      if (!keyingHeld)
+        edge_monitor_expect(group.timeNs >= statsStartNs ? edgeNs : keyedNs,
+                            missHeld || (group.onMask & 0x01));
+
+      onMask = group.onMask;
+      carrierKeyed = (minuteKeying == MINUTE_TIME_SIGNAL && !keyingHeld && !missHeld);
+
+      tx.stats.edgeGroups++;
+      if (group.timeNs >= statsStartNs)
+      {
+        tx.stats.lastLatenessNs = keyedNs - edgeNs;
+        if (threadData.ppsAlign && !keyingHeld && !missHeld && group.timeNs % NSEC_PER_SEC == 0)
+        {
+          ppsErrorSumNs += tx.stats.lastLatenessNs;
+          ppsEdges++;
+        }
+
+        if (tx.stats.lastLatenessNs > tx.stats.maxLatenessNs)
+          tx.stats.maxLatenessNs = tx.stats.lastLatenessNs;
+        if (tx.stats.lastLatenessNs > EDGE_LATE_NS)
+          tx.stats.lateGroups++;
+
+        metrics_record_edge(tx.stats.lastLatenessNs, tx.stats.lastLatenessNs > EDGE_LATE_NS);
+
+        if (tx.stats.lastLatenessNs > secondLatenessNs)
+          secondLatenessNs = tx.stats.lastLatenessNs;
+        if (tx.stats.lastLatenessNs <= EDGE_LATE_NS)
+          thread_ready();
+
+        // Edges ending a dithered period wake from the dither loop rather
+        // than the timer, so they do not adjust the advance.
+        if (threadData.adaptiveTiming && !keyingHeld && !missHeld && !dithered)
+        {
+          EDGE_CONTROLLER *pCtl = &controllers[transition];
+          edge_controller_update(pCtl, tx.stats.lastLatenessNs);
+          tx.stats.advanceNs[transition] = pCtl->advanceNs;
+          tx.stats.meanErrorNs[transition] = llround(pCtl->meanErrorNs);
+          tx.stats.frozenEdges = controllers[EDGE_TRANSITION_ON].frozenEdges + controllers[EDGE_TRANSITION_OFF].frozenEdges;
+        }
+      }
 
-      if (minuteOffset != 0)
+      // The DCF77 phase code is sent once per second, from the first group
+      // of the second that leaves the carrier on. That is the end of the
+      // amplitude pulse, or the second boundary of second 59.
+      int second = group.timeNs / NSEC_PER_SEC - minuteStart;
+      uint64_t chipBits[PHASE_CODE_WORDS];
+      if (threadData.phaseCode && !keyingHeld && !missHeld && second != phaseSecond && (group.onMask & 0x01) &&
+          get_phase_code_for_second(threadData.outputs[0].timeService, minuteBits[0], second, chipBits))
       {
-        time_t t = minuteStart + (minuteOffset * 60);
-        localtime_r(&t, &timeParts);
+        phaseSecond = second;
+        modulate_phase_for_second(&phaseModulator, minuteStart + second, chipBits);
+      }
+
+      // Control commands are checked once per second, after the edge.
+      // A pause or forced carrier holds the outputs for the rest of the
+      // minute, and resuming restores the keyed state.
+      if (second != commandSecond)
+      {
+        commandSecond = second;
+        reference_clock_correlate(&reference);
+        if (handle_control_commands(&threadData, &tx))
+        {
+          keyingHeld = (tx.paused || tx.carrierOnly);
+          uint32_t heldMask = tx.paused ? 0 : ((tx.carrierOnly || missHeld) && runMinute) ? outputMask : onMask;
+          set_clock_outputs(outputMask, heldMask);
+          edge_monitor_expect(timestamp_now_ns(), heldMask & 0x01);
+          carrierKeyed = (minuteKeying == MINUTE_TIME_SIGNAL && !keyingHeld && !missHeld);
+        }
+
+        publish_status(&threadData, &tx);
+        thread_heartbeat(secondLatenessNs);
+        secondLatenessNs = 0;
+      }
+    }
+
+    // Off windows are slept through in one go. A schedule that never
+    // turns on is checked again once a day.
+    if (!runMinute)
+    {
+      if (powerHeld)
+      {
+        power_latency_release();
+        powerHeld = false;
+        if (_verbosityLevel >= 1)
+          printf("CPU power management released\n");
+      }
+
+      time_t nextStart = get_next_schedule_run(&pConfig->schedule, minuteStart);
+      if (nextStart <= minuteStart)
+        nextStart = minuteStart + SECONDS_IN_DAY;
+
+      if (_verbosityLevel >= 1)
+      {
+        localtime_r(&nextStart, &timeParts);
         strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
-        printf(" --> %s", dateString);
+        printf("Schedule off until %s", dateString);
+
+        if (get_schedule_state(&pConfig->schedule, nextStart) == SCHEDULE_PRE_ROLL)
+        {
+          time_t windowStart = get_next_schedule_transition(&pConfig->schedule, nextStart);
+          localtime_r(&windowStart, &timeParts);
+          strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
+          printf(" (Pre-Roll, Window Starts %s)", dateString);
+        }
+
+        printf("\n");
+        fflush(stdout);
+      }
+
+      minuteStart = nextStart;
+
+      // Long off windows stop the clocks altogether. They are restarted
+      // early enough to be stable before the first edge of the window.
+      // A configuration reload cuts the sleep short so the new schedule
+      // is checked from the next minute.
+      bool reloaded = false;
+      if (threadData.powerDownMinutes > 0 && minuteStart - reference_time() >= threadData.powerDownMinutes * 60)
+      {
+        stop_output_clocks(&threadData);
+        tx.poweredDown = true;
+        publish_status(&threadData, &tx);
+
+        if (_verbosityLevel >= 1)
+        {
+          printf("Clock powered down\n");
+          fflush(stdout);
+        }
+
+        reloaded = !sleep_off_window(&threadData, &tx, pConfig, minuteStart - threadData.warmUpSeconds);
+
+        if (!_threadRun)
+          break;
+
+        // The outputs are off, so a handoff needn't wait for its minute.
+        if (tx.handoffCommitted)
+        {
+          _handedOff = true;
+          break;
+        }
+
+        double stableUs = 0;
+        if (!start_output_clocks(&threadData, tx.achievedFrequency, &stableUs))
+        {
+          fprintf(stderr, "Failed to restart clock.\n");
+          _threadRun = 0;
+          break;
+        }
+
+        tx.poweredDown = false;
+        publish_status(&threadData, &tx);
+
+        if (threadData.phaseCode && !phase_modulation_init(&phaseModulator, CLOCK_OUTPUT_GP0, PHASE_CODE_DEVIATION))
+        {
+          fprintf(stderr, "Failed to initialize phase modulation.\n");
+          _threadRun = 0;
+          break;
+        }
+
+        if (_verbosityLevel >= 1)
+        {
+          printf("Clock Warm-Up: Start To Stable = %.1lf us, Margin = %.3lf s\n",
+                 stableUs, (double)minuteStart - reference_now_ns() / 1e9);
+          fflush(stdout);
+        }
+      }
+
+      if (!reloaded)
+        reloaded = !sleep_off_window(&threadData, &tx, pConfig, minuteStart);
+
+      if (tx.handoffCommitted && _threadRun)
+      {
+        _handedOff = true;
+        break;
       }
 
-      printf("\n");
+      if (reloaded)
+      {
+        currentTime = reference_time();
+        minuteStart = currentTime - (currentTime % 60) + 60;
+        if (minuteStart - reference_time() < 2)
+          minuteStart += 60;
+      }
+
+      continue;
+    }
+
+    if (threadData.outputCount > 1 && _verbosityLevel >= 1)
+    {
+      printf("Edge Scheduler: Edges = %" PRIu64 ", Writes = %" PRIu64 "\n", scheduler.edgesOut, scheduler.groupsOut);
       fflush(stdout);
+
+      scheduler.edgesOut = 0;
+      scheduler.groupsOut = 0;
     }
 
-    uint64_t minuteBits = prepare_minute(threadData.timeService, minuteStart + (minuteOffset * 60));
-    if (minuteBits == (uint64_t)-1)
+    // Second marker error is the keyed time against the PPS edge.
+    if (threadData.ppsAlign)
     {
-      fprintf(stderr, "Error preparing minute bits.\n");
-      _threadRun = 0;
+      PPS_STATUS pps;
+      get_pps_status(&pps);
+      metrics_set_pps(ppsOffsetNs, ppsLocked);
+
+      if (_verbosityLevel >= 1)
+      {
+        printf("PPS: Offset = %+.1lf us, Jitter = %.1lf us, Pulses = %" PRIu64 ", Rejected = %" PRIu64
+               ", Second Edge Error = %+.1lf us%s\n",
+               ppsOffsetNs / 1e3, pps.jitterNs / 1e3, pps.pulses, pps.rejected,
+               ppsEdges > 0 ? (double)ppsErrorSumNs / ppsEdges / 1e3 : 0.0,
+               ppsLocked ? "" : pps.pulses > 0 ? " (Holdover)" : " (No Pulses)");
+        fflush(stdout);
+      }
+    }
+
+    if (threadData.adaptiveTiming && _verbosityLevel >= 1)
+      print_edge_timing(stdout, controllers, tx.stats.frozenEdges);
+
+    if (threadData.phaseCode && _verbosityLevel >= 1)
+    {
+      printf("Phase Code: Steps = %" PRIu64 ", Late = %" PRIu64 ", Divisors = %.4lf / %.4lf / %.4lf\n",
+             phaseModulator.steps, phaseModulator.lateSteps, phaseModulator.slowDivisor / 1024.0,
+             phaseModulator.baseDivisor / 1024.0, phaseModulator.fastDivisor / 1024.0);
+
+      PHASE_VERIFY phaseVerify;
+      if (is_mock_registers() && verify_phase_trace(&phaseModulator, &phaseTraceCursor, &phaseVerify))
+      {
+        printf("Phase Trace: Chips = %" PRIu32 ", Errors = %" PRIu32 ", Mean Phase = %.2lf deg, RMS Error = %.2lf deg\n",
+               phaseVerify.chips, phaseVerify.chipErrors, phaseVerify.meanAbsDegrees, phaseVerify.rmsErrorDegrees);
+      }
+
+      fflush(stdout);
+      phaseModulator.steps = 0;
+      phaseModulator.lateSteps = 0;
+    }
+
+    if (dither.level > 0 && dither.lowTimeNs > 0 && _verbosityLevel >= 1)
+    {
+      // CPU cost covers this whole thread, which is idle apart from dithering.
+      struct timespec cpuNow, wallNow;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuNow);
+      clock_gettime(CLOCK_MONOTONIC, &wallNow);
+      double cpuPercent = (double)(TIMESPEC_TO_NS(cpuNow) - TIMESPEC_TO_NS(cpuStart)) /
+                          (TIMESPEC_TO_NS(wallNow) - TIMESPEC_TO_NS(wallStart)) * 100.0;
+      double achieved = (double)dither.onTimeNs / dither.lowTimeNs;
+
+      printf("Reduced Carrier: Target = %.2lf%%, Achieved = %.2lf%% (Error = %+.2lf%%), "
+             "Steps = %" PRIu64 ", Late = %" PRIu64 ", CPU = %.2lf%%\n",
+             dither.level * 100.0, achieved * 100.0, (achieved - dither.level) * 100.0,
+             dither.steps, dither.lateSteps, cpuPercent);
+      fflush(stdout);
+
+      dither.steps = 0;
+      dither.lateSteps = 0;
+      dither.onTimeNs = 0;
+      dither.lowTimeNs = 0;
+      cpuStart = cpuNow;
+      wallStart = wallNow;
+    }
+
+    minuteStart += 60;
+  }
+
+  printf("Stopping thread...\n");
+  if (threadData.dmaKeying)
+    dma_keying_stop();
+
+  power_latency_release();
+
+  if (_handedOff)
+  {
+    printf("Handed off. Leaving clock running.\n");
+    _threadRun = 0;
+  }
+  else if (adopted && __atomic_load_n(&_handoffPending, __ATOMIC_ACQUIRE))
+  {
+    printf("Handoff not committed. Leaving clock to the running process.\n");
+  }
+  else
+  {
+    stop_output_clocks(&threadData);
+  }
+
+  pthread_exit(NULL);
+}
+
+
+static bool start_output_clocks(const THREAD_DATA *pThreadData, double *pFrequencies, double *pStableUs)
+{
+  // Starts every clock and waits for each to be running from its source.
+  // The frequencies set up and the time from the first start until all
+  // are stable are returned.
+  struct timespec start, stable;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+  {
+    double frequency = start_clock(i, pThreadData->outputs[i].carrierFrequency);
+    if (frequency <= 0)
+      return false;
+
+    if (pFrequencies != NULL)
+      pFrequencies[i] = frequency;
+
+    metrics_set_clock(i, TimeServiceNames[pThreadData->outputs[i].timeService],
+                      pThreadData->outputs[i].carrierFrequency, frequency, get_clock_source_name(i));
+  }
+
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+  {
+    if (!wait_clock_stable(i, CLOCK_STABLE_TIMEOUT_US))
+    {
+      fprintf(stderr, "Error: GPCLK%zu did not become stable.\n", i);
+      return false;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &stable);
+  if (pStableUs != NULL)
+    *pStableUs = (TIMESPEC_TO_NS(stable) - TIMESPEC_TO_NS(start)) / 1e3;
+
+  return true;
+}
+
+
+static bool adopt_output_clocks(const THREAD_DATA *pThreadData, double *pFrequencies)
+{
+  // Takes over clocks left running by a process that handed off.
+  // Either every output is adopted or none is.
+  double frequencies[CLOCK_OUTPUT_COUNT];
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+  {
+    frequencies[i] = adopt_clock(i, pThreadData->outputs[i].carrierFrequency);
+    if (frequencies[i] <= 0)
+      return false;
+  }
+
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+  {
+    pFrequencies[i] = frequencies[i];
+    metrics_set_clock(i, TimeServiceNames[pThreadData->outputs[i].timeService],
+                      pThreadData->outputs[i].carrierFrequency, frequencies[i], get_clock_source_name(i));
+  }
+
+  return true;
+}
+
+
+static void stop_output_clocks(const THREAD_DATA *pThreadData)
+{
+  set_clock_outputs((1 << pThreadData->outputCount) - 1, 0);
+
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+    stop_clock(i);
+}
+
+
+static bool handle_control_commands(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState)
+{
+  // Applies queued control commands and answers requests.
+  // Returns true if pause or forced carrier changed.
+  bool paused = pState->paused;
+  bool carrierOnly = pState->carrierOnly;
+
+  CONTROL_COMMAND command;
+  CONTROL_REPLY reply;
+  while (control_command_pop(&command))
+  {
+    if (apply_control_command(pThreadData, pState, &command, &reply))
+      control_reply_push(&reply);
+  }
+
+  __atomic_store_n(&_handoffAgreed, pState->handoffMinute != 0, __ATOMIC_RELEASE);
+
+  return (paused != pState->paused || carrierOnly != pState->carrierOnly);
+}
+
+
+static bool apply_control_command(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState,
+                                  const CONTROL_COMMAND *pCommand, CONTROL_REPLY *pReply)
+{
+  // Returns true with *pReply filled in if the command is answered.
+  switch (pCommand->type)
+  {
+    case CONTROL_PAUSE:       pState->paused = true;       break;
+    case CONTROL_RESUME:      pState->paused = false;      break;
+    case CONTROL_CARRIER_ON:  pState->carrierOnly = true;  break;
+    case CONTROL_CARRIER_OFF: pState->carrierOnly = false; break;
+
+    // The new process takes over at the first minute boundary that
+    // leaves it time to start. Handoff minute zero is a refusal.
+    case CONTROL_HANDOFF:
+    {
+      time_t now = reference_time();
+      if (pState->handoffMinute == 0 && !pThreadData->dmaKeying)
+      {
+        pState->handoffMinute = now - (now % 60) + 60;
+        if (pState->handoffMinute - now < HANDOFF_MARGIN_SEC)
+          pState->handoffMinute += 60;
+      }
+
+      *pReply = (CONTROL_REPLY){ .requestId = pCommand->requestId, .type = pCommand->type, .minuteStart = pState->handoffMinute };
+      return true;
+    }
+
+    // The new process is ready to key. Committed before the handoff
+    // minute, the handoff can no longer be dropped.
+    case CONTROL_HANDOFF_COMMIT:
+    {
+      if (pState->handoffMinute != 0 && reference_time() < pState->handoffMinute)
+        pState->handoffCommitted = true;
+
+      *pReply = (CONTROL_REPLY){ .requestId = pCommand->requestId, .type = pCommand->type,
+                                 .minuteStart = pState->handoffCommitted ? pState->handoffMinute : 0 };
+      return true;
+    }
+
+    // Kept until the next configuration reload.
+    case CONTROL_OFFSET:
+      pState->minuteOffset = lround(pCommand->hourOffset * 60);
       break;
+
+    case CONTROL_FRAME:
+    case CONTROL_STATS:
+    {
+      *pReply = (CONTROL_REPLY)
+      {
+        .requestId = pCommand->requestId,
+        .type = pCommand->type,
+        .minuteStart = pState->minuteStart,
+        .minuteOffset = pState->minuteOffset,
+        .scheduleState = pState->scheduleState,
+        .paused = pState->paused,
+        .carrierOnly = pState->carrierOnly,
+        .outputCount = pThreadData->outputCount,
+        .stats = pState->stats
+      };
+
+      for (size_t i = 0; i < pThreadData->outputCount; i++)
+      {
+        pReply->timeServices[i] = pThreadData->outputs[i].timeService;
+        pReply->minuteBits[i] = pState->minuteBits[i];
+      }
+
+      return true;
     }
+  }
 
-    for (int second = 0; second < 60; second++)
+  return false;
+}
+
+
+static void publish_status(const THREAD_DATA *pThreadData, const TRANSMIT_STATE *pState)
+{
+  // The status page belongs to the new process once a handoff is agreed,
+  // and to the running process until ours is committed.
+  if (pState->handoffMinute != 0 || __atomic_load_n(&_handoffPending, __ATOMIC_ACQUIRE))
+    return;
+
+  TRANSMIT_STATUS *pStatus = status_page_begin();
+  if (pStatus == NULL)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  pStatus->updateTimeNs = TIMESPEC_TO_NS(now);
+  pStatus->minuteStart = pState->minuteStart;
+  pStatus->minuteOffset = pState->minuteOffset;
+  pStatus->scheduleState = pState->scheduleState;
+  pStatus->flags = (pState->paused ? STATUS_FLAG_PAUSED : 0) |
+                   (pState->carrierOnly ? STATUS_FLAG_CARRIER_ONLY : 0) |
+                   (pState->poweredDown ? STATUS_FLAG_POWERED_DOWN : 0) |
+                   (pThreadData->dmaKeying ? STATUS_FLAG_DMA_KEYING : 0);
+  pStatus->outputCount = pThreadData->outputCount;
+
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+  {
+    pStatus->outputs[i].timeService = pThreadData->outputs[i].timeService;
+    pStatus->outputs[i].requestedFrequency = pThreadData->outputs[i].carrierFrequency;
+    pStatus->outputs[i].achievedFrequency = pState->achievedFrequency[i];
+    pStatus->outputs[i].minuteBits = pState->minuteBits[i];
+  }
+
+  pStatus->minutesOn = pState->stats.minutesOn;
+  pStatus->minutesOff = pState->stats.minutesOff;
+  pStatus->edgeGroups = pState->stats.edgeGroups;
+  pStatus->lateGroups = pState->stats.lateGroups;
+  pStatus->lastLatenessNs = pState->stats.lastLatenessNs;
+  pStatus->maxLatenessNs = pState->stats.maxLatenessNs;
+  pStatus->advanceOnNs = pState->stats.advanceNs[EDGE_TRANSITION_ON];
+  pStatus->advanceOffNs = pState->stats.advanceNs[EDGE_TRANSITION_OFF];
+  pStatus->meanErrorOnNs = pState->stats.meanErrorNs[EDGE_TRANSITION_ON];
+  pStatus->meanErrorOffNs = pState->stats.meanErrorNs[EDGE_TRANSITION_OFF];
+  pStatus->stretchedEdges = pState->stats.deadlineMisses[DEADLINE_STRETCH];
+  pStatus->skippedSeconds = pState->stats.deadlineMisses[DEADLINE_SKIP_SECOND];
+  pStatus->abandonedMinutes = pState->stats.deadlineMisses[DEADLINE_ABANDON_MINUTE];
+
+  status_page_end();
+}
+
+
+static bool sleep_off_window(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState,
+                             const RUNTIME_CONFIG *pConfig, time_t wakeTime)
+{
+  // Returns true at wakeTime, or false if stopping, the configuration
+  // was reloaded or a handoff was committed. Control commands are handled
+  // as they arrive. There is nothing to key until wakeTime, so the
+  // watchdog is fed until then. A wakeTime on a clock source is slept for
+  // on CLOCK_REALTIME. A handoff left uncommitted at its minute is
+  // dropped.
+  time_t realtimeWake = reference_to_realtime_ns((int64_t)wakeTime * NSEC_PER_SEC) / NSEC_PER_SEC;
+  bool woken = !pState->handoffCommitted;
+  thread_ready();
+  __atomic_store_n(&_threadHealth.sleepingUntil, realtimeWake, __ATOMIC_RELEASE);
+
+  while (woken)
+  {
+    time_t sleepUntil = realtimeWake;
+    if (pState->handoffMinute != 0 && pState->handoffMinute < wakeTime)
+      sleepUntil = reference_to_realtime_ns((int64_t)pState->handoffMinute * NSEC_PER_SEC) / NSEC_PER_SEC;
+
+    if (runtime_config_sleep_until(sleepUntil))
     {
-      if (!_threadRun)
+      if (sleepUntil == realtimeWake)
         break;
 
-      int modulation = get_modulation_for_second(threadData.timeService, minuteBits, second);
-      if (modulation < 0)
+      cancel_handoff(pState);
+      continue;
+    }
+
+    if (!_threadRun || runtime_config_changed(pConfig))
+    {
+      woken = false;
+      break;
+    }
+
+    handle_control_commands(pThreadData, pState);
+    publish_status(pThreadData, pState);
+    woken = !pState->handoffCommitted;
+  }
+
+  __atomic_store_n(&_threadHealth.sleepingUntil, 0, __ATOMIC_RELEASE);
+  thread_heartbeat(0);
+
+  return woken;
+}
+
+
+static bool add_minute_edges(EDGE_SCHEDULER *pSched, const THREAD_DATA *pThreadData, time_t minuteStart,
+                             const uint64_t *minuteBits, enum MinuteKeying keying)
+{
+  int64_t minuteStartNs = minuteStart * NSEC_PER_SEC;
+
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+  {
+    enum TimeService timeService = pThreadData->outputs[i].timeService;
+
+    // Unscheduled minutes are keyed as a single carrier off edge.
+    if (keying == MINUTE_OFF)
+    {
+      if (!edge_scheduler_add(pSched, i, minuteStartNs, false))
+        return false;
+
+      continue;
+    }
+
+    // Paused and carrier only minutes repeat their state every second,
+    // so control commands are still checked once per second.
+    if (keying != MINUTE_TIME_SIGNAL)
+    {
+      for (int second = 0; second < 60; second++)
       {
-        fprintf(stderr, "Error getting modulation time.\n");
-        _threadRun = 0;
-        break;
+        if (!edge_scheduler_add(pSched, i, minuteStartNs + second * NSEC_PER_SEC, keying == MINUTE_CARRIER))
+          return false;
       }
 
-      // Wait until we reach the beginning of the current second
-      targetWait.tv_sec = minuteStart + second;
-      targetWait.tv_nsec = 0;
-      clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+      continue;
+    }
 
-      if (threadData.timeService == JJY)
-        enable_clock_output(true);
-      else
-        enable_clock_output(false);
+    if (_verbosityLevel >= 2 && pThreadData->outputCount > 1)
+      printf("GPCLK%zu:\n", i);
+
+    for (int second = 0; second < 60; second++)
+    {
+      int modulation = get_modulation_for_second(timeService, minuteBits[i], second);
+      if (modulation < 0)
+      {
+        fprintf(stderr, "Error getting modulation time.\n");
+        return false;
+      }
 
       if (_verbosityLevel >= 2)
       {
@@ -616,25 +2259,206 @@ static void *thread_time_signal(void *arg)
 
         if ((second + 1) % 15 == 0)
           printf("\n");
+      }
 
-        fflush(stdout);
+      // A second without amplitude modulation still gets a group at its
+      // boundary, repeating the carrier state, for the phase code to start from.
+      int64_t secondStartNs = minuteStartNs + second * NSEC_PER_SEC;
+      if (modulation == 0)
+      {
+        if (pThreadData->phaseCode && i == 0 && !edge_scheduler_add(pSched, i, secondStartNs, timeService != JJY))
+          return false;
+
+        continue;
       }
 
-      targetWait.tv_nsec = modulation * 1e6;
-      clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &targetWait, NULL);
+      // JJY keys the carrier on at the start of each second, all others key it off.
+      if (!edge_scheduler_add(pSched, i, secondStartNs, timeService == JJY) ||
+          !edge_scheduler_add(pSched, i, secondStartNs + modulation * 1000000LL, timeService != JJY))
+      {
+        return false;
+      }
+    }
+  }
 
-      if (threadData.timeService == JJY)
-        enable_clock_output(false);
-      else
-        enable_clock_output(true);
+  if (_verbosityLevel >= 2)
+    fflush(stdout);
+
+  return true;
+}
+
+
+static bool load_dma_minute(EDGE_SCHEDULER *pSched, time_t minuteStart)
+{
+  static DMA_EDGE edges[DMA_MAX_EDGES];
+  size_t edgeCount = 0;
+  EDGE_GROUP group;
+
+  // Each coalesced group is a single GPFSEL write holding the state of all
+  // outputs. The other pins in GPFSEL0 are written back as they are now, so
+  // any change to their functions during the minute is undone.
+  while (edge_scheduler_next(pSched, &group))
+  {
+    if (edgeCount >= DMA_MAX_EDGES)
+    {
+      fprintf(stderr, "Error: Too many DMA keying edges in minute.\n");
+      return false;
     }
 
-    minuteStart += 60;
+    uint32_t offsetUs = (group.timeNs - minuteStart * NSEC_PER_SEC) / 1000;
+    edges[edgeCount++] = (DMA_EDGE){ offsetUs, get_clock_outputs_fsel(pSched->outputMask, group.onMask) };
   }
 
-  printf("Stopping thread...\n");
-  enable_clock_output(false);
-  stop_clock();
+  return dma_keying_load_minute(minuteStart, edges, edgeCount);
+}
 
-  pthread_exit(NULL);
+
+static void print_minute_header(FILE *pStream, time_t minuteStart, int32_t minuteOffset, enum ScheduleState scheduleState)
+{
+  struct tm timeParts;
+  char dateString[] = "1970-01-01 00:00:00";
+
+  localtime_r(&minuteStart, &timeParts);
+  strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
+  fprintf(pStream, "%s", dateString);
+
+  if (minuteOffset != 0)
+  {
+    time_t t = minuteStart + (minuteOffset * 60);
+    localtime_r(&t, &timeParts);
+    strftime(dateString, sizeof(dateString), "%Y-%m-%d %H:%M:%S", &timeParts);
+    fprintf(pStream, " --> %s", dateString);
+  }
+
+  if (scheduleState == SCHEDULE_PRE_ROLL)
+    fprintf(pStream, " (Pre-Roll)");
+
+  fprintf(pStream, "\n");
+  fflush(pStream);
+}
+
+
+static void print_edge_timing(FILE *pStream, const EDGE_CONTROLLER *pControllers, uint64_t frozenEdges)
+{
+  fprintf(pStream, "Edge Timing: Advance On = %.1lf us, Off = %.1lf us, Mean Error On = %+.1lf us, Off = %+.1lf us, "
+         "Frozen = %" PRIu64 "\n",
+         pControllers[EDGE_TRANSITION_ON].advanceNs / 1e3, pControllers[EDGE_TRANSITION_OFF].advanceNs / 1e3,
+         pControllers[EDGE_TRANSITION_ON].meanErrorNs / 1e3, pControllers[EDGE_TRANSITION_OFF].meanErrorNs / 1e3,
+         frozenEdges);
+  fflush(pStream);
+}
+
+
+static void prepare_rt_path(const THREAD_DATA *pThreadData, TRANSMIT_STATE *pState, uint32_t outputMask,
+                            const EDGE_CONTROLLER *pControllers, time_t minuteStart)
+{
+  // Builds and walks one real minute ahead of the first edge, so the code,
+  // data and time zone file the per-minute path touches are faulted in
+  // while nothing is being keyed. Output writes leave every pin as it is,
+  // the log lines are printed to /dev/null and a scratch command is
+  // applied to a copy of the state. The whole stack is prefaulted too, as
+  // memory locking only covers pages that have been mapped.
+  size_t stackBytes = prefault_thread_stack();
+  FILE *pNull = fopen("/dev/null", "we");
+
+  tzset();
+  if (pNull != NULL)
+    print_minute_header(pNull, minuteStart, pState->minuteOffset, SCHEDULE_PRE_ROLL);
+
+  // The scratch scheduler is as large as the real one, so is kept off the stack.
+  static EDGE_SCHEDULER scratch;
+  edge_scheduler_init(&scratch, outputMask);
+
+  uint64_t minuteBits[CLOCK_OUTPUT_COUNT] = { 0 };
+  for (size_t i = 0; i < pThreadData->outputCount; i++)
+    minuteBits[i] = prepare_minute(pThreadData->outputs[i].timeService, minuteStart + (pState->minuteOffset * 60));
+
+  EDGE_GROUP group;
+  if (add_minute_edges(&scratch, pThreadData, minuteStart, minuteBits, MINUTE_TIME_SIGNAL))
+  {
+    while (edge_scheduler_next(&scratch, &group))
+      ;
+  }
+
+  // None of the outputs are changed, and the monitor ignores an
+  // expectation matching the state it last expected.
+  set_clock_outputs(0, 0);
+  edge_monitor_expect(timestamp_now_ns(), false);
+  publish_status(pThreadData, pState);
+
+  TRANSMIT_STATE scratchState = *pState;
+  CONTROL_COMMAND scratchCommand = { .type = CONTROL_STATS };
+  CONTROL_REPLY scratchReply;
+  apply_control_command(pThreadData, &scratchState, &scratchCommand, &scratchReply);
+
+  if (pNull != NULL)
+  {
+    print_edge_timing(pNull, pControllers, pState->stats.frozenEdges);
+    fclose(pNull);
+  }
+
+  if (_verbosityLevel >= 1)
+  {
+    printf("RT Prepare: Stack Prefaulted = %zu bytes\n\n", stackBytes);
+    fflush(stdout);
+  }
+}
+
+
+static void thread_heartbeat(int64_t latenessNs)
+{
+  // Called by the thread only. Lateness is stored before the heartbeat
+  // so the main thread never pairs a new heartbeat with stale lateness.
+  __atomic_store_n(&_threadHealth.latenessNs, latenessNs, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&_threadHealth.heartbeat, 1, __ATOMIC_RELEASE);
+}
+
+
+static void thread_ready(void)
+{
+  __atomic_store_n(&_threadHealth.ready, true, __ATOMIC_RELEASE);
+}
+
+
+static bool is_thread_healthy(uint64_t *pLastHeartbeat)
+{
+  // The thread is healthy if it has advanced its heartbeat since the last
+  // check with edges on time, or is sleeping through an off window that
+  // has not overrun.
+  uint64_t heartbeat = __atomic_load_n(&_threadHealth.heartbeat, __ATOMIC_ACQUIRE);
+  int64_t latenessNs = __atomic_load_n(&_threadHealth.latenessNs, __ATOMIC_RELAXED);
+  time_t sleepingUntil = __atomic_load_n(&_threadHealth.sleepingUntil, __ATOMIC_ACQUIRE);
+
+  bool advanced = (heartbeat != *pLastHeartbeat);
+  *pLastHeartbeat = heartbeat;
+
+  if (sleepingUntil != 0 && time(NULL) <= sleepingUntil + WATCHDOG_SLEEP_GRACE_SEC)
+    return true;
+
+  return advanced && latenessNs <= WATCHDOG_LATE_NS;
+}
+
+
+static bool wait_for_handoff_commit(void)
+{
+  // Called by the thread only. The outputs stay with the running process
+  // until the main thread has committed the handoff. Returns false if it
+  // could not be committed.
+  struct timespec pollWait = { .tv_sec = 0, .tv_nsec = 10000000 };
+  while (_threadRun && __atomic_load_n(&_handoffPending, __ATOMIC_ACQUIRE))
+  {
+    thread_heartbeat(0);
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &pollWait, NULL);
+  }
+
+  return _threadRun;
+}
+
+
+static void cancel_handoff(TRANSMIT_STATE *pState)
+{
+  // The new process never committed, so this one carries on keying.
+  fprintf(stderr, "Handoff not committed by the new process. Carrying on.\n");
+  pState->handoffMinute = 0;
+  __atomic_store_n(&_handoffAgreed, false, __ATOMIC_RELEASE);
 }
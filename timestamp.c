@@ -0,0 +1,247 @@
+/*
+timestamp.c - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "macros.h"
+#include "clock-control.h"
+#include "timestamp.h"
+
+
+// Edge timing is measured with a free-running hardware counter rather than
+// clock_gettime, so the measurement adds little overhead or jitter of its
+// own. The counter is correlated with CLOCK_REALTIME once a minute, and its
+// rate is measured between correlations so it follows the clock discipline.
+
+#define TIMESTAMP_SYSTEM_TIMER_HZ 1000000.0
+#define CORRELATION_TRIES         5           // Narrowest read window is kept
+#define CORRELATION_INITIAL_NS    1000000000  // Rate is first measured over 1 s
+#define RATE_MIN_INTERVAL_NS      1000000000  // Shorter intervals keep the last rate
+
+
+const char * const TimestampSourceNames[TIMESTAMP_SOURCE_COUNT] =
+{
+  [TIMESTAMP_REALTIME]     = "realtime",
+  [TIMESTAMP_SYSTEM_TIMER] = "systimer",
+  [TIMESTAMP_ARM_COUNTER]  = "cntvct"
+};
+
+
+// Only used by the real-time thread, so no synchronization is needed.
+static enum TimestampSource _source = TIMESTAMP_REALTIME;
+static double _nominalNsPerTick = 0;
+static double _nsPerTick = 0;
+static uint64_t _baseTicks = 0;
+static int64_t _baseNs = 0;
+
+
+static bool read_counter(uint64_t *pTicks);
+static bool read_counter_frequency(double *pFrequency);
+static bool correlate(uint64_t *pTicks, int64_t *pRealtimeNs, int64_t *pWindowNs);
+
+
+static bool read_counter(uint64_t *pTicks)
+{
+  if (_source == TIMESTAMP_SYSTEM_TIMER)
+    return read_system_timer(pTicks);
+
+#if defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+  *pTicks = ticks;
+  return true;
+#elif defined(__arm__) && defined(__ARM_ARCH) && __ARM_ARCH >= 7
+  uint64_t ticks;
+  __asm__ volatile("isb\n\tmrrc p15, 1, %Q0, %R0, c14" : "=r"(ticks) :: "memory");
+  *pTicks = ticks;
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+static bool read_counter_frequency(double *pFrequency)
+{
+  if (_source == TIMESTAMP_SYSTEM_TIMER)
+  {
+    *pFrequency = TIMESTAMP_SYSTEM_TIMER_HZ;
+    return true;
+  }
+
+  uint64_t frequency = 0;
+#if defined(__aarch64__)
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+#elif defined(__arm__) && defined(__ARM_ARCH) && __ARM_ARCH >= 7
+  uint32_t frequency32;
+  __asm__ volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(frequency32));
+  frequency = frequency32;
+#endif
+
+  *pFrequency = frequency;
+  return (frequency > 0);
+}
+
+
+static bool correlate(uint64_t *pTicks, int64_t *pRealtimeNs, int64_t *pWindowNs)
+{
+  // CLOCK_REALTIME is read between two counter reads and paired with their
+  // midpoint, keeping the narrowest of a few tries.
+  CLOCK_BRACKET tries[CORRELATION_TRIES];
+
+  for (int i = 0; i < CORRELATION_TRIES; i++)
+  {
+    uint64_t before, after;
+    struct timespec now;
+
+    if (!read_counter(&before))
+      return false;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if (!read_counter(&after))
+      return false;
+
+    tries[i] = (CLOCK_BRACKET){ .before = before, .reading = TIMESPEC_TO_NS(now), .after = after };
+  }
+
+  const CLOCK_BRACKET *pBest = narrowest_bracket(tries, CORRELATION_TRIES);
+  *pTicks = (uint64_t)pBest->before + (uint64_t)(pBest->after - pBest->before) / 2;
+  *pRealtimeNs = pBest->reading;
+  *pWindowNs = (int64_t)((uint64_t)(pBest->after - pBest->before) * _nominalNsPerTick);
+  return true;
+}
+
+
+bool timestamp_init(enum TimestampSource source)
+{
+  // Clock registers must already be mapped for the system timer. The rate
+  // is measured over a first second, with the counter checked to be running.
+  _source = source;
+  if (source == TIMESTAMP_REALTIME)
+    return true;
+
+  double frequency;
+  uint64_t ticks;
+  if (!read_counter_frequency(&frequency) || !read_counter(&ticks))
+  {
+    fprintf(stderr, "Error: Timestamp source %s is not available.\n", TimestampSourceNames[source]);
+    _source = TIMESTAMP_REALTIME;
+    return false;
+  }
+
+  _nominalNsPerTick = NSEC_PER_SEC / frequency;
+  _nsPerTick = _nominalNsPerTick;
+
+  int64_t windowNs;
+  if (!correlate(&_baseTicks, &_baseNs, &windowNs))
+  {
+    _source = TIMESTAMP_REALTIME;
+    return false;
+  }
+
+  struct timespec wait = NS_TO_TIMESPEC(CORRELATION_INITIAL_NS);
+  clock_nanosleep(CLOCK_MONOTONIC, 0, &wait, NULL);
+
+  TIMESTAMP_CORRELATION correlation;
+  if (!timestamp_correlate(&correlation) || _nsPerTick <= 0)
+  {
+    fprintf(stderr, "Error: Timestamp source %s is not counting.\n", TimestampSourceNames[source]);
+    _source = TIMESTAMP_REALTIME;
+    return false;
+  }
+
+  return true;
+}
+
+
+bool timestamp_correlate(TIMESTAMP_CORRELATION *pCorrelation)
+{
+  // Re-anchors the counter to CLOCK_REALTIME, taking the rate over the
+  // interval since the last correlation.
+  if (_source == TIMESTAMP_REALTIME)
+    return false;
+
+  uint64_t ticks;
+  int64_t realtimeNs;
+  int64_t windowNs;
+  if (!correlate(&ticks, &realtimeNs, &windowNs))
+    return false;
+
+  int64_t extrapolatedNs = _baseNs + (int64_t)((int64_t)(ticks - _baseTicks) * _nsPerTick);
+  int64_t intervalNs = realtimeNs - _baseNs;
+  if (intervalNs >= RATE_MIN_INTERVAL_NS && ticks > _baseTicks)
+    _nsPerTick = (double)intervalNs / (ticks - _baseTicks);
+
+  _baseTicks = ticks;
+  _baseNs = realtimeNs;
+
+  pCorrelation->stepNs = extrapolatedNs - realtimeNs;
+  pCorrelation->rateErrorPpm = (_nsPerTick / _nominalNsPerTick - 1.0) * 1e6;
+  pCorrelation->windowNs = windowNs;
+  return true;
+}
+
+
+int64_t timestamp_now_ns(void)
+{
+  // Returns CLOCK_REALTIME in ns, extrapolated from the counter when one
+  // is in use.
+  uint64_t ticks;
+  if (_source == TIMESTAMP_REALTIME || !read_counter(&ticks))
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return TIMESPEC_TO_NS(now);
+  }
+
+  return _baseNs + (int64_t)((int64_t)(ticks - _baseTicks) * _nsPerTick);
+}
+
+
+enum TimestampSource get_timestamp_source(void)
+{
+  return _source;
+}
+
+
+double get_timestamp_frequency(void)
+{
+  return (_source == TIMESTAMP_REALTIME) ? 0 : NSEC_PER_SEC / _nominalNsPerTick;
+}
+
+
+const CLOCK_BRACKET *narrowest_bracket(const CLOCK_BRACKET *pBrackets, int count)
+{
+  // The read with the least time between its bracketing reads was least
+  // disturbed, so it is the best pairing of the two clocks.
+  const CLOCK_BRACKET *pBest = &pBrackets[0];
+  for (int i = 1; i < count; i++)
+  {
+    if (pBrackets[i].after - pBrackets[i].before < pBest->after - pBest->before)
+      pBest = &pBrackets[i];
+  }
+
+  return pBest;
+}
@@ -0,0 +1,62 @@
+/*
+timestamp.h - part of time-signal
+DCF77/JJY/MSF/WWVB radio transmitter for Raspberry Pi
+
+Copyright (C) 2024 Steve Matos
+Source: https://github.com/steve1515/time-signal
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __TIMESTAMP_H__
+#define __TIMESTAMP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum TimestampSource
+{
+  TIMESTAMP_REALTIME,      // clock_gettime(CLOCK_REALTIME)
+  TIMESTAMP_SYSTEM_TIMER,  // BCM 1 MHz system timer (Pi 1 to 4)
+  TIMESTAMP_ARM_COUNTER,   // ARM generic timer virtual count (CNTVCT)
+  TIMESTAMP_SOURCE_COUNT
+};
+
+typedef struct
+{
+  int64_t stepNs;       // Extrapolated minus correlated time at the correlation
+  double rateErrorPpm;  // Counter rate error against CLOCK_REALTIME
+  int64_t windowNs;     // Width of the CLOCK_REALTIME read between counter reads
+} TIMESTAMP_CORRELATION;
+
+// One clock read between two reads of another. Before and after are in
+// the units of the bracketing clock.
+typedef struct
+{
+  int64_t before;
+  int64_t reading;
+  int64_t after;
+} CLOCK_BRACKET;
+
+extern const char * const TimestampSourceNames[TIMESTAMP_SOURCE_COUNT];
+
+bool timestamp_init(enum TimestampSource source);
+bool timestamp_correlate(TIMESTAMP_CORRELATION *pCorrelation);
+int64_t timestamp_now_ns(void);
+enum TimestampSource get_timestamp_source(void);
+double get_timestamp_frequency(void);
+const CLOCK_BRACKET *narrowest_bracket(const CLOCK_BRACKET *pBrackets, int count);
+
+#endif  // __TIMESTAMP_H__